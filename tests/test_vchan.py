@@ -20,11 +20,19 @@
 
 import unittest
 import socket
+import select
+import os
+import errno
 from concurrent.futures import ThreadPoolExecutor
 import time
 
-from .vchan import VchanServer, VchanClient, \
-    VCHAN_WAITING, VCHAN_DISCONNECTED, VCHAN_CONNECTED
+from .vchan import VchanServer, VchanClient, VchanException, \
+    VCHAN_WAITING, VCHAN_DISCONNECTED, VCHAN_CONNECTED, LIBVCHAN_NO_THREAD, \
+    LIBVCHAN_CREDITS, LIBVCHAN_MULTI_WRITER, LIBVCHAN_RATE_READ, LIBVCHAN_RATE_WRITE, \
+    LIBVCHAN_PREFAULT, LIBVCHAN_MLOCK, \
+    LIBVCHAN_NUMA_DEFAULT, LIBVCHAN_NUMA_THREAD, LIBVCHAN_FORWARD_BOTH, \
+    LIBVCHAN_PUMP_HANGUP, LIBVCHAN_PUMP_THREAD, \
+    LIBVCHAN_POLLIN, LIBVCHAN_POLLOUT, LIBVCHAN_POLLHUP
 
 # default buffer size for server and client
 BUF_SIZE = 4096
@@ -112,11 +120,36 @@ class SimpleVchanServerTest(VchanServerTest):
         self.assertEqual(server.buffer_space(), 0)
         sock = self.connect(server)
         server.wait_for_state(VCHAN_CONNECTED)
-        self.assertEqual(server.buffer_space(), 1)
+        space = server.buffer_space()
+        self.assertGreater(space, BUF_SIZE)
+        server.write(SAMPLE)
+        self.assertLess(server.buffer_space(), space)
         sock.close()
         server.wait_for_state(VCHAN_DISCONNECTED)
         self.assertEqual(server.buffer_space(), 0)
 
+    def test_buffered_buffer_space(self):
+        server = self.start_server()
+        server.set_buffered_writes(True)
+        self.assertEqual(server.buffer_space(), BUF_SIZE)
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        space = server.buffer_space()
+        self.assertGreater(space, BUF_SIZE)
+        data = BIG_SAMPLE * (space // len(BIG_SAMPLE) + 1)
+        self.assertEqual(server.write(data[:space]), space)
+        self.assertEqual(
+            sock.recv(space, socket.MSG_WAITALL), data[:space])
+
+    def test_buffered_write_then_connect(self):
+        server = self.start_server()
+        server.set_buffered_writes(True)
+        self.assertEqual(server.write(SAMPLE), len(SAMPLE))
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.buffer_space()
+        self.assertEqual(sock.recv(len(SAMPLE)), SAMPLE)
+
     @unittest.skip('not possible in simple implementation')
     def test_write_then_connect(self):
         pass
@@ -156,10 +189,1397 @@ class VchanBufferTest(unittest.TestCase, VchanTestMixin):
         self.assertEqual(server.read(BUF_SIZE),
                          BIG_SAMPLE[:BUF_SIZE])
 
+    def test_write_order(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        # more than the socket buffers, so that some data gets queued
+        chunks = [bytes([i % 256]) * BUF_SIZE for i in range(256)]
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(
+                sock.recv, BUF_SIZE * len(chunks), socket.MSG_WAITALL)
+            for chunk in chunks:
+                server.send(chunk)
+            self.assertEqual(future.result(), b''.join(chunks))
+
+    def test_read_lowat(self):
+        server = self.start_server()
+        server.set_read_lowat(len(SAMPLE) * 2)
+        sock = self.connect(server)
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(server.read, BUF_SIZE)
+            sock.send(SAMPLE)
+            time.sleep(0.1)
+            self.assertFalse(future.done())
+            sock.send(SAMPLE)
+            self.assertEqual(future.result(), SAMPLE * 2)
+
+    def test_read_lowat_disconnect(self):
+        server = self.start_server()
+        server.set_read_lowat(len(SAMPLE) * 2)
+        sock = self.connect(server)
+        sock.send(SAMPLE)
+        sock.close()
+        self.assertEqual(server.read(BUF_SIZE), SAMPLE)
+
+
+class VchanCorkTest(unittest.TestCase, VchanTestMixin):
+    def assertNothingReceived(self, sock):
+        sock.settimeout(0.1)
+        with self.assertRaises(socket.timeout):
+            sock.recv(BUF_SIZE)
+        sock.settimeout(None)
+
+    def test_cork(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.cork()
+        server.write(SAMPLE)
+        server.write(SAMPLE)
+        self.assertNothingReceived(sock)
+        server.uncork()
+        self.assertEqual(sock.recv(len(SAMPLE) * 2, socket.MSG_WAITALL),
+                         SAMPLE * 2)
+
+    def test_cork_full(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.cork()
+        self.assertEqual(server.write(BIG_SAMPLE), BUF_SIZE)
+        self.assertEqual(sock.recv(BUF_SIZE, socket.MSG_WAITALL),
+                         BIG_SAMPLE[:BUF_SIZE])
+
+    def test_autoflush_bytes(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.set_autoflush(len(SAMPLE) * 2, 0)
+        server.write(SAMPLE)
+        self.assertNothingReceived(sock)
+        server.write(SAMPLE)
+        self.assertEqual(sock.recv(len(SAMPLE) * 2, socket.MSG_WAITALL),
+                         SAMPLE * 2)
+
+    def test_autoflush_usec(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.set_autoflush(0, 200000)
+        server.write(SAMPLE)
+        self.assertNothingReceived(sock)
+        sock.settimeout(1)
+        self.assertEqual(sock.recv(len(SAMPLE)), SAMPLE)
+
+    def test_autoflush_many(self):
+        # Each flush notifies socket_event_pipe, more often than it can hold,
+        # and nothing drains it when the channel only writes
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.set_autoflush(1, 0)
+        for _ in range(70000):
+            server.send(SAMPLE)
+            self.assertEqual(sock.recv(len(SAMPLE), socket.MSG_WAITALL),
+                             SAMPLE)
+        self.assertEqual(server.state(), VCHAN_CONNECTED)
+
+class SimpleVchanCorkTest(VchanCorkTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    @unittest.skip('no I/O thread to flush in the background')
+    def test_autoflush_usec(self):
+        pass
+
+    def test_autoflush_before_read(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.set_autoflush(0, 1000000)
+        server.write(SAMPLE)
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(server.read, len(SAMPLE))
+            self.assertEqual(sock.recv(len(SAMPLE)), SAMPLE)
+            sock.send(SAMPLE)
+            self.assertEqual(future.result(), SAMPLE)
+
 
 class SimpleVchanBufferTest(VchanBufferTest):
     lib = 'vchan-simple/libvchan-socket-simple.so'
 
+    def test_send_big(self):
+        # reads bypass read_ring, so they are not limited by its size
+        server = self.start_server()
+        sock = self.connect(server)
+        sock.send(BIG_SAMPLE[:BUF_SIZE+10])
+        self.assertEqual(server.recv(BUF_SIZE+10), BIG_SAMPLE[:BUF_SIZE+10])
+
+    def test_recv_bigger_than_buffer(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(server.recv, len(BIG_SAMPLE))
+            sock.send(BIG_SAMPLE[:BUF_SIZE])
+            time.sleep(0.1)
+            sock.send(BIG_SAMPLE[BUF_SIZE:])
+            self.assertEqual(future.result(), BIG_SAMPLE)
+
+    def test_recv_disconnect(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        sock.send(SAMPLE)
+        sock.close()
+        with self.assertRaises(VchanException):
+            server.recv(len(SAMPLE) * 2)
+        self.assertEqual(server.read(len(SAMPLE) * 2), SAMPLE)
+
+
+class VchanEventTest(unittest.TestCase, VchanTestMixin):
+    def assertReadable(self, fd, readable=True):
+        rlist, _, _ = select.select([fd], [], [], 0.1 if readable else 0)
+        self.assertEqual(bool(rlist), readable)
+
+    def test_fd_for_read(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        self.assertReadable(server.fd_for_read(), False)
+        sock.send(SAMPLE)
+        self.assertReadable(server.fd_for_read())
+        self.assertEqual(server.read(len(SAMPLE)), SAMPLE)
+        self.assertReadable(server.fd_for_read(), False)
+        sock.close()
+        self.assertReadable(server.fd_for_read())
+
+    def test_fd_for_write(self):
+        server = self.start_server()
+        self.assertReadable(server.fd_for_write())
+        server.send(BIG_SAMPLE[:BUF_SIZE])
+        self.assertReadable(server.fd_for_write(), False)
+        sock = self.connect(server)
+        self.assertEqual(sock.recv(BUF_SIZE, socket.MSG_WAITALL),
+                         BIG_SAMPLE[:BUF_SIZE])
+        self.assertReadable(server.fd_for_write())
+
+    def test_full_duplex(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.send(BIG_SAMPLE[:BUF_SIZE])
+        with ThreadPoolExecutor() as executor:
+            read_future = executor.submit(server.recv, len(SAMPLE))
+            write_future = executor.submit(server.send, SAMPLE)
+            time.sleep(0.1)
+            sock.send(SAMPLE)
+            self.assertEqual(read_future.result(), SAMPLE)
+            self.assertEqual(
+                sock.recv(BUF_SIZE + len(SAMPLE), socket.MSG_WAITALL),
+                BIG_SAMPLE[:BUF_SIZE] + SAMPLE)
+            self.assertEqual(write_future.result(), len(SAMPLE))
+
+
+class VchanThreadlessTest(unittest.TestCase, VchanTestMixin):
+    def start_server(self):
+        server = VchanServer(self.lib, 1, 2, 42, flags=LIBVCHAN_NO_THREAD)
+        self.addCleanup(server.close)
+        return server
+
+    def test_connect_and_read(self):
+        server = self.start_server()
+        self.assertEqual(server.state(), VCHAN_WAITING)
+        sock = self.connect(server)
+        sock.send(SAMPLE)
+        self.assertEqual(server.read(len(SAMPLE)), SAMPLE)
+
+    def test_connect_and_write(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        self.assertEqual(server.write(SAMPLE), len(SAMPLE))
+        self.assertEqual(sock.recv(len(SAMPLE)), SAMPLE)
+
+    def test_process(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        rlist, _, _ = select.select([server.fd_for_select()], [], [], 1)
+        self.assertTrue(rlist)
+        self.assertEqual(server.process(), select.POLLIN)
+        self.assertEqual(server.state(), VCHAN_CONNECTED)
+        sock.send(SAMPLE)
+        rlist, _, _ = select.select([server.fd_for_select()], [], [], 1)
+        self.assertTrue(rlist)
+        server.process()
+        self.assertEqual(server.data_ready(), len(SAMPLE))
+        sock.close()
+        server.wait_for_state(VCHAN_DISCONNECTED)
+
+    def test_client(self):
+        server = self.start_server()
+        client = VchanClient(self.lib, 2, 1, 42, flags=LIBVCHAN_NO_THREAD)
+        self.addCleanup(client.close)
+        client.write(SAMPLE)
+        self.assertEqual(server.read(len(SAMPLE)), SAMPLE)
+
+
+class SimpleVchanThreadlessTest(VchanThreadlessTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+
+class VchanPollTest(unittest.TestCase, VchanTestMixin):
+    def start_servers(self, flags=0):
+        servers = []
+        socks = []
+        for port in (42, 43):
+            server = VchanServer(self.lib, 1, 2, port, flags=flags)
+            self.addCleanup(server.close)
+            servers.append(server)
+            socks.append(self.connect(server))
+        return servers, socks
+
+    def test_poll_read(self):
+        servers, socks = self.start_servers()
+        socks[1].send(SAMPLE)
+        self.assertEqual(
+            servers[0].poll([(server, LIBVCHAN_POLLIN) for server in servers]),
+            [0, LIBVCHAN_POLLIN])
+        self.assertEqual(servers[1].read(len(SAMPLE)), SAMPLE)
+
+    def test_poll_timeout(self):
+        servers, _socks = self.start_servers()
+        start = time.monotonic()
+        self.assertEqual(
+            servers[0].poll([(server, LIBVCHAN_POLLIN) for server in servers],
+                            100),
+            [0, 0])
+        self.assertGreaterEqual(time.monotonic() - start, 0.09)
+
+    def test_poll_write(self):
+        servers, _socks = self.start_servers()
+        for server in servers:
+            server.wait_for_state(VCHAN_CONNECTED)
+        self.assertEqual(
+            servers[0].poll([(servers[0], LIBVCHAN_POLLOUT)]),
+            [LIBVCHAN_POLLOUT])
+
+    def test_poll_write_lowat(self):
+        # A mark larger than the buffer is capped at its size
+        servers, _socks = self.start_servers()
+        servers[0].wait_for_state(VCHAN_CONNECTED)
+        servers[0].set_buffered_writes(True)
+        servers[0].set_write_lowat(1024 * 1024 * 1024)
+        self.assertEqual(
+            servers[0].poll([(servers[0], LIBVCHAN_POLLOUT)], 1000),
+            [LIBVCHAN_POLLOUT])
+
+    def test_poll_hup(self):
+        servers, socks = self.start_servers()
+        socks[0].close()
+        revents = servers[0].poll(
+            [(server, LIBVCHAN_POLLIN) for server in servers], 1000)
+        self.assertEqual(revents, [LIBVCHAN_POLLHUP, 0])
+
+    def test_poll_hup_only(self):
+        servers, socks = self.start_servers()
+        for server in servers:
+            server.wait_for_state(VCHAN_CONNECTED)
+        socks[1].close()
+        revents = servers[0].poll(
+            [(server, LIBVCHAN_POLLHUP) for server in servers], 1000)
+        self.assertEqual(revents, [0, LIBVCHAN_POLLHUP])
+
+    def test_poll_threadless(self):
+        servers, socks = self.start_servers(flags=LIBVCHAN_NO_THREAD)
+        socks[0].send(SAMPLE)
+        self.assertEqual(
+            servers[0].poll([(server, LIBVCHAN_POLLIN) for server in servers],
+                            1000),
+            [LIBVCHAN_POLLIN, 0])
+        self.assertEqual(servers[0].read(len(SAMPLE)), SAMPLE)
+
+
+class SimpleVchanPollTest(VchanPollTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+
+class VchanTimeoutTest(unittest.TestCase, VchanTestMixin):
+    def assertTimesOut(self, func, *args, error=errno.ETIMEDOUT):
+        with self.assertRaises(VchanException) as cm:
+            func(*args)
+        self.assertEqual(cm.exception.errno, error)
+
+    def start_connected_server(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        # Clear the pending connection event
+        try:
+            server.wait_timeout(0)
+        except VchanException:
+            pass
+        return server, sock
+
+    def test_read_timeout(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.set_timeout(100)
+        start = time.monotonic()
+        self.assertTimesOut(server.read, len(SAMPLE))
+        self.assertGreaterEqual(time.monotonic() - start, 0.09)
+        sock.send(SAMPLE)
+        self.assertEqual(server.read(len(SAMPLE)), SAMPLE)
+
+    def test_recv_timeout(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.set_timeout(100)
+        sock.send(SAMPLE[:5])
+        self.assertTimesOut(server.recv, len(SAMPLE))
+        sock.send(SAMPLE[5:])
+        self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+
+    def test_nonblocking(self):
+        server, sock = self.start_connected_server()
+        server.set_timeout(0)
+        self.assertTimesOut(server.read, len(SAMPLE), error=errno.EAGAIN)
+        self.assertTimesOut(server.wait_timeout, 0, error=errno.EAGAIN)
+        sock.send(SAMPLE)
+        server.wait_timeout(1000)
+        self.assertEqual(server.read(len(SAMPLE)), SAMPLE)
+
+    def test_send_timeout(self):
+        server, sock = self.start_connected_server()
+        server.set_timeout(100)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, BUF_SIZE)
+        # Fill up the socket and the buffer
+        with self.assertRaises(VchanException) as cm:
+            while True:
+                server.send(BIG_SAMPLE)
+        self.assertEqual(cm.exception.errno, errno.ETIMEDOUT)
+
+    def test_wait_timeout(self):
+        server, _sock = self.start_connected_server()
+        start = time.monotonic()
+        self.assertTimesOut(server.wait_timeout, 100)
+        self.assertGreaterEqual(time.monotonic() - start, 0.09)
+
+
+class SimpleVchanTimeoutTest(VchanTimeoutTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def test_send_started(self):
+        # A message that has started going out is finished past the timeout
+        server, sock = self.start_connected_server()
+        server.set_timeout(0)
+        data = os.urandom(1024 * 1024)
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(sock.recv, len(data), socket.MSG_WAITALL)
+            try:
+                self.assertEqual(server.send(data), len(data))
+            finally:
+                server.close()
+            self.assertEqual(future.result(), data)
+
+    def test_send_whole(self):
+        # With little space, a message is queued whole or not at all
+        server, sock = self.start_connected_server()
+        server.set_timeout(0)
+        written = 0
+        with self.assertRaises(VchanException) as cm:
+            while True:
+                written += server.write(BIG_SAMPLE)
+        self.assertEqual(cm.exception.errno, errno.EAGAIN)
+        received = len(sock.recv(BUF_SIZE * 2, socket.MSG_WAITALL))
+        for _ in range(10):
+            try:
+                written += server.send(SAMPLE * 100)
+            except VchanException as e:
+                self.assertEqual(e.errno, errno.EAGAIN)
+        # Closing sends out the rest
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(server.close)
+            while True:
+                chunk = sock.recv(1024 * 1024)
+                if not chunk:
+                    break
+                received += len(chunk)
+            future.result()
+        self.assertEqual(received, written)
+
+
+class VchanAsyncTest(unittest.TestCase, VchanTestMixin):
+    def test_submit_read(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        size = len(BIG_SAMPLE) * 4
+        server.submit_read(1, size)
+        server.submit_read(2, len(SAMPLE))
+        sock.sendall(BIG_SAMPLE * 4 + SAMPLE)
+        completions = server.wait_for_completions(2)
+        self.assertEqual([(tag, result) for tag, result, _ in completions],
+                         [(1, size), (2, len(SAMPLE))])
+        self.assertEqual(server.ffi.unpack(completions[0][2], size),
+                         BIG_SAMPLE * 4)
+        self.assertEqual(server.ffi.unpack(completions[1][2], len(SAMPLE)),
+                         SAMPLE)
+
+    def test_submit_write(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.write(SAMPLE)
+        server.submit_write(1, BIG_SAMPLE * 4)
+        server.submit_write(2, SAMPLE)
+        self.assertEqual(server.write(SAMPLE), len(SAMPLE))
+        size = len(SAMPLE) * 3 + len(BIG_SAMPLE) * 4
+        self.assertEqual(sock.recv(size, socket.MSG_WAITALL),
+                         SAMPLE + BIG_SAMPLE * 4 + SAMPLE + SAMPLE)
+        completions = server.wait_for_completions(2)
+        self.assertEqual([(tag, result) for tag, result, _ in completions],
+                         [(1, len(BIG_SAMPLE) * 4), (2, len(SAMPLE))])
+
+    def test_disconnect(self):
+        server = self.start_server()
+        sock = self.connect(server)
+        server.submit_read(1, len(SAMPLE) * 2)
+        sock.send(SAMPLE)
+        sock.close()
+        completions = server.wait_for_completions(1)
+        self.assertEqual([(tag, result) for tag, result, _ in completions],
+                         [(1, len(SAMPLE))])
+        with self.assertRaises(VchanException) as cm:
+            server.submit_read(2, len(SAMPLE))
+        self.assertEqual(cm.exception.errno, errno.EPIPE)
+
+
+class SimpleVchanAsyncTest(unittest.TestCase, VchanTestMixin):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def test_not_supported(self):
+        server = self.start_server()
+        with self.assertRaises(VchanException) as cm:
+            server.submit_read(1, len(SAMPLE))
+        self.assertEqual(cm.exception.errno, errno.ENOTSUP)
+
+
+class VchanCreditTest(unittest.TestCase, VchanTestMixin):
+    flags = LIBVCHAN_CREDITS
+
+    def start_pair(self):
+        server = VchanServer(self.lib, 1, 2, 42, flags=self.flags)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42, flags=self.flags)
+        self.addCleanup(client.close)
+        return server, client
+
+    def test_buffer_space(self):
+        server, client = self.start_pair()
+        # Nothing can be sent before the server advertises its buffer
+        client.wait_for(lambda: client.buffer_space() == BUF_SIZE)
+        self.assertEqual(client.write(BIG_SAMPLE), BUF_SIZE)
+        self.assertEqual(client.buffer_space(), 0)
+        server.wait_for(lambda: server.data_ready() == BUF_SIZE)
+        self.assertEqual(client.buffer_space(), 0)
+
+        self.assertEqual(server.read(100), BIG_SAMPLE[:100])
+        client.wait_for(lambda: client.buffer_space() == 100)
+
+    def test_transfer(self):
+        server, client = self.start_pair()
+        data = BIG_SAMPLE * 8
+
+        def write_all():
+            written = 0
+            while written < len(data):
+                written += client.write(data[written:])
+            return written
+
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(write_all)
+            received = b''
+            while len(received) < len(data):
+                received += server.read(len(data) - len(received))
+            self.assertEqual(future.result(), len(data))
+        self.assertEqual(received, data)
+        self.assertEqual(server.send(SAMPLE), len(SAMPLE))
+        self.assertEqual(client.recv(len(SAMPLE)), SAMPLE)
+
+    def test_threadless(self):
+        server = VchanServer(self.lib, 1, 2, 42,
+                             flags=self.flags | LIBVCHAN_NO_THREAD)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42, flags=self.flags)
+        self.addCleanup(client.close)
+        with ThreadPoolExecutor() as executor:
+            # Blocks until the server sends credits
+            future = executor.submit(client.send, SAMPLE)
+            self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+            self.assertEqual(future.result(), len(SAMPLE))
+        self.assertEqual(server.send(SAMPLE), len(SAMPLE))
+        self.assertEqual(client.recv(len(SAMPLE)), SAMPLE)
+
+
+class SimpleVchanCreditTest(unittest.TestCase, VchanTestMixin):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def test_not_supported(self):
+        with self.assertRaises(VchanException):
+            VchanServer(self.lib, 1, 2, 42, flags=LIBVCHAN_CREDITS)
+
+
+class VchanStreamTest(unittest.TestCase, VchanTestMixin):
+    def start_pair(self, flags=LIBVCHAN_CREDITS):
+        server = VchanServer(self.lib, 1, 2, 42, flags=flags)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42, flags=flags)
+        self.addCleanup(client.close)
+        return server, client
+
+    def test_streams(self):
+        server, client = self.start_pair()
+        server.stream_open(1, BUF_SIZE, BUF_SIZE, priority=1)
+        client.stream_open(1, BUF_SIZE, BUF_SIZE, priority=1)
+
+        # Stream 0 is full, but stream 1 still gets through
+        client.wait_for(lambda: client.buffer_space() == BUF_SIZE)
+        self.assertEqual(client.write(BIG_SAMPLE), BUF_SIZE)
+        client.wait_for(lambda: client.stream_buffer_space(1) == BUF_SIZE)
+        self.assertEqual(client.stream_send(1, SAMPLE), len(SAMPLE))
+        self.assertEqual(server.stream_recv(1, len(SAMPLE)), SAMPLE)
+
+        self.assertEqual(server.stream_recv(0, BUF_SIZE),
+                         BIG_SAMPLE[:BUF_SIZE])
+        self.assertEqual(server.stream_data_ready(1), 0)
+        self.assertEqual(server.stream_send(1, SAMPLE), len(SAMPLE))
+        self.assertEqual(client.stream_recv(1, len(SAMPLE)), SAMPLE)
+
+    def test_errors(self):
+        server, client = self.start_pair()
+        with self.assertRaises(VchanException) as cm:
+            server.stream_open(0, BUF_SIZE, BUF_SIZE)
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+        with self.assertRaises(VchanException) as cm:
+            server.stream_send(1, SAMPLE)
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+        server.stream_open(1, BUF_SIZE, BUF_SIZE)
+        with self.assertRaises(VchanException) as cm:
+            server.stream_open(1, BUF_SIZE, BUF_SIZE)
+        self.assertEqual(cm.exception.errno, errno.EEXIST)
+
+        # Streams need credits
+        plain = VchanServer(self.lib, 1, 2, 43)
+        self.addCleanup(plain.close)
+        with self.assertRaises(VchanException) as cm:
+            plain.stream_open(1, BUF_SIZE, BUF_SIZE)
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+
+    def test_threadless(self):
+        server, client = self.start_pair(
+            flags=LIBVCHAN_CREDITS | LIBVCHAN_NO_THREAD)
+        server.stream_open(2, BUF_SIZE, BUF_SIZE)
+        client.stream_open(2, BUF_SIZE, BUF_SIZE)
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(client.stream_send, 2, SAMPLE)
+            self.assertEqual(server.stream_recv(2, len(SAMPLE)), SAMPLE)
+            self.assertEqual(future.result(), len(SAMPLE))
+
+
+class SimpleVchanStreamTest(unittest.TestCase, VchanTestMixin):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def test_not_supported(self):
+        server = self.start_server()
+        with self.assertRaises(VchanException) as cm:
+            server.stream_open(1, BUF_SIZE, BUF_SIZE)
+        self.assertEqual(cm.exception.errno, errno.ENOTSUP)
+
+
+class VchanBatchTest(unittest.TestCase, VchanTestMixin):
+    def start_pair(self):
+        server = VchanServer(self.lib, 1, 2, 42)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+        return server, client
+
+    def test_small_messages(self):
+        server, client = self.start_pair()
+        messages = [b'message %d;' % i for i in range(100)]
+        data = b''.join(messages)
+        self.assertEqual(server.send_batch(messages), (len(data), 100))
+        self.assertEqual(client.recv(len(data)), data)
+
+    def test_whole_messages(self):
+        server, client = self.start_pair()
+        messages = [bytes([i]) * 3000 for i in range(3)]
+        size, sent = server.send_batch(messages)
+        self.assertGreaterEqual(sent, 1)
+        self.assertEqual(size, 3000 * sent)
+        self.assertEqual(client.recv(size), b''.join(messages[:sent]))
+
+        with self.assertRaises(VchanException) as cm:
+            server.send_batch([BIG_SAMPLE * 4] + messages)
+        self.assertEqual(cm.exception.errno, errno.EMSGSIZE)
+
+
+class SimpleVchanBatchTest(VchanBatchTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    @unittest.skip('messages go to the socket, not to a buffer')
+    def test_whole_messages(self):
+        pass
+
+    def test_torn_message(self):
+        # The message the socket takes in part is finished past the timeout
+        server, client = self.start_pair()
+        server.set_timeout(0)
+        client.set_timeout(100)
+        messages = [os.urandom(64 * 1024) for _ in range(16)]
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(server.send_batch, messages)
+            received = b''
+            while not future.done():
+                try:
+                    received += client.read(64 * 1024)
+                except VchanException:
+                    pass
+            size, sent = future.result()
+            self.assertGreaterEqual(sent, 1)
+            self.assertEqual(size, 64 * 1024 * sent)
+            if size > len(received):
+                received += client.recv(size - len(received))
+            self.assertEqual(received, b''.join(messages[:sent]))
+
+
+class VchanCopyTest(unittest.TestCase, VchanTestMixin):
+    def test_sizes(self):
+        # Cross the thresholds between the copy kernels, at odd offsets.
+        # Only the server has rings big enough for that.
+        server = VchanServer(self.lib, 1, 2, 42,
+                             read_min=256 * 1024, write_min=256 * 1024)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+
+        def write_all(data):
+            while data:
+                data = data[client.write(data):]
+
+        def read_all(size):
+            data = b''
+            while len(data) < size:
+                data += client.read(size - len(data))
+            return data
+
+        sizes = [1, 255, 4095, 4096, 4097, 65537, 200003]
+        chunks = [os.urandom(size) for size in sizes]
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(lambda: [write_all(c) for c in chunks])
+            for chunk in chunks:
+                self.assertEqual(server.recv(len(chunk)), chunk)
+            future.result()
+
+            future = executor.submit(lambda: [read_all(s) for s in sizes])
+            for chunk in chunks:
+                self.assertEqual(server.send(chunk), len(chunk))
+            self.assertEqual(future.result(), chunks)
+
+
+class SimpleVchanCopyTest(VchanCopyTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+
+class VchanLargeTest(unittest.TestCase, VchanTestMixin):
+    def test_larger_than_rings(self):
+        # Both rings are 4096 bytes
+        server = VchanServer(self.lib, 1, 2, 42)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+
+        data = os.urandom(100003)
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(client.send64, data)
+            self.assertEqual(server.recv64(len(data)), data)
+            self.assertEqual(future.result(), len(data))
+
+        client.write64(SAMPLE)
+        self.assertEqual(server.read64(len(SAMPLE)), SAMPLE)
+
+    def test_int_limit(self):
+        size = 3 * 1024 ** 3
+        server = VchanServer(self.lib, 1, 2, 42, write_min=size)
+        self.addCleanup(server.close)
+        # Not allocated until a client connects
+        server.set_buffered_writes(True)
+        self.assertEqual(server.buffer_space64(), 4 * 1024 ** 3)
+        self.assertEqual(server.buffer_space(), 2 ** 31 - 1)
+
+        # Fails before looking at the data
+        ffi = server.ffi
+        self.assertEqual(
+            server.lib.libvchan_send(server.ctrl, ffi.NULL, size), -1)
+        self.assertEqual(ffi.errno, errno.EOVERFLOW)
+        self.assertEqual(
+            server.lib.libvchan_recv(server.ctrl, ffi.NULL, size), -1)
+        self.assertEqual(ffi.errno, errno.EOVERFLOW)
+
+
+class SimpleVchanLargeTest(VchanLargeTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+
+class VchanDelimiterTest(unittest.TestCase, VchanTestMixin):
+    def start_pair(self):
+        server = VchanServer(self.lib, 1, 2, 42)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+        return server, client
+
+    def test_find(self):
+        server, client = self.start_pair()
+        self.assertIsNone(server.find(ord('\n')))
+        client.send(b'x' * 100 + b'\n' + b'y' * 100 + b'\n')
+        server.wait_for(lambda: server.data_ready() == 202)
+        self.assertEqual(server.find(ord('\n')), 100)
+        self.assertIsNone(server.find(0))
+        # Nothing consumed
+        self.assertEqual(server.data_ready(), 202)
+
+    def test_read_until(self):
+        server, client = self.start_pair()
+        with ThreadPoolExecutor() as executor:
+            # The record arrives in parts
+            future = executor.submit(server.read_until, 1024, ord('\n'))
+            client.send(b'hello ')
+            time.sleep(0.1)
+            client.send(b'world\nnext')
+            self.assertEqual(future.result(), b'hello world\n')
+
+        client.send(b' line\n' + b'z' * 99)
+        self.assertEqual(server.read_until(1024, ord('\n')), b'next line\n')
+        # Longer than size
+        self.assertEqual(server.read_until(50, ord('\n')), b'z' * 50)
+
+        server.set_timeout(0)
+        with self.assertRaises(VchanException) as cm:
+            server.read_until(1024, ord('\n'))
+        self.assertEqual(cm.exception.errno, errno.EAGAIN)
+
+        # The last record, without delimiter
+        client.close()
+        server.wait_for_state(VCHAN_DISCONNECTED)
+        self.assertEqual(server.read_until(1024, ord('\n')), b'z' * 49)
+        with self.assertRaises(VchanException):
+            server.read_until(1024, ord('\n'))
+
+
+class SimpleVchanDelimiterTest(VchanDelimiterTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+
+class VchanForwardTest(unittest.TestCase, VchanTestMixin):
+    def start_relay(self, flags=0):
+        '''
+        source -> (a -> b) -> sink, with the relay forwarding from a to b.
+        '''
+        a = VchanServer(self.lib, 1, 2, 42)
+        self.addCleanup(a.close)
+        source = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(source.close)
+        sink = VchanServer(self.lib, 1, 3, 43)
+        self.addCleanup(sink.close)
+        b = VchanClient(self.lib, 3, 1, 43)
+        self.addCleanup(b.close)
+        a.forward(b, flags)
+        return source, a, b, sink
+
+    def relay(self, _a, _b, pred):
+        # The I/O threads move the data
+        while not pred():
+            time.sleep(0.01)
+
+    def test_forward(self):
+        source, a, b, sink = self.start_relay()
+        data = os.urandom(1024 * 1024)
+        with ThreadPoolExecutor() as executor:
+            sent = executor.submit(source.send, data)
+            received = executor.submit(sink.recv, len(data))
+            self.relay(a, b, received.done)
+            self.assertEqual(sent.result(), len(data))
+            self.assertEqual(received.result(), data)
+
+        for read in (lambda: a.read(1), lambda: a.find(ord('\n')),
+                     lambda: a.read_until(1024, ord('\n'))):
+            with self.assertRaises(VchanException) as cm:
+                read()
+            self.assertEqual(cm.exception.errno, errno.EBUSY)
+
+    def test_backpressure(self):
+        source, a, b, sink = self.start_relay()
+        data = os.urandom(4 * 1024 * 1024)
+        with ThreadPoolExecutor() as executor:
+            sent = executor.submit(source.send, data)
+            deadline = time.monotonic() + 0.5
+            self.relay(a, b, lambda: time.monotonic() > deadline)
+            # Held up by the sink not reading
+            self.assertFalse(sent.done())
+
+            received = executor.submit(sink.recv, len(data))
+            self.relay(a, b, received.done)
+            self.assertEqual(sent.result(), len(data))
+            self.assertEqual(received.result(), data)
+
+    def test_both(self):
+        source, a, b, sink = self.start_relay(LIBVCHAN_FORWARD_BOTH)
+        with ThreadPoolExecutor() as executor:
+            received = executor.submit(sink.recv, len(SAMPLE))
+            source.send(SAMPLE)
+            self.relay(a, b, received.done)
+            self.assertEqual(received.result(), SAMPLE)
+
+            received = executor.submit(source.recv, len(SAMPLE))
+            sink.send(SAMPLE)
+            self.relay(a, b, received.done)
+            self.assertEqual(received.result(), SAMPLE)
+
+        # Stopped: the data stays in a
+        a.forward(None, LIBVCHAN_FORWARD_BOTH)
+        source.send(SAMPLE)
+        a.wait_for(lambda: a.data_ready() == len(SAMPLE))
+        self.assertEqual(a.read(len(SAMPLE)), SAMPLE)
+
+
+class SimpleVchanForwardTest(VchanForwardTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def relay(self, a, b, pred):
+        # Move the data ourselves
+        while not pred():
+            fds = [(a.fd_for_select(), a.process()),
+                   (b.fd_for_select(), b.process())]
+            poller = select.poll()
+            for fd, events in fds:
+                if fd >= 0 and events:
+                    poller.register(fd, events)
+            poller.poll(10)
+
+
+class VchanPumpTest(unittest.TestCase, VchanTestMixin):
+    def start_pair(self):
+        server = VchanServer(self.lib, 1, 2, 42)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+        return server, client
+
+    def write_all(self, fd, data):
+        while data:
+            data = data[os.write(fd, data):]
+
+    def read_all(self, fd, size):
+        data = b''
+        while len(data) < size:
+            chunk = os.read(fd, size - len(data))
+            if not chunk:
+                break
+            data += chunk
+        return data
+
+    def test_pump(self):
+        server, client = self.start_pair()
+        in_r, in_w = os.pipe()
+        out_r, out_w = os.pipe()
+        for fd in (in_r, out_r, out_w):
+            self.addCleanup(os.close, fd)
+
+        # Both ways at once, more than fits in the buffers
+        data_in = os.urandom(1024 * 1024)
+        data_out = os.urandom(1024 * 1024)
+        with ThreadPoolExecutor(max_workers=4) as executor:
+            pumped = executor.submit(
+                server.pump, in_r, out_w, LIBVCHAN_PUMP_HANGUP)
+            written = executor.submit(self.write_all, in_w, data_in)
+            sent = executor.submit(client.send, data_out)
+            received = executor.submit(self.read_all, out_r, len(data_out))
+            self.assertEqual(client.recv(len(data_in)), data_in)
+            written.result()
+            self.assertEqual(sent.result(), len(data_out))
+            self.assertEqual(received.result(), data_out)
+
+            with self.assertRaises(VchanException) as cm:
+                server.read(1)
+            self.assertEqual(cm.exception.errno, errno.EBUSY)
+
+            # EOF is passed on as disconnect
+            os.close(in_w)
+            client.wait_for_state(VCHAN_DISCONNECTED)
+            pumped.result()
+
+    def test_thread(self):
+        server, client = self.start_pair()
+        sock, other = socket.socketpair()
+        self.addCleanup(other.close)
+        # The I/O thread owns it now
+        fd = sock.detach()
+        server.pump(fd, fd, LIBVCHAN_PUMP_THREAD)
+
+        other.sendall(SAMPLE)
+        self.assertEqual(client.recv(len(SAMPLE)), SAMPLE)
+        client.send(BIG_SAMPLE)
+        self.assertEqual(self.read_all(other.fileno(), len(BIG_SAMPLE)),
+                         BIG_SAMPLE)
+
+        # Disconnect is passed on as EOF
+        client.close()
+        self.assertEqual(other.recv(1), b'')
+
+
+class SimpleVchanPumpTest(VchanPumpTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def test_pump(self):
+        # The client can't send and receive from two threads here, so one
+        # direction at a time
+        server, client = self.start_pair()
+        in_r, in_w = os.pipe()
+        out_r, out_w = os.pipe()
+        for fd in (in_r, out_r, out_w):
+            self.addCleanup(os.close, fd)
+
+        data_in = os.urandom(1024 * 1024)
+        data_out = os.urandom(1024 * 1024)
+        with ThreadPoolExecutor(max_workers=3) as executor:
+            pumped = executor.submit(
+                server.pump, in_r, out_w, LIBVCHAN_PUMP_HANGUP)
+            received = executor.submit(self.read_all, out_r, len(data_out))
+            self.assertEqual(client.send(data_out), len(data_out))
+            self.assertEqual(received.result(), data_out)
+
+            written = executor.submit(self.write_all, in_w, data_in)
+            self.assertEqual(client.recv(len(data_in)), data_in)
+            written.result()
+
+            os.close(in_w)
+            client.wait_for_state(VCHAN_DISCONNECTED)
+            pumped.result()
+
+    def test_thread(self):
+        server, _client = self.start_pair()
+        with self.assertRaises(VchanException) as cm:
+            server.pump(0, 1, LIBVCHAN_PUMP_THREAD)
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+
+
+class VchanSpillTest(unittest.TestCase, VchanTestMixin):
+    def start_pair(self, flags=0):
+        server = VchanServer(self.lib, 1, 2, 42, flags=flags)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+        return server, client
+
+    def fill(self, client):
+        # Write without waiting until even the spill buffer is full
+        client.set_timeout(0)
+        data = b''
+        while True:
+            chunk = os.urandom(64 * 1024)
+            try:
+                written = client.write(chunk)
+            except VchanException as e:
+                self.assertEqual(e.errno, errno.EAGAIN)
+                return data
+            data += chunk[:written]
+
+    def receive(self, server, client, size):
+        received = b''
+        while len(received) < size:
+            received += server.read(size - len(received))
+        return received
+
+    def test_spill(self):
+        server, client = self.start_pair()
+        client.set_spill(1024 * 1024)
+        data = self.fill(client)
+        self.assertGreater(len(data), 1024 * 1024)
+        stats = client.get_stats()
+        self.assertEqual(stats['spill_pending'], 1024 * 1024)
+        self.assertEqual(stats['spill_peak'], 1024 * 1024)
+        self.assertGreaterEqual(stats['spilled_bytes'], 1024 * 1024)
+
+        # Writes after it wait for the spilled data to go first
+        self.assertEqual(self.receive(server, client, len(data)), data)
+        data = self.fill(client)
+        self.assertEqual(self.receive(server, client, len(data)), data)
+        stats = client.get_stats()
+        self.assertEqual(stats['spill_pending'], 0)
+        self.assertGreaterEqual(stats['spilled_bytes'], 2 * 1024 * 1024)
+
+        # Disabled, but what's spilled still goes out
+        data = self.fill(client)
+        client.set_spill(0)
+        with self.assertRaises(VchanException):
+            client.write(b'x')
+        self.assertEqual(self.receive(server, client, len(data)), data)
+        client.set_timeout(-1)
+        self.assertEqual(client.write(SAMPLE), len(SAMPLE))
+        self.assertEqual(self.receive(server, client, len(SAMPLE)), SAMPLE)
+
+    def test_multi_writer(self):
+        server, _client = self.start_pair(LIBVCHAN_MULTI_WRITER)
+        with self.assertRaises(VchanException) as cm:
+            server.set_spill(1024 * 1024)
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+
+
+class SimpleVchanSpillTest(VchanSpillTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def receive(self, server, client, size):
+        # Nothing sends the spilled data unless we process the client
+        received = b''
+        while len(received) < size:
+            client.process()
+            received += server.read(size - len(received))
+        return received
+
+    @unittest.skip('LIBVCHAN_MULTI_WRITER is not supported')
+    def test_multi_writer(self):
+        pass
+
+
+class VchanRateTest(unittest.TestCase, VchanTestMixin):
+    def start_pair(self):
+        server = VchanServer(self.lib, 1, 2, 42)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+        return server, client
+
+    def transfer(self, server, client, data):
+        def write_all():
+            written = 0
+            while written < len(data):
+                written += client.write(data[written:])
+
+        with ThreadPoolExecutor() as executor:
+            future = executor.submit(write_all)
+            received = b''
+            while len(received) < len(data):
+                received += server.read(len(data) - len(received))
+            future.result()
+        return received
+
+    def test_stats(self):
+        server, client = self.start_pair()
+        self.assertEqual(client.send(SAMPLE), len(SAMPLE))
+        self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+        client_stats = client.get_stats()
+        self.assertEqual(client_stats['bytes_written'], len(SAMPLE))
+        self.assertGreaterEqual(client_stats['writes'], 1)
+        self.assertEqual(client_stats['write_bytes_per_sec'], 0)
+        server_stats = server.get_stats()
+        self.assertEqual(server_stats['bytes_read'], len(SAMPLE))
+        self.assertGreaterEqual(server_stats['reads'], 1)
+
+    def test_write_limit(self):
+        server, client = self.start_pair()
+        client.set_rate_limit(LIBVCHAN_RATE_WRITE, 20000)
+        self.assertEqual(client.get_stats()['write_bytes_per_sec'], 20000)
+
+        start = time.monotonic()
+        self.assertEqual(self.transfer(server, client, BIG_SAMPLE),
+                         BIG_SAMPLE)
+        # 8 KiB at 20 KB/s, minus the initial burst
+        self.assertGreater(time.monotonic() - start, 0.2)
+        self.assertGreater(client.get_stats()['write_throttled'], 0)
+
+        client.set_rate_limit(LIBVCHAN_RATE_WRITE, 0)
+        start = time.monotonic()
+        self.assertEqual(self.transfer(server, client, BIG_SAMPLE),
+                         BIG_SAMPLE)
+        self.assertLess(time.monotonic() - start, 0.2)
+
+    def test_read_ops_limit(self):
+        server, client = self.start_pair()
+        server.set_rate_limit(LIBVCHAN_RATE_READ, 0, 20)
+        start = time.monotonic()
+        for _ in range(5):
+            self.assertEqual(client.send(SAMPLE), len(SAMPLE))
+            self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+        self.assertGreater(time.monotonic() - start, 0.1)
+        self.assertGreater(server.get_stats()['read_throttled'], 0)
+
+
+class SimpleVchanRateTest(VchanRateTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+
+class VchanMultiWriterTest(unittest.TestCase, VchanTestMixin):
+    def start_pair(self, flags):
+        server = VchanServer(self.lib, 1, 2, 42, flags=flags)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+        return server, client
+
+    def test_sendv(self):
+        server, client = self.start_pair(0)
+        self.assertEqual(client.sendv([b'Hello', b' ', b'World']),
+                         len(SAMPLE))
+        self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+
+    def test_concurrent_sends(self):
+        server, client = self.start_pair(LIBVCHAN_MULTI_WRITER)
+        size, count, writers = 1000, 50, 4
+
+        def send_all(tag):
+            for _ in range(count):
+                server.sendv([bytes([tag]) * 10, bytes([tag]) * (size - 10)])
+
+        with ThreadPoolExecutor(writers) as executor:
+            futures = [executor.submit(send_all, tag)
+                       for tag in range(writers)]
+            received = b''
+            while len(received) < size * count * writers:
+                received += client.read(size * count * writers - len(received))
+            for future in futures:
+                future.result()
+
+        # Each message arrived in one piece
+        for i in range(0, len(received), size):
+            message = received[i:i+size]
+            self.assertEqual(message, message[:1] * size)
+
+    def test_too_big(self):
+        server, client = self.start_pair(LIBVCHAN_MULTI_WRITER)
+        with self.assertRaises(VchanException) as cm:
+            server.send(BIG_SAMPLE)
+        self.assertEqual(cm.exception.errno, errno.EMSGSIZE)
+
+
+class SimpleVchanMultiWriterTest(VchanMultiWriterTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    def start_pair(self, flags):
+        if flags & LIBVCHAN_MULTI_WRITER:
+            self.skipTest('nothing is thread-safe in simple implementation')
+        return super().start_pair(flags)
+
+    def test_not_supported(self):
+        with self.assertRaises(VchanException):
+            VchanServer(self.lib, 1, 2, 42, flags=LIBVCHAN_MULTI_WRITER)
+
+
+def memory_status(field):
+    with open('/proc/self/status') as f:
+        for line in f:
+            if line.startswith(field + ':'):
+                return int(line.split()[1]) * 1024
+    raise KeyError(field)
+
+
+class VchanPrefaultTest(unittest.TestCase, VchanTestMixin):
+    RING_SIZE = 1024 * 1024
+
+    def start_pair(self, flags):
+        server = VchanServer(self.lib, 1, 2, 42, flags=flags,
+                             read_min=self.RING_SIZE,
+                             write_min=self.RING_SIZE)
+        self.addCleanup(server.close)
+        client = VchanClient(self.lib, 2, 1, 42, flags=flags)
+        self.addCleanup(client.close)
+        return server, client
+
+    def test_prefault(self):
+        before = memory_status('RssShmem')
+        server, client = self.start_pair(LIBVCHAN_PREFAULT)
+        # Both server rings, in both mappings
+        self.assertGreaterEqual(memory_status('RssShmem') - before,
+                                4 * self.RING_SIZE)
+
+        client.send(SAMPLE)
+        self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+
+    def test_mlock(self):
+        before = memory_status('VmLck')
+        try:
+            server, client = self.start_pair(LIBVCHAN_MLOCK)
+        except VchanException:
+            self.skipTest('cannot lock memory')
+        self.assertGreaterEqual(memory_status('VmLck') - before,
+                                4 * self.RING_SIZE)
+
+        client.send(SAMPLE)
+        self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+
+
+class SimpleVchanPrefaultTest(VchanPrefaultTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+
+class VchanNumaTest(unittest.TestCase, VchanTestMixin):
+    def test_numa_node(self):
+        server = self.start_server()
+        server.set_numa_node(0)
+        self.assertEqual(server.get_stats()['numa_node'], -1)
+
+        client = VchanClient(self.lib, 2, 1, 42)
+        self.addCleanup(client.close)
+        server.wait_for_state(VCHAN_CONNECTED)
+        client.send(SAMPLE)
+        self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+        self.assertEqual(server.get_stats()['numa_node'], 0)
+
+        server.set_numa_node(LIBVCHAN_NUMA_DEFAULT)
+        client.send(SAMPLE)
+        self.assertEqual(server.recv(len(SAMPLE)), SAMPLE)
+
+    def test_invalid_node(self):
+        server = self.start_server()
+        with self.assertRaises(VchanException):
+            server.set_numa_node(9999)
+
+    def test_thread_node(self):
+        server = self.start_server()
+        # Not pinned to any CPU
+        with self.assertRaises(VchanException):
+            server.set_numa_node(LIBVCHAN_NUMA_THREAD)
+        server.set_thread_affinity([0])
+        server.set_numa_node(LIBVCHAN_NUMA_THREAD)
+
+
+class SimpleVchanNumaTest(VchanNumaTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    @unittest.skip('no I/O thread in simple implementation')
+    def test_thread_node(self):
+        pass
+
+
+class VchanMemoryTest(unittest.TestCase, VchanTestMixin):
+    def test_waiting_servers(self):
+        servers = []
+        for port in range(3):
+            server = VchanServer(self.lib, 1, 2, 100 + port,
+                                 read_min=64 * 1024, write_min=64 * 1024)
+            self.addCleanup(server.close)
+            servers.append(server)
+        before = servers[0].get_memory()
+        self.assertGreaterEqual(before['channels'], 3)
+
+        # Nothing allocated until a client connects
+        client = VchanClient(self.lib, 2, 1, 100)
+        self.addCleanup(client.close)
+        servers[0].wait_for_state(VCHAN_CONNECTED)
+        after = servers[0].get_memory()
+        self.assertEqual(after['channels'] - before['channels'], 1)
+        self.assertEqual(after['rings'] - before['rings'], 4)
+        self.assertEqual(after['ring_bytes'] - before['ring_bytes'],
+                         2 * 64 * 1024 + 2 * 4096)
+
+        client.close()
+        for server in servers:
+            server.close()
+        memory = servers[0].get_memory()
+        self.assertEqual(memory['channels'], before['channels'] - 3)
+        self.assertEqual(memory['rings'], before['rings'])
+
+    def test_write_before_connect(self):
+        server = self.start_server()
+        before = server.get_memory()
+        server.write(SAMPLE)
+        self.assertEqual(server.get_memory()['rings'] - before['rings'], 1)
+
+
+class SimpleVchanMemoryTest(VchanMemoryTest):
+    lib = 'vchan-simple/libvchan-socket-simple.so'
+
+    @unittest.skip('not possible in simple implementation')
+    def test_write_before_connect(self):
+        pass
+
+
+class VchanThreadTest(unittest.TestCase, VchanTestMixin):
+    def thread_tids(self, name):
+        tids = []
+        for tid in os.listdir('/proc/self/task'):
+            with open('/proc/self/task/{}/comm'.format(tid)) as f:
+                if f.read().strip() == name:
+                    tids.append(int(tid))
+        return tids
+
+    def test_thread_name(self):
+        server = self.start_server()
+        # Until a client connects, the shared waiter does the job
+        self.assertEqual(len(self.thread_tids('vchan/2/42')), 0)
+        self.assertTrue(self.thread_tids('vchan/waiter'))
+        self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        self.assertEqual(len(self.thread_tids('vchan/2/42')), 1)
+
+    def test_thread_affinity(self):
+        server = self.start_server()
+        self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        cpu = min(os.sched_getaffinity(0))
+        server.set_thread_affinity([cpu])
+        tid, = self.thread_tids('vchan/2/42')
+        self.assertEqual(os.sched_getaffinity(tid), {cpu})
+
+    def test_thread_priority(self):
+        server = self.start_server()
+        self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        server.set_thread_priority(os.SCHED_OTHER, 5)
+        tid, = self.thread_tids('vchan/2/42')
+        self.assertEqual(os.getpriority(os.PRIO_PROCESS, tid), 5)
+
+    def test_settings_before_start(self):
+        server = self.start_server()
+        # Checked right away, not only when the thread starts
+        with self.assertRaises(VchanException) as cm:
+            server.set_thread_priority(os.SCHED_FIFO, 1000)
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+        with self.assertRaises(VchanException) as cm:
+            # The last CPU that fits in cpu_set_t, which this machine lacks
+            server.set_thread_affinity([1023])
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+
+        server.set_thread_priority(os.SCHED_OTHER, 5)
+        self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        tid, = self.thread_tids('vchan/2/42')
+        self.assertEqual(os.getpriority(os.PRIO_PROCESS, tid), 5)
+
+    def test_stack_size(self):
+        server = self.start_server()
+        with self.assertRaises(VchanException) as cm:
+            server.set_thread_stack_size(1)
+        self.assertEqual(cm.exception.errno, errno.EINVAL)
+        server.set_thread_stack_size(512 * 1024)
+        self.connect(server)
+        server.wait_for_state(VCHAN_CONNECTED)
+        with self.assertRaises(VchanException) as cm:
+            server.set_thread_stack_size(1024 * 1024)
+        self.assertEqual(cm.exception.errno, errno.EBUSY)
+
+    def test_stack_size_too_large(self):
+        # The thread can't be started, so the client is turned away
+        server = self.start_server()
+        server.set_thread_stack_size(1 << 50)
+        sock = self.connect(server)
+        server.wait_for_state(VCHAN_DISCONNECTED)
+        self.assertEqual(sock.recv(1), b'')
+
+    def test_threadless(self):
+        server = VchanServer(self.lib, 1, 2, 42, flags=LIBVCHAN_NO_THREAD)
+        self.addCleanup(server.close)
+        with self.assertRaises(VchanException):
+            server.set_thread_affinity([0])
+        with self.assertRaises(VchanException):
+            server.set_thread_stack_size(512 * 1024)
+
 
 class VchanClientTest(unittest.TestCase, VchanTestMixin):
     def test_client_connect_and_send(self):
@@ -20,6 +20,7 @@
 
 from cffi import FFI
 import os
+import select
 import time
 
 
@@ -27,6 +28,27 @@ VCHAN_DISCONNECTED = 0
 VCHAN_CONNECTED = 1
 VCHAN_WAITING = 2
 
+LIBVCHAN_NO_THREAD = 1 << 0
+LIBVCHAN_CREDITS = 1 << 1
+LIBVCHAN_MULTI_WRITER = 1 << 2
+LIBVCHAN_PREFAULT = 1 << 3
+LIBVCHAN_MLOCK = 1 << 4
+
+LIBVCHAN_NUMA_DEFAULT = -1
+LIBVCHAN_NUMA_THREAD = -2
+
+LIBVCHAN_RATE_READ = 1 << 0
+LIBVCHAN_RATE_WRITE = 1 << 1
+
+LIBVCHAN_FORWARD_BOTH = 1 << 0
+
+LIBVCHAN_PUMP_HANGUP = 1 << 0
+LIBVCHAN_PUMP_THREAD = 1 << 1
+
+LIBVCHAN_POLLIN = 1 << 0
+LIBVCHAN_POLLOUT = 1 << 1
+LIBVCHAN_POLLHUP = 1 << 2
+
 
 class VchanBase:
     def __init__(self, lib):
@@ -38,22 +60,136 @@ typedef struct libvchan libvchan_t;
 
 libvchan_t *libvchan_server_init(int domain, int port, size_t read_min, size_t write_min);
 libvchan_t *libvchan_client_init(int domain, int port);
+libvchan_t *libvchan_server_init_flags(int domain, int port,
+                                       size_t read_min, size_t write_min,
+                                       unsigned int flags);
+libvchan_t *libvchan_client_init_flags(int domain, int port,
+                                       unsigned int flags);
+int libvchan_process(libvchan_t *ctrl);
+
+int libvchan_set_thread_affinity(libvchan_t *ctrl,
+                                 const int *cpus, size_t ncpus);
+int libvchan_set_thread_priority(libvchan_t *ctrl, int policy, int priority);
+int libvchan_set_thread_stack_size(libvchan_t *ctrl, size_t size);
+int libvchan_set_numa_node(libvchan_t *ctrl, int node);
 int libvchan_write(libvchan_t *ctrl, const void *data, size_t size);
 int libvchan_send(libvchan_t *ctrl, const void *data, size_t size);
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+int libvchan_sendv(libvchan_t *ctrl, const struct iovec *iov, int iovcnt);
+int libvchan_send_batch(libvchan_t *ctrl, const struct iovec *msgs, int n,
+                        int *sent);
 int libvchan_read(libvchan_t *ctrl, void *data, size_t size);
 int libvchan_recv(libvchan_t *ctrl, void *data, size_t size);
+ssize_t libvchan_write64(libvchan_t *ctrl, const void *data, size_t size);
+ssize_t libvchan_send64(libvchan_t *ctrl, const void *data, size_t size);
+ssize_t libvchan_read64(libvchan_t *ctrl, void *data, size_t size);
+ssize_t libvchan_recv64(libvchan_t *ctrl, void *data, size_t size);
 int libvchan_wait(libvchan_t *ctrl);
+int libvchan_wait_timeout(libvchan_t *ctrl, int timeout);
 void libvchan_close(libvchan_t *ctrl);
 int libvchan_fd_for_select(libvchan_t *ctrl);
+int libvchan_fd_for_read(libvchan_t *ctrl);
+int libvchan_fd_for_write(libvchan_t *ctrl);
 int libvchan_is_open(libvchan_t *ctrl);
 
+struct libvchan_pollfd {
+    libvchan_t *ctrl;
+    short events;
+    short revents;
+};
+
+int libvchan_poll(struct libvchan_pollfd *fds, size_t nfds, int timeout);
+
 int libvchan_data_ready(libvchan_t *ctrl);
 int libvchan_buffer_space(libvchan_t *ctrl);
+size_t libvchan_data_ready64(libvchan_t *ctrl);
+size_t libvchan_buffer_space64(libvchan_t *ctrl);
+int libvchan_find(libvchan_t *ctrl, uint8_t byte, size_t *offset);
+int libvchan_read_until(libvchan_t *ctrl, void *data, size_t size,
+                        uint8_t delim);
+
+int libvchan_forward(libvchan_t *from, libvchan_t *to, int flags);
+int libvchan_pump(libvchan_t *ctrl, int in_fd, int out_fd, unsigned int flags);
+
+int libvchan_set_read_lowat(libvchan_t *ctrl, size_t size);
+int libvchan_set_write_lowat(libvchan_t *ctrl, size_t size);
+int libvchan_set_timeout(libvchan_t *ctrl, int timeout);
+
+int libvchan_cork(libvchan_t *ctrl);
+int libvchan_uncork(libvchan_t *ctrl);
+int libvchan_set_autoflush(libvchan_t *ctrl, size_t flush_bytes,
+                           unsigned int flush_usec);
+int libvchan_set_buffered_writes(libvchan_t *ctrl, bool enable);
+int libvchan_set_spill(libvchan_t *ctrl, size_t max_size);
+
+struct libvchan_completion {
+    void *user_data;
+    int result;
+};
+
+int libvchan_submit_read(libvchan_t *ctrl, void *data, size_t size,
+                         void *user_data);
+int libvchan_submit_write(libvchan_t *ctrl, const void *data, size_t size,
+                          void *user_data);
+int libvchan_fd_for_completion(libvchan_t *ctrl);
+int libvchan_get_completions(libvchan_t *ctrl,
+                             struct libvchan_completion *completions,
+                             int max);
+
+int libvchan_stream_open(libvchan_t *ctrl, unsigned int stream,
+                         size_t read_min, size_t write_min, int priority);
+int libvchan_stream_write(libvchan_t *ctrl, unsigned int stream,
+                          const void *data, size_t size);
+int libvchan_stream_send(libvchan_t *ctrl, unsigned int stream,
+                         const void *data, size_t size);
+int libvchan_stream_read(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size);
+int libvchan_stream_recv(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size);
+int libvchan_stream_data_ready(libvchan_t *ctrl, unsigned int stream);
+int libvchan_stream_buffer_space(libvchan_t *ctrl, unsigned int stream);
+
+int libvchan_set_rate_limit(libvchan_t *ctrl, int direction,
+                            uint64_t bytes_per_sec, uint64_t ops_per_sec);
+
+struct libvchan_stats {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_throttled;
+    uint64_t write_throttled;
+    uint64_t read_bytes_per_sec;
+    uint64_t read_ops_per_sec;
+    uint64_t write_bytes_per_sec;
+    uint64_t write_ops_per_sec;
+    int64_t numa_node;
+    uint64_t spilled_bytes;
+    uint64_t spill_pending;
+    uint64_t spill_peak;
+};
+
+int libvchan_get_stats(libvchan_t *ctrl, struct libvchan_stats *stats);
+
+struct libvchan_memory {
+    uint64_t channels;
+    uint64_t threads;
+    uint64_t thread_stack_bytes;
+    uint64_t rings;
+    uint64_t ring_bytes;
+};
+
+int libvchan_get_memory(struct libvchan_memory *memory);
 """)
 
         self.lib = self.ffi.dlopen(
             os.path.join(os.path.dirname(__file__), '..', lib))
         self.ctrl = None
+        # Buffers of asynchronous operations in progress, by tag
+        self.ops = {}
 
     def close(self):
         if self.ctrl is not None:
@@ -63,27 +199,80 @@ int libvchan_buffer_space(libvchan_t *ctrl);
     def write(self, data: bytes) -> int:
         result = self.lib.libvchan_write(self.ctrl, data, len(data))
         if result < 0:
-            raise VchanException('libvchan_write')
+            raise VchanException('libvchan_write', self.ffi.errno)
         return result
 
     def send(self, data: bytes) -> int:
         result = self.lib.libvchan_send(self.ctrl, data, len(data))
         if result < 0:
-            raise VchanException('libvchan_send')
+            raise VchanException('libvchan_send', self.ffi.errno)
+        return result
+
+    def sendv(self, parts) -> int:
+        bufs = [self.ffi.from_buffer(part) for part in parts]
+        iov = self.ffi.new('struct iovec[]', len(parts))
+        for i, buf in enumerate(bufs):
+            iov[i].iov_base = buf
+            iov[i].iov_len = len(buf)
+        result = self.lib.libvchan_sendv(self.ctrl, iov, len(parts))
+        if result < 0:
+            raise VchanException('libvchan_sendv', self.ffi.errno)
         return result
 
+    def send_batch(self, messages):
+        '''
+        Returns (bytes sent, number of messages sent).
+        '''
+        bufs = [self.ffi.from_buffer(message) for message in messages]
+        iov = self.ffi.new('struct iovec[]', len(messages))
+        for i, buf in enumerate(bufs):
+            iov[i].iov_base = buf
+            iov[i].iov_len = len(buf)
+        sent = self.ffi.new('int *')
+        result = self.lib.libvchan_send_batch(
+            self.ctrl, iov, len(messages), sent)
+        if result < 0:
+            raise VchanException('libvchan_send_batch', self.ffi.errno)
+        return result, sent[0]
+
     def read(self, size: int) -> bytes:
         buf = self.ffi.new('char[]', size)
         result = self.lib.libvchan_read(self.ctrl, buf, size)
         if result < 0:
-            raise VchanException('libvchan_read')
+            raise VchanException('libvchan_read', self.ffi.errno)
         return self.ffi.unpack(buf, result)
 
     def recv(self, size: int) -> bytes:
         buf = self.ffi.new('char[]', size)
         result = self.lib.libvchan_recv(self.ctrl, buf, size)
         if result < 0:
-            raise VchanException('libvchan_recv')
+            raise VchanException('libvchan_recv', self.ffi.errno)
+        return self.ffi.unpack(buf, result)
+
+    def write64(self, data: bytes) -> int:
+        result = self.lib.libvchan_write64(self.ctrl, data, len(data))
+        if result < 0:
+            raise VchanException('libvchan_write64', self.ffi.errno)
+        return result
+
+    def send64(self, data: bytes) -> int:
+        result = self.lib.libvchan_send64(self.ctrl, data, len(data))
+        if result < 0:
+            raise VchanException('libvchan_send64', self.ffi.errno)
+        return result
+
+    def read64(self, size: int) -> bytes:
+        buf = self.ffi.new('char[]', size)
+        result = self.lib.libvchan_read64(self.ctrl, buf, size)
+        if result < 0:
+            raise VchanException('libvchan_read64', self.ffi.errno)
+        return self.ffi.unpack(buf, result)
+
+    def recv64(self, size: int) -> bytes:
+        buf = self.ffi.new('char[]', size)
+        result = self.lib.libvchan_recv64(self.ctrl, buf, size)
+        if result < 0:
+            raise VchanException('libvchan_recv64', self.ffi.errno)
         return self.ffi.unpack(buf, result)
 
     def wait(self):
@@ -91,12 +280,23 @@ int libvchan_buffer_space(libvchan_t *ctrl);
         if result < 0:
             raise VchanException('libvchan_wait')
 
+    def wait_timeout(self, timeout: int):
+        result = self.lib.libvchan_wait_timeout(self.ctrl, timeout)
+        if result < 0:
+            raise VchanException('libvchan_wait_timeout', self.ffi.errno)
+
     def state(self) -> int:
         return self.lib.libvchan_is_open(self.ctrl)
 
     def fd_for_select(self) -> int:
         return self.lib.libvchan_fd_for_select(self.ctrl)
 
+    def fd_for_read(self) -> int:
+        return self.lib.libvchan_fd_for_read(self.ctrl)
+
+    def fd_for_write(self) -> int:
+        return self.lib.libvchan_fd_for_write(self.ctrl)
+
     def wait_for(self, pred):
         while not pred():
             self.wait()
@@ -116,6 +316,252 @@ int libvchan_buffer_space(libvchan_t *ctrl);
             raise VchanException('libvchan_buffer_space')
         return result
 
+    def data_ready64(self) -> int:
+        return self.lib.libvchan_data_ready64(self.ctrl)
+
+    def buffer_space64(self) -> int:
+        return self.lib.libvchan_buffer_space64(self.ctrl)
+
+    def find(self, byte: int):
+        '''
+        Returns the offset of byte in the data ready, or None.
+        '''
+        offset = self.ffi.new('size_t *')
+        result = self.lib.libvchan_find(self.ctrl, byte, offset)
+        if result < 0:
+            raise VchanException('libvchan_find', self.ffi.errno)
+        if result == 0:
+            return None
+        return offset[0]
+
+    def read_until(self, size: int, delim: int) -> bytes:
+        buf = self.ffi.new('char[]', size)
+        result = self.lib.libvchan_read_until(self.ctrl, buf, size, delim)
+        if result < 0:
+            raise VchanException('libvchan_read_until', self.ffi.errno)
+        return self.ffi.unpack(buf, result)
+
+    def forward(self, to, flags=0):
+        '''
+        Forward to another channel (using this channel's library), or stop
+        if to is None.
+        '''
+        to_ctrl = self.ffi.cast(
+            'libvchan_t *', int(to.ffi.cast('uintptr_t', to.ctrl)) if to else 0)
+        result = self.lib.libvchan_forward(self.ctrl, to_ctrl, flags)
+        if result < 0:
+            raise VchanException('libvchan_forward', self.ffi.errno)
+
+    def pump(self, in_fd: int, out_fd: int, flags=0):
+        result = self.lib.libvchan_pump(self.ctrl, in_fd, out_fd, flags)
+        if result < 0:
+            raise VchanException('libvchan_pump', self.ffi.errno)
+
+    def set_read_lowat(self, size: int):
+        result = self.lib.libvchan_set_read_lowat(self.ctrl, size)
+        if result < 0:
+            raise VchanException('libvchan_set_read_lowat')
+
+    def set_write_lowat(self, size: int):
+        result = self.lib.libvchan_set_write_lowat(self.ctrl, size)
+        if result < 0:
+            raise VchanException('libvchan_set_write_lowat')
+
+    def set_timeout(self, timeout: int):
+        result = self.lib.libvchan_set_timeout(self.ctrl, timeout)
+        if result < 0:
+            raise VchanException('libvchan_set_timeout')
+
+    def cork(self):
+        if self.lib.libvchan_cork(self.ctrl) < 0:
+            raise VchanException('libvchan_cork')
+
+    def uncork(self):
+        if self.lib.libvchan_uncork(self.ctrl) < 0:
+            raise VchanException('libvchan_uncork')
+
+    def set_autoflush(self, flush_bytes: int, flush_usec: int):
+        result = self.lib.libvchan_set_autoflush(
+            self.ctrl, flush_bytes, flush_usec)
+        if result < 0:
+            raise VchanException('libvchan_set_autoflush')
+
+    def set_buffered_writes(self, enable: bool):
+        result = self.lib.libvchan_set_buffered_writes(self.ctrl, enable)
+        if result < 0:
+            raise VchanException('libvchan_set_buffered_writes')
+
+    def set_spill(self, max_size: int):
+        result = self.lib.libvchan_set_spill(self.ctrl, max_size)
+        if result < 0:
+            raise VchanException('libvchan_set_spill', self.ffi.errno)
+
+    def process(self) -> int:
+        result = self.lib.libvchan_process(self.ctrl)
+        if result < 0:
+            raise VchanException('libvchan_process')
+        return result
+
+    def set_thread_affinity(self, cpus):
+        result = self.lib.libvchan_set_thread_affinity(
+            self.ctrl, cpus, len(cpus))
+        if result < 0:
+            raise VchanException('libvchan_set_thread_affinity',
+                                 self.ffi.errno)
+
+    def set_thread_priority(self, policy: int, priority: int):
+        result = self.lib.libvchan_set_thread_priority(
+            self.ctrl, policy, priority)
+        if result < 0:
+            raise VchanException('libvchan_set_thread_priority',
+                                 self.ffi.errno)
+
+    def set_thread_stack_size(self, size: int):
+        result = self.lib.libvchan_set_thread_stack_size(self.ctrl, size)
+        if result < 0:
+            raise VchanException('libvchan_set_thread_stack_size',
+                                 self.ffi.errno)
+
+    def set_numa_node(self, node: int):
+        result = self.lib.libvchan_set_numa_node(self.ctrl, node)
+        if result < 0:
+            raise VchanException('libvchan_set_numa_node', self.ffi.errno)
+
+    def poll(self, channels, timeout: int = -1):
+        '''
+        Poll a list of (vchan, events) pairs (using this channel's library).
+        Returns a list of revents.
+        '''
+        fds = self.ffi.new('struct libvchan_pollfd[]', len(channels))
+        for i, (vchan, events) in enumerate(channels):
+            fds[i].ctrl = self.ffi.cast(
+                'libvchan_t *', int(vchan.ffi.cast('uintptr_t', vchan.ctrl)))
+            fds[i].events = events
+        result = self.lib.libvchan_poll(fds, len(channels), timeout)
+        if result < 0:
+            raise VchanException('libvchan_poll')
+        return [fds[i].revents for i in range(len(channels))]
+
+    def submit_read(self, tag: int, size: int):
+        buf = self.ffi.new('char[]', size)
+        result = self.lib.libvchan_submit_read(
+            self.ctrl, buf, size, self.ffi.cast('void *', tag))
+        if result < 0:
+            raise VchanException('libvchan_submit_read', self.ffi.errno)
+        self.ops[tag] = buf
+
+    def submit_write(self, tag: int, data: bytes):
+        buf = self.ffi.new('char[]', data)
+        result = self.lib.libvchan_submit_write(
+            self.ctrl, buf, len(data), self.ffi.cast('void *', tag))
+        if result < 0:
+            raise VchanException('libvchan_submit_write', self.ffi.errno)
+        self.ops[tag] = buf
+
+    def fd_for_completion(self) -> int:
+        return self.lib.libvchan_fd_for_completion(self.ctrl)
+
+    def get_completions(self, max_count: int = 16):
+        '''
+        Returns a list of (tag, result, buffer) for completed operations.
+        '''
+        completions = self.ffi.new('struct libvchan_completion[]', max_count)
+        count = self.lib.libvchan_get_completions(
+            self.ctrl, completions, max_count)
+        if count < 0:
+            raise VchanException('libvchan_get_completions')
+        result = []
+        for i in range(count):
+            tag = int(self.ffi.cast('uintptr_t', completions[i].user_data))
+            buf = self.ops.pop(tag)
+            result.append((tag, completions[i].result, buf))
+        return result
+
+    def wait_for_completions(self, count: int, timeout: float = 1):
+        '''
+        Wait until count operations complete (or timeout passes).
+        '''
+        result = []
+        while len(result) < count:
+            rlist, _, _ = select.select(
+                [self.fd_for_completion()], [], [], timeout)
+            if not rlist:
+                break
+            result.extend(self.get_completions())
+        return result
+
+    def stream_open(self, stream: int, read_min: int, write_min: int,
+                    priority: int = 0):
+        result = self.lib.libvchan_stream_open(
+            self.ctrl, stream, read_min, write_min, priority)
+        if result < 0:
+            raise VchanException('libvchan_stream_open', self.ffi.errno)
+
+    def stream_write(self, stream: int, data: bytes) -> int:
+        result = self.lib.libvchan_stream_write(
+            self.ctrl, stream, data, len(data))
+        if result < 0:
+            raise VchanException('libvchan_stream_write', self.ffi.errno)
+        return result
+
+    def stream_send(self, stream: int, data: bytes) -> int:
+        result = self.lib.libvchan_stream_send(
+            self.ctrl, stream, data, len(data))
+        if result < 0:
+            raise VchanException('libvchan_stream_send', self.ffi.errno)
+        return result
+
+    def stream_read(self, stream: int, size: int) -> bytes:
+        buf = self.ffi.new('char[]', size)
+        result = self.lib.libvchan_stream_read(self.ctrl, stream, buf, size)
+        if result < 0:
+            raise VchanException('libvchan_stream_read', self.ffi.errno)
+        return self.ffi.unpack(buf, result)
+
+    def stream_recv(self, stream: int, size: int) -> bytes:
+        buf = self.ffi.new('char[]', size)
+        result = self.lib.libvchan_stream_recv(self.ctrl, stream, buf, size)
+        if result < 0:
+            raise VchanException('libvchan_stream_recv', self.ffi.errno)
+        return self.ffi.unpack(buf, result)
+
+    def stream_data_ready(self, stream: int) -> int:
+        result = self.lib.libvchan_stream_data_ready(self.ctrl, stream)
+        if result < 0:
+            raise VchanException('libvchan_stream_data_ready', self.ffi.errno)
+        return result
+
+    def stream_buffer_space(self, stream: int) -> int:
+        result = self.lib.libvchan_stream_buffer_space(self.ctrl, stream)
+        if result < 0:
+            raise VchanException('libvchan_stream_buffer_space',
+                                 self.ffi.errno)
+        return result
+
+    def set_rate_limit(self, direction: int, bytes_per_sec: int,
+                       ops_per_sec: int = 0):
+        result = self.lib.libvchan_set_rate_limit(
+            self.ctrl, direction, bytes_per_sec, ops_per_sec)
+        if result < 0:
+            raise VchanException('libvchan_set_rate_limit', self.ffi.errno)
+
+    def get_stats(self) -> dict:
+        stats = self.ffi.new('struct libvchan_stats *')
+        if self.lib.libvchan_get_stats(self.ctrl, stats) < 0:
+            raise VchanException('libvchan_get_stats', self.ffi.errno)
+        return {field: getattr(stats, field)
+                for field, _ in self.ffi.typeof(stats[0]).fields}
+
+    def get_memory(self) -> dict:
+        '''
+        Memory used by all the channels in the process.
+        '''
+        memory = self.ffi.new('struct libvchan_memory *')
+        if self.lib.libvchan_get_memory(memory) < 0:
+            raise VchanException('libvchan_get_memory', self.ffi.errno)
+        return {field: getattr(memory, field)
+                for field, _ in self.ffi.typeof(memory[0]).fields}
+
     def __enter__(self):
         pass
 
@@ -124,7 +570,9 @@ int libvchan_buffer_space(libvchan_t *ctrl);
 
 
 class VchanException(Exception):
-    pass
+    def __init__(self, message, errno=0):
+        super().__init__(message)
+        self.errno = errno
 
 
 class VchanServer(VchanBase):
@@ -135,6 +583,7 @@ class VchanServer(VchanBase):
             socket_dir='/tmp',
             read_min=1024,
             write_min=1024,
+            flags=0,
     ):
         super().__init__(lib)
         os.environ['VCHAN_DOMAIN'] = str(domain)
@@ -143,8 +592,8 @@ class VchanServer(VchanBase):
         self.socket_path = '{}/vchan.{}.{}.{}.sock'.format(
             socket_dir, domain, remote_domain, port)
 
-        self.ctrl = self.lib.libvchan_server_init(
-            remote_domain, port, read_min, write_min)
+        self.ctrl = self.lib.libvchan_server_init_flags(
+            remote_domain, port, read_min, write_min, flags)
         if self.ctrl == self.ffi.NULL:
             raise VchanException('libvchan_server_init')
 
@@ -155,6 +604,7 @@ class VchanClient(VchanBase):
             lib,
             domain=0, remote_domain=0, port=0,
             socket_dir='/tmp',
+            flags=0,
     ):
         super().__init__(lib)
         os.environ['VCHAN_DOMAIN'] = str(domain)
@@ -163,7 +613,7 @@ class VchanClient(VchanBase):
         self.socket_path = '{}/vchan.{}.{}.{}.sock'.format(
             socket_dir, remote_domain, domain, port)
 
-        self.ctrl = self.lib.libvchan_client_init(
-            remote_domain, port)
+        self.ctrl = self.lib.libvchan_client_init_flags(
+            remote_domain, port, flags)
         if self.ctrl == self.ffi.NULL:
             raise VchanException('libvchan_client_init')
@@ -0,0 +1,236 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "copy.h"
+
+// Used when the cache size is unknown
+#define DEFAULT_NT_THRESHOLD (4 * 1024 * 1024)
+
+#ifdef __x86_64__
+
+// CPUID leaf 7: Enhanced REP MOVSB/STOSB
+#define CPUID_7_EBX_ERMS (1 << 9)
+
+static void *copy_rep_movsb(void *dest, const void *src, size_t n) {
+    void *d = dest;
+    __asm__ volatile("rep movsb"
+                     : "+D"(d), "+S"(src), "+c"(n)
+                     :
+                     : "memory");
+    return dest;
+}
+
+__attribute__((target("avx2")))
+static void *copy_avx2(void *dest, const void *src, size_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    if (n < 32)
+        return memcpy(dest, src, n);
+
+    // The last 32 bytes are copied separately (possibly overlapping)
+    __m256i last = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+    uint8_t *d_last = d + n - 32;
+    for (; n > 128; n -= 128, s += 128, d += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_storeu_si256((__m256i *)d, a);
+        _mm256_storeu_si256((__m256i *)(d + 32), b);
+        _mm256_storeu_si256((__m256i *)(d + 64), c);
+        _mm256_storeu_si256((__m256i *)(d + 96), e);
+    }
+    for (; n > 32; n -= 32, s += 32, d += 32)
+        _mm256_storeu_si256((__m256i *)d,
+                            _mm256_loadu_si256((const __m256i *)s));
+    _mm256_storeu_si256((__m256i *)d_last, last);
+    return dest;
+}
+
+/*
+ * Streaming stores write around the cache, so that a big copy doesn't evict
+ * everything else. The destination has to be aligned; the unaligned head and
+ * the tail are copied with memcpy(). The stores are weakly ordered, so finish
+ * with a fence before anyone else (the other thread) gets to see the data.
+ */
+
+static void *copy_stream_sse2(void *dest, const void *src, size_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    size_t head = -(uintptr_t)d & 15;
+    if (head > n)
+        head = n;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    for (; n >= 64; n -= 64, s += 64, d += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    for (; n >= 16; n -= 16, s += 16, d += 16)
+        _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    _mm_sfence();
+
+    memcpy(d, s, n);
+    return dest;
+}
+
+__attribute__((target("avx2")))
+static void *copy_stream_avx2(void *dest, const void *src, size_t n) {
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    size_t head = -(uintptr_t)d & 31;
+    if (head > n)
+        head = n;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    for (; n >= 128; n -= 128, s += 128, d += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+    }
+    for (; n >= 32; n -= 32, s += 32, d += 32)
+        _mm256_stream_si256((__m256i *)d,
+                            _mm256_loadu_si256((const __m256i *)s));
+    _mm_sfence();
+
+    memcpy(d, s, n);
+    return dest;
+}
+
+#endif
+
+enum {
+    KERNEL_MEMCPY,
+#ifdef __x86_64__
+    KERNEL_REP_MOVSB,
+    KERNEL_AVX2,
+    KERNEL_STREAM_SSE2,
+    KERNEL_STREAM_AVX2,
+#endif
+};
+
+struct copy_kernel copy_kernels[] = {
+    [KERNEL_MEMCPY] = { "memcpy", memcpy, true },
+#ifdef __x86_64__
+    [KERNEL_REP_MOVSB] = { "rep-movsb", copy_rep_movsb, false },
+    [KERNEL_AVX2] = { "avx2", copy_avx2, false },
+    [KERNEL_STREAM_SSE2] = { "sse2-stream", copy_stream_sse2, true },
+    [KERNEL_STREAM_AVX2] = { "avx2-stream", copy_stream_avx2, false },
+#endif
+    { NULL, NULL, false },
+};
+
+size_t copy_nt_threshold = SIZE_MAX;
+
+static struct copy_kernel *medium = &copy_kernels[KERNEL_MEMCPY];
+static struct copy_kernel *large = &copy_kernels[KERNEL_MEMCPY];
+
+/*
+ * Choose the kernels once, when the library is loaded. The threshold for
+ * streaming stores is our share of the last level cache: a copy bigger than
+ * that would evict the caller's data (and most of itself) anyway. It can be
+ * overridden using VCHAN_COPY_NT_THRESHOLD.
+ */
+__attribute__((constructor))
+static void copy_init(void) {
+#ifdef __x86_64__
+    unsigned int eax, ebx, ecx, edx;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        copy_kernels[KERNEL_AVX2].supported = true;
+        copy_kernels[KERNEL_STREAM_AVX2].supported = true;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+        (ebx & CPUID_7_EBX_ERMS))
+        copy_kernels[KERNEL_REP_MOVSB].supported = true;
+
+    // The AVX2 loop doesn't beat memcpy() (see copy-bench), so it's there
+    // only for comparison
+    if (copy_kernels[KERNEL_REP_MOVSB].supported)
+        medium = &copy_kernels[KERNEL_REP_MOVSB];
+
+    if (copy_kernels[KERNEL_STREAM_AVX2].supported)
+        large = &copy_kernels[KERNEL_STREAM_AVX2];
+    else
+        large = &copy_kernels[KERNEL_STREAM_SSE2];
+
+    long cache_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (cache_size <= 0)
+        cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cache_size > 0)
+        copy_nt_threshold = cache_size / (ncpus > 0 ? ncpus : 1);
+    else
+        copy_nt_threshold = DEFAULT_NT_THRESHOLD;
+#endif
+
+    const char *s = getenv("VCHAN_COPY_NT_THRESHOLD");
+    if (s)
+        copy_nt_threshold = strtoull(s, NULL, 0);
+}
+
+void *copy_data(void *dest, const void *src, size_t n) {
+    if (n < COPY_MEDIUM_MIN)
+        return memcpy(dest, src, n);
+    if (n < copy_nt_threshold)
+        return medium->fn(dest, src, n);
+    return large->fn(dest, src, n);
+}
+
+const char *copy_medium_name(void) {
+    return medium->name;
+}
+
+const char *copy_large_name(void) {
+    return large->name;
+}
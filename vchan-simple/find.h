@@ -0,0 +1,45 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#ifndef _FIND_H
+#define _FIND_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Same as memchr()
+typedef void *(*find_fn)(const void *data, int byte, size_t n);
+
+struct find_kernel {
+    const char *name;
+    find_fn fn;
+    // Set at load time, depending on the CPU
+    bool supported;
+};
+
+// All the kernels, terminated by one with a NULL name (for copy-bench)
+extern struct find_kernel find_kernels[];
+
+void *find_byte(const void *data, int byte, size_t n);
+const char *find_kernel_name(void);
+
+#endif
@@ -25,21 +25,41 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "libvchan.h"
 #include "libvchan_private.h"
+#include "numa.h"
 
 #define SOCKET_DIR "/var/run/vchan"
 
+// For libvchan_get_memory (rings are counted in ring.c)
+static size_t channel_count;
+
 static int get_current_domain() {
     const char *s = getenv("VCHAN_DOMAIN");
     return s ? atoi(s) : 0;
 }
 
+// mlock() faults the pages in as well
+static int ring_flags(unsigned int flags) {
+    int result = 0;
+    if (flags & LIBVCHAN_PREFAULT)
+        result |= RING_PREFAULT;
+    if (flags & LIBVCHAN_MLOCK)
+        result |= RING_MLOCK;
+    return result;
+}
+
+/*
+ * With lazy_rings, the rings are allocated only when a client connects (or
+ * when the user writes something before that), unless the user wants them
+ * ready up front.
+ */
 static libvchan_t *init(
     int server_domain, int client_domain, int port,
-    size_t read_min) {
+    size_t read_min, size_t write_min, unsigned int flags, bool lazy_rings) {
 
     libvchan_t *ctrl = malloc(sizeof(*ctrl));
     if (!ctrl)
@@ -49,6 +69,21 @@ static libvchan_t *init(
     ctrl->server_fd = -1;
     ctrl->socket_fd = -1;
     ctrl->is_new = true;
+    ctrl->read_lowat = 1;
+    ctrl->write_lowat = 1;
+    ctrl->timeout = -1;
+    ctrl->ring_flags = ring_flags(flags);
+    ctrl->numa_node = -1;
+    ctrl->call_timeout = -1;
+    ctrl->buffered = false;
+    ctrl->corked = false;
+    ctrl->flush_bytes = 0;
+    ctrl->flush_usec = 0;
+    memset(&ctrl->read_rate, 0, sizeof(ctrl->read_rate));
+    memset(&ctrl->write_rate, 0, sizeof(ctrl->write_rate));
+    ctrl->forward_to = NULL;
+    ctrl->forward_from = NULL;
+    spill_init(&ctrl->spill);
 
     const char *socket_dir = getenv("VCHAN_SOCKET_DIR");
     if (!socket_dir)
@@ -61,19 +96,44 @@ static libvchan_t *init(
         return NULL;
     }
 
-    if (ring_init(&ctrl->read_ring, read_min) < 0) {
+    int main_ring_flags = ctrl->ring_flags;
+    if (lazy_rings && !(main_ring_flags & (RING_PREFAULT | RING_MLOCK)))
+        main_ring_flags |= RING_LAZY;
+    if (ring_init(&ctrl->read_ring, read_min, main_ring_flags, ctrl->numa_node) < 0) {
         free(ctrl);
         return NULL;
     }
 
+    if (ring_init(&ctrl->write_ring, write_min, main_ring_flags, ctrl->numa_node) < 0) {
+        ring_destroy(&ctrl->read_ring);
+        free(ctrl);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&channel_count, 1, __ATOMIC_RELAXED);
     return ctrl;
 }
 
 libvchan_t *libvchan_server_init(int domain, int port,
-                                 size_t read_min,
-                                 __attribute__((unused)) size_t write_min) {
+                                 size_t read_min, size_t write_min) {
+    return libvchan_server_init_flags(domain, port, read_min, write_min, 0);
+}
+
+/*
+ * There is never a separate thread, so LIBVCHAN_NO_THREAD changes nothing.
+ * LIBVCHAN_CREDITS is not supported, and neither is LIBVCHAN_MULTI_WRITER,
+ * since nothing here is thread-safe.
+ */
+libvchan_t *libvchan_server_init_flags(int domain, int port,
+                                       size_t read_min, size_t write_min,
+                                       unsigned int flags) {
+    if (flags & (LIBVCHAN_CREDITS | LIBVCHAN_MULTI_WRITER)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
     libvchan_t *ctrl = init(
-        get_current_domain(), domain, port, read_min);
+        get_current_domain(), domain, port, read_min, write_min, flags, true);
     if (!ctrl) {
         return NULL;
     }
@@ -88,8 +148,18 @@ libvchan_t *libvchan_server_init(int domain, int port,
 }
 
 libvchan_t *libvchan_client_init(int domain, int port) {
+    return libvchan_client_init_flags(domain, port, 0);
+}
+
+libvchan_t *libvchan_client_init_flags(int domain, int port,
+                                       unsigned int flags) {
+    if (flags & (LIBVCHAN_CREDITS | LIBVCHAN_MULTI_WRITER)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
     libvchan_t *ctrl = init(
-        domain, get_current_domain(), port, 1024);
+        domain, get_current_domain(), port, 1024, 1024, flags, false);
     if (!ctrl) {
         return NULL;
     }
@@ -132,13 +202,35 @@ int libvchan_client_init_async_finish(libvchan_t *ctrl,
 
 
 void libvchan_close(libvchan_t *ctrl) {
+    libvchan__forward_stop(ctrl);
+
+    // Send out any buffered data first, regardless of the timeout
+    ctrl->call_timeout = -1;
+    if (ctrl->socket_fd >= 0)
+        libvchan__flush(ctrl, true);
+
     if (ctrl->server_fd >= 0)
         if (close(ctrl->server_fd))
             perror("close server_fd");
     if (ctrl->socket_fd >= 0)
         if (close(ctrl->socket_fd))
             perror("close socket_fd");
+    ring_destroy(&ctrl->read_ring);
+    ring_destroy(&ctrl->write_ring);
+    spill_destroy(&ctrl->spill);
     free(ctrl);
+    __atomic_sub_fetch(&channel_count, 1, __ATOMIC_RELAXED);
+}
+
+int libvchan_get_memory(struct libvchan_memory *memory) {
+    size_t rings, ring_bytes;
+    ring_usage(&rings, &ring_bytes);
+
+    memset(memory, 0, sizeof(*memory));
+    memory->channels = __atomic_load_n(&channel_count, __ATOMIC_RELAXED);
+    memory->rings = rings;
+    memory->ring_bytes = ring_bytes;
+    return 0;
 }
 
 EVTCHN libvchan_fd_for_select(libvchan_t *ctrl) {
@@ -146,3 +238,144 @@ EVTCHN libvchan_fd_for_select(libvchan_t *ctrl) {
         return ctrl->socket_fd;
     return ctrl->server_fd;
 }
+
+EVTCHN libvchan_fd_for_read(libvchan_t *ctrl) {
+    return libvchan_fd_for_select(ctrl);
+}
+
+/*
+ * There is no I/O thread to signal us, so this is the socket itself: poll it
+ * for POLLOUT instead.
+ */
+EVTCHN libvchan_fd_for_write(libvchan_t *ctrl) {
+    return libvchan_fd_for_select(ctrl);
+}
+
+// There is no I/O thread here
+int libvchan_set_thread_affinity(__attribute__((unused)) libvchan_t *ctrl,
+                                 __attribute__((unused)) const int *cpus,
+                                 __attribute__((unused)) size_t ncpus) {
+    errno = EINVAL;
+    return -1;
+}
+
+int libvchan_set_thread_priority(__attribute__((unused)) libvchan_t *ctrl,
+                                 __attribute__((unused)) int policy,
+                                 __attribute__((unused)) int priority) {
+    errno = EINVAL;
+    return -1;
+}
+
+int libvchan_set_thread_stack_size(__attribute__((unused)) libvchan_t *ctrl,
+                                   __attribute__((unused)) size_t size) {
+    errno = EINVAL;
+    return -1;
+}
+
+// No I/O thread, so no LIBVCHAN_NUMA_THREAD
+int libvchan_set_numa_node(libvchan_t *ctrl, int node) {
+    if (node != LIBVCHAN_NUMA_DEFAULT && !numa_has_node(node)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (numa_nodes() <= 1)
+        return 0;
+
+    ctrl->numa_node = node;
+    if (ring_set_node(&ctrl->read_ring, node) ||
+        ring_set_node(&ctrl->write_ring, node))
+        return -1;
+    return 0;
+}
+
+// There is no I/O thread to complete the operations in the background
+int libvchan_submit_read(__attribute__((unused)) libvchan_t *ctrl,
+                         __attribute__((unused)) void *data,
+                         __attribute__((unused)) size_t size,
+                         __attribute__((unused)) void *user_data) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int libvchan_submit_write(__attribute__((unused)) libvchan_t *ctrl,
+                          __attribute__((unused)) const void *data,
+                          __attribute__((unused)) size_t size,
+                          __attribute__((unused)) void *user_data) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+EVTCHN libvchan_fd_for_completion(__attribute__((unused)) libvchan_t *ctrl) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int libvchan_get_completions(__attribute__((unused)) libvchan_t *ctrl,
+                             __attribute__((unused))
+                             struct libvchan_completion *completions,
+                             __attribute__((unused)) int max) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+// Streams need LIBVCHAN_CREDITS. Only stream 0, the channel itself, exists.
+int libvchan_stream_open(__attribute__((unused)) libvchan_t *ctrl,
+                         __attribute__((unused)) unsigned int stream,
+                         __attribute__((unused)) size_t read_min,
+                         __attribute__((unused)) size_t write_min,
+                         __attribute__((unused)) int priority) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int libvchan_stream_write(libvchan_t *ctrl, unsigned int stream,
+                          const void *data, size_t size) {
+    if (stream != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return libvchan_write(ctrl, data, size);
+}
+
+int libvchan_stream_send(libvchan_t *ctrl, unsigned int stream,
+                         const void *data, size_t size) {
+    if (stream != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return libvchan_send(ctrl, data, size);
+}
+
+int libvchan_stream_read(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size) {
+    if (stream != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return libvchan_read(ctrl, data, size);
+}
+
+int libvchan_stream_recv(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size) {
+    if (stream != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return libvchan_recv(ctrl, data, size);
+}
+
+int libvchan_stream_data_ready(libvchan_t *ctrl, unsigned int stream) {
+    if (stream != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return libvchan_data_ready(ctrl);
+}
+
+int libvchan_stream_buffer_space(libvchan_t *ctrl, unsigned int stream) {
+    if (stream != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return libvchan_buffer_space(ctrl);
+}
@@ -22,50 +22,229 @@
 #define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
 #include <assert.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <fcntl.h>
 #include "libvchan.h"
 #include "libvchan_private.h"
 
-static int do_read(libvchan_t *ctrl, void *data,
-                   size_t min_size, size_t max_size);
-static int do_write(libvchan_t *ctrl, const void *data,
-                    size_t min_size, size_t max_size);
-static int read_pending(libvchan_t *ctrl);
+// State of libvchan_pump()
+struct pump {
+    int in_fd;
+    int out_fd;
+    // splice() to / from the socket directly (the other end is a pipe)
+    bool in_splice;
+    bool out_splice;
+    // poll() events seen for in_fd, out_fd and the socket, until a transfer
+    // would block
+    short in_ready;
+    short out_ready;
+    short socket_ready;
+    bool in_done;
+    bool out_done;
+    // LIBVCHAN_PUMP_HANGUP, and whether we already did
+    bool hangup;
+    bool hung_up;
+};
+
+static ssize_t do_read(libvchan_t *ctrl, void *data,
+                       size_t min_size, size_t max_size);
+static ssize_t read_parts(libvchan_t *ctrl, void *data, size_t size);
+static ssize_t do_write(libvchan_t *ctrl, const struct iovec *iov, int iovcnt,
+                        size_t min_size, size_t max_size);
+static size_t int_size(size_t size);
+static bool fits_int(size_t size);
+static size_t read_pending(libvchan_t *ctrl);
+static ssize_t socket_read(libvchan_t *ctrl, void *data, size_t size);
+static ssize_t socket_write(libvchan_t *ctrl, const void *data, size_t size);
+static ssize_t socket_writev(libvchan_t *ctrl, const struct iovec *iov,
+                             int iovcnt, size_t skip, size_t size);
+static int throttle_events(libvchan_t *ctrl, struct pollfd *pfd, int timeout);
+static ssize_t direct_read(libvchan_t *ctrl, void *data,
+                           size_t min_size, size_t wanted, size_t max_size);
+static bool write_timed_out(libvchan_t *ctrl, const struct iovec *iov,
+                            int iovcnt, size_t *size,
+                            size_t min_size, size_t max_size);
+static size_t queue_write(libvchan_t *ctrl, const struct iovec *iov,
+                          int iovcnt, size_t skip, size_t size);
+static bool spill_rest(libvchan_t *ctrl, const struct iovec *iov, int iovcnt,
+                       size_t *size, size_t min_size, size_t max_size);
+static int spill_refill(libvchan_t *ctrl);
+static bool holding_writes(libvchan_t *ctrl);
+static bool flush_due(libvchan_t *ctrl);
+static size_t socket_space(libvchan_t *ctrl);
+static ssize_t buffered_write(libvchan_t *ctrl,
+                              const struct iovec *iov, int iovcnt,
+                              size_t min_size, size_t wanted, size_t max_size);
+static int wait_event(libvchan_t *ctrl);
 static int wait_for_read(libvchan_t *ctrl);
 static int wait_for_write(libvchan_t *ctrl);
 static int wait_for_connection(libvchan_t *ctrl);
 static void close_socket(libvchan_t *ctrl);
+static short poll_prepare(libvchan_t *ctrl, short events, struct pollfd *pfd);
+static short poll_check(libvchan_t *ctrl, short events, short revents);
+static struct timespec *get_deadline(int timeout, struct timespec *deadline);
+static void start_timer(libvchan_t *ctrl, int timeout);
+static bool timed_out(void);
+static int poll_deadline(libvchan_t *ctrl, struct pollfd *fds, const char *what);
+static int poll_timeout(const struct timespec *deadline);
+static int add_link(libvchan_t *from, libvchan_t *to);
+static void stop_forward(libvchan_t *from);
+static void forward_step(libvchan_t *from);
+static bool forward_splice(libvchan_t *from);
+static bool pump_in(libvchan_t *ctrl, struct pump *pump);
+static bool pump_out(libvchan_t *ctrl, struct pump *pump);
+static int pump_poll(libvchan_t *ctrl, struct pump *pump);
+static bool is_pipe(int fd);
+static int set_nonblock(int fd);
 
 int libvchan_read(libvchan_t *ctrl, void *data, size_t size) {
-    return do_read(ctrl, data, 1, size);
+    return do_read(ctrl, data, 1, int_size(size));
 }
 
 int libvchan_recv(libvchan_t *ctrl, void *data, size_t size) {
+    if (!fits_int(size))
+        return -1;
     return do_read(ctrl, data, size, size);
 }
 
 int libvchan_write(libvchan_t *ctrl, const void *data, size_t size) {
-    return do_write(ctrl, data, 1, size);
+    struct iovec iov = { (void *)data, int_size(size) };
+    return do_write(ctrl, &iov, 1, 1, iov.iov_len);
 }
 
 int libvchan_send(libvchan_t *ctrl, const void *data, size_t size) {
-    return do_write(ctrl, data, size, size);
+    if (!fits_int(size))
+        return -1;
+    struct iovec iov = { (void *)data, size };
+    return do_write(ctrl, &iov, 1, size, size);
 }
 
-static int do_read(libvchan_t *ctrl, void *data, size_t min_size, size_t max_size) {
-    size_t size = ring_filled(&ctrl->read_ring);
-    while (size < min_size) {
-        if (libvchan_wait(ctrl) < 0) {
+int libvchan_sendv(libvchan_t *ctrl, const struct iovec *iov, int iovcnt) {
+    size_t size = iov_size(iov, iovcnt);
+    if (!fits_int(size))
+        return -1;
+    return do_write(ctrl, iov, iovcnt, size, size);
+}
+
+ssize_t libvchan_read64(libvchan_t *ctrl, void *data, size_t size) {
+    return do_read(ctrl, data, 1, size);
+}
+
+ssize_t libvchan_recv64(libvchan_t *ctrl, void *data, size_t size) {
+    return do_read(ctrl, data, size, size);
+}
+
+ssize_t libvchan_write64(libvchan_t *ctrl, const void *data, size_t size) {
+    struct iovec iov = { (void *)data, size };
+    return do_write(ctrl, &iov, 1, 1, size);
+}
+
+ssize_t libvchan_send64(libvchan_t *ctrl, const void *data, size_t size) {
+    struct iovec iov = { (void *)data, size };
+    return do_write(ctrl, &iov, 1, size, size);
+}
+
+/*
+ * Write all the messages with one writev(), and stop at whatever the socket
+ * (or write_ring) doesn't take right away. A message cut in the middle is
+ * finished with a blocking write, regardless of the timeout, so that it's
+ * never left half-sent unless the channel is gone. Then we fail, but still
+ * report the whole messages sent before it.
+ */
+int libvchan_send_batch(libvchan_t *ctrl, const struct iovec *msgs, int n,
+                        int *sent) {
+    *sent = 0;
+    if (n == 0)
+        return 0;
+
+    if (!fits_int(msgs[0].iov_len))
+        return -1;
+    int result = do_write(ctrl, msgs, n, msgs[0].iov_len,
+                          int_size(iov_size(msgs, n)));
+    if (result < 0)
+        return -1;
+
+    size_t size;
+    int count = iov_whole(msgs, n, result, &size);
+    if (size < (size_t)result) {
+        size_t done = result - size;
+        struct iovec rest = {
+            (uint8_t *)msgs[count].iov_base + done,
+            msgs[count].iov_len - done,
+        };
+        int timeout = ctrl->timeout;
+        ctrl->timeout = -1;
+        int ret = do_write(ctrl, &rest, 1, rest.iov_len, rest.iov_len);
+        ctrl->timeout = timeout;
+        if (ret < 0) {
+            *sent = count;
             return -1;
         }
-        if (libvchan_is_open(ctrl) == VCHAN_DISCONNECTED)
+        size += msgs[count].iov_len;
+        count++;
+    }
+    *sent = count;
+    return size;
+}
+
+// The int variants return at most INT_MAX
+static size_t int_size(size_t size) {
+    return size > INT_MAX ? INT_MAX : size;
+}
+
+// ... so a send or recv of more than that has to use the 64-bit variants
+static bool fits_int(size_t size) {
+    if (size > INT_MAX) {
+        errno = EOVERFLOW;
+        return false;
+    }
+    return true;
+}
+
+static ssize_t do_read(libvchan_t *ctrl, void *data,
+                       size_t min_size, size_t max_size) {
+    // The data goes elsewhere (see libvchan_forward, libvchan_pump)
+    if (ctrl->forward_to) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // Would never fit in read_ring at once
+    if (min_size > ctrl->read_ring.size)
+        return read_parts(ctrl, data, min_size);
+
+    size_t wanted = ctrl->read_lowat < max_size ? ctrl->read_lowat : max_size;
+    if (wanted < min_size)
+        wanted = min_size;
+
+    start_timer(ctrl, ctrl->timeout);
+    size_t size = ring_filled(&ctrl->read_ring);
+    // Make sure the other side gets our request before we wait for a reply
+    if (size < wanted && !ctrl->corked)
+        libvchan__flush(ctrl, true);
+    while (size < wanted) {
+        // Nothing buffered, so there is no need to go through read_ring
+        if (size == 0 && ctrl->socket_fd >= 0)
+            return direct_read(ctrl, data, min_size, wanted, max_size);
+
+        if (wait_event(ctrl) < 0) {
+            if (!timed_out())
+                return -1;
+            size = ring_filled(&ctrl->read_ring);
             break;
+        }
         size = ring_filled(&ctrl->read_ring);
+        if (libvchan_is_open(ctrl) == VCHAN_DISCONNECTED)
+            break;
     }
 
     if (size < min_size)
@@ -74,22 +253,107 @@ static int do_read(libvchan_t *ctrl, void *data, size_t min_size, size_t max_siz
     if (size > max_size)
         size = max_size;
 
-    memcpy(data, ring_head(&ctrl->read_ring), size);
+    copy_data(data, ring_head(&ctrl->read_ring), size);
     ring_advance_head(&ctrl->read_ring, size);
 
     return size;
 }
 
-static int do_write(libvchan_t *ctrl, const void *data,
-                    size_t min_size, size_t max_size) {
+/*
+ * Receive a message larger than read_ring, as it arrives. If the channel
+ * is closed (or the call times out) in the middle, the part already read is
+ * lost.
+ */
+static ssize_t read_parts(libvchan_t *ctrl, void *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = do_read(ctrl, (uint8_t *)data + done, 1, size - done);
+        if (count < 0)
+            return -1;
+        done += count;
+    }
+    return done;
+}
+
+/*
+ * Read from the socket straight into the caller's buffer, until at least
+ * wanted bytes are read. If we get disconnected (or time out) before reading
+ * min_size bytes, keep what we got in read_ring for the next read.
+ */
+static ssize_t direct_read(libvchan_t *ctrl, void *data,
+                           size_t min_size, size_t wanted, size_t max_size) {
+    size_t size = 0;
+
+    while (size < wanted && ctrl->socket_fd >= 0) {
+        size_t count = max_size - size;
+        // With a timeout, don't read more than read_ring can keep
+        if (ctrl->call_timeout >= 0 && size < min_size &&
+            count > ring_available(&ctrl->read_ring) - size) {
+            count = ring_available(&ctrl->read_ring) - size;
+            if (count == 0) {
+                errno = ctrl->call_timeout == 0 ? EAGAIN : ETIMEDOUT;
+                break;
+            }
+        }
+        ssize_t ret = socket_read(ctrl, (uint8_t *)data + size, count);
+        if (ret > 0) {
+            size += ret;
+            continue;
+        }
+        if (ret == 0 || errno == ECONNRESET) {
+            close_socket(ctrl);
+            break;
+        }
+        if (errno != EAGAIN) {
+            perror("read");
+            return -1;
+        }
+
+        struct pollfd fds[1];
+        fds[0].fd = ctrl->socket_fd;
+        fds[0].events = POLLIN;
+        if (flush_due(ctrl))
+            fds[0].events |= POLLOUT;
+        if (poll_deadline(ctrl, fds, "poll read socket") < 0) {
+            if (!timed_out())
+                return -1;
+            break;
+        }
+        if (fds[0].revents & POLLOUT)
+            libvchan__flush(ctrl, false);
+    }
+
+    if (size < min_size) {
+        // Anything more than that would have never fit in read_ring anyway
+        if (size > ring_available(&ctrl->read_ring))
+            size = ring_available(&ctrl->read_ring);
+        copy_data(ring_tail(&ctrl->read_ring), data, size);
+        ring_advance_tail(&ctrl->read_ring, size);
+        return -1;
+    }
+    return size;
+}
+
+static ssize_t do_write(libvchan_t *ctrl, const struct iovec *iov, int iovcnt,
+                        size_t min_size, size_t max_size) {
     if (max_size == 0)
         return 0;
 
+    size_t wanted = ctrl->write_lowat < max_size ? ctrl->write_lowat : max_size;
+    if (wanted < min_size)
+        wanted = min_size;
+
+    start_timer(ctrl, ctrl->timeout);
+    if (ctrl->buffered || holding_writes(ctrl) ||
+        ring_filled(&ctrl->write_ring) > 0 || spill_pending(&ctrl->spill) > 0)
+        return buffered_write(ctrl, iov, iovcnt, min_size, wanted, max_size);
+
     size_t size = 0;
 
     for (;;) {
         if (ctrl->socket_fd >= 0) {
-            int ret = write(ctrl->socket_fd, data + size, max_size - size);
+            ssize_t ret = socket_writev(ctrl, iov, iovcnt, size,
+                                        max_size - size);
             if (ret < 0) {
                 if (errno == EAGAIN)
                     ret = 0;
@@ -102,22 +366,290 @@ static int do_write(libvchan_t *ctrl, const void *data,
                 }
             }
             size += ret;
-            if (size >= min_size)
+            if (size >= wanted)
                 break;
 
-            wait_for_write(ctrl);
+            if (spill_rest(ctrl, iov, iovcnt, &size, min_size, max_size))
+                break;
+            if (wait_for_write(ctrl) < 0) {
+                if (!timed_out())
+                    return -1;
+                if (write_timed_out(ctrl, iov, iovcnt, &size,
+                                    min_size, max_size))
+                    break;
+                continue;
+            }
             if (ctrl->socket_fd < 0)
                 break;
         } else if (libvchan_is_open(ctrl) == VCHAN_DISCONNECTED)
             break;
-        else
-            libvchan_wait(ctrl);
+        else if (spill_rest(ctrl, iov, iovcnt, &size, min_size, max_size))
+            break;
+        else if (wait_event(ctrl) < 0) {
+            if (!timed_out())
+                return -1;
+            if (write_timed_out(ctrl, iov, iovcnt, &size, min_size, max_size))
+                break;
+        }
     }
     if (size < min_size)
         return -1;
     return size;
 }
 
+/*
+ * Write through write_ring. The data is sent when it's due according to the
+ * autoflush settings, or when write_ring fills up. If there is nothing to
+ * hold back, write to the socket directly first and buffer only the rest.
+ */
+static ssize_t buffered_write(libvchan_t *ctrl,
+                              const struct iovec *iov, int iovcnt,
+                              size_t min_size, size_t wanted, size_t max_size) {
+    size_t size = 0;
+
+    if (libvchan_is_open(ctrl) == VCHAN_DISCONNECTED)
+        return -1;
+
+    if (ctrl->socket_fd >= 0 && ring_filled(&ctrl->write_ring) == 0 &&
+        spill_pending(&ctrl->spill) == 0 && !holding_writes(ctrl)) {
+        ssize_t ret = socket_writev(ctrl, iov, iovcnt, 0, max_size);
+        if (ret < 0) {
+            if (errno == EPIPE || errno == ECONNRESET) {
+                close_socket(ctrl);
+                return -1;
+            } else if (errno != EAGAIN) {
+                perror("write");
+                return -1;
+            }
+            ret = 0;
+        }
+        size = ret;
+    }
+
+    for (;;) {
+        // Spilled data goes first, and a message only once it can't be cut
+        // in half by a timeout
+        if (spill_pending(&ctrl->spill) == 0 &&
+            (size > 0 || ring_available(&ctrl->write_ring) >= min_size ||
+             min_size > ctrl->write_ring.size))
+            size += queue_write(ctrl, iov, iovcnt, size, max_size - size);
+        if (size >= wanted)
+            break;
+
+        // Buffer full, spill the rest or make some space
+        if (spill_rest(ctrl, iov, iovcnt, &size, min_size, max_size))
+            break;
+        if (libvchan__flush(ctrl, true) < 0) {
+            // Finish a message that has started, past the timeout
+            if (size == 0 || size >= min_size || !timed_out())
+                break;
+            start_timer(ctrl, -1);
+        }
+    }
+
+    if (size < min_size)
+        return -1;
+    if (flush_due(ctrl) && libvchan__flush(ctrl, false) < 0)
+        return -1;
+    return size;
+}
+
+/*
+ * A write timed out after size bytes. Keep the rest for later, as much as
+ * fits in write_ring, but don't cut a message (min_size) in half: if the rest
+ * of it doesn't fit, fail if none of it has gone out yet, or else finish it
+ * past the timeout. Returns false if the caller has to carry on writing.
+ */
+static bool write_timed_out(libvchan_t *ctrl, const struct iovec *iov,
+                            int iovcnt, size_t *size,
+                            size_t min_size, size_t max_size) {
+    if (*size + ring_available(&ctrl->write_ring) < min_size) {
+        if (*size == 0)
+            return true;
+        start_timer(ctrl, -1);
+        return false;
+    }
+    *size += queue_write(ctrl, iov, iovcnt, *size, max_size - *size);
+    return true;
+}
+
+// Add as much data to write_ring as fits (size bytes of iov, from skip)
+static size_t queue_write(libvchan_t *ctrl, const struct iovec *iov,
+                          int iovcnt, size_t skip, size_t size) {
+    size_t count = ring_available(&ctrl->write_ring);
+    if (count > size)
+        count = size;
+    // Written before a client connected?
+    if (count > 0 && ring_map(&ctrl->write_ring) < 0)
+        return 0;
+    if (ring_filled(&ctrl->write_ring) == 0)
+        clock_gettime(CLOCK_MONOTONIC, &ctrl->write_start);
+    iov_gather(ring_tail(&ctrl->write_ring), iov, iovcnt, skip, count);
+    ring_advance_tail(&ctrl->write_ring, count);
+    return count;
+}
+
+/*
+ * Instead of waiting for space, put what fits in write_ring, and the rest in
+ * the spill buffer, after anything spilled before. Returns false if less than
+ * min_size fits even then.
+ */
+static bool spill_rest(libvchan_t *ctrl, const struct iovec *iov, int iovcnt,
+                       size_t *size, size_t min_size, size_t max_size) {
+    struct spill *spill = &ctrl->spill;
+    size_t ring_size = spill_pending(spill) == 0 ?
+        ring_available(&ctrl->write_ring) : 0;
+    size_t count = ring_size + spill_space(spill);
+    if (count > max_size - *size)
+        count = max_size - *size;
+    if (spill->max == 0 || count == 0 || *size + count < min_size)
+        return false;
+
+    if (ring_size > count)
+        ring_size = count;
+    size_t queued = queue_write(ctrl, iov, iovcnt, *size, ring_size);
+    *size += queued;
+    if (queued < ring_size)
+        return *size >= min_size;
+    if (count > ring_size) {
+        if (spill_write(spill, iov, iovcnt, *size, count - ring_size) < 0)
+            return queued > 0 && *size >= min_size;
+        *size += count - ring_size;
+    }
+    return true;
+}
+
+// Move spilled data into write_ring, as much as fits
+static int spill_refill(libvchan_t *ctrl) {
+    size_t size = spill_pending(&ctrl->spill);
+    if (size > ring_available(&ctrl->write_ring))
+        size = ring_available(&ctrl->write_ring);
+    if (size == 0)
+        return 0;
+    if (ring_filled(&ctrl->write_ring) == 0)
+        clock_gettime(CLOCK_MONOTONIC, &ctrl->write_start);
+    if (spill_read(&ctrl->spill, ring_tail(&ctrl->write_ring), size) < 0)
+        return -1;
+    ring_advance_tail(&ctrl->write_ring, size);
+    return 0;
+}
+
+static bool holding_writes(libvchan_t *ctrl) {
+    return ctrl->corked || ctrl->flush_bytes > 0 || ctrl->flush_usec > 0;
+}
+
+static bool flush_due(libvchan_t *ctrl) {
+    size_t filled = ring_filled(&ctrl->write_ring);
+
+    if (filled == 0)
+        return false;
+    if (!holding_writes(ctrl))
+        return true;
+    if (ring_available(&ctrl->write_ring) == 0 ||
+        (ctrl->flush_bytes > 0 && filled >= ctrl->flush_bytes))
+        return true;
+    if (ctrl->flush_usec > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long elapsed =
+            (now.tv_sec - ctrl->write_start.tv_sec) * 1000000LL +
+            (now.tv_nsec - ctrl->write_start.tv_nsec) / 1000;
+        if (elapsed >= ctrl->flush_usec)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Send out data from write_ring. If block is set, wait until everything is
+ * written, otherwise write only as much as the socket accepts.
+ * Returns -1 if we got disconnected before writing everything.
+ */
+int libvchan__flush(libvchan_t *ctrl, bool block) {
+    for (;;) {
+        // Spilled data follows through write_ring
+        if (spill_refill(ctrl) < 0)
+            return -1;
+        if (ring_filled(&ctrl->write_ring) == 0)
+            break;
+        if (ctrl->socket_fd < 0) {
+            if (!block)
+                return 0;
+            if (ctrl->server_fd < 0 || !ctrl->is_new)
+                return -1;
+            if (wait_for_connection(ctrl) < 0)
+                return -1;
+            continue;
+        }
+
+        ssize_t ret = socket_write(ctrl, ring_head(&ctrl->write_ring),
+                                   ring_filled(&ctrl->write_ring));
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                if (!block)
+                    return 0;
+                if (wait_for_write(ctrl) < 0)
+                    return -1;
+                continue;
+            } else if (errno == EPIPE || errno == ECONNRESET) {
+                close_socket(ctrl);
+                return -1;
+            } else {
+                perror("write");
+                return -1;
+            }
+        }
+        ring_advance_head(&ctrl->write_ring, ret);
+    }
+    return 0;
+}
+
+int libvchan_cork(libvchan_t *ctrl) {
+    ctrl->corked = true;
+    return 0;
+}
+
+/*
+ * There is no I/O thread, so the data is written out right away.
+ */
+int libvchan_uncork(libvchan_t *ctrl) {
+    ctrl->corked = false;
+    start_timer(ctrl, -1);
+    return libvchan__flush(ctrl, true);
+}
+
+/*
+ * There is no I/O thread, so flush_usec is checked only on the next write.
+ * Also, any pending data is flushed before waiting in libvchan_read() and
+ * libvchan_recv().
+ */
+int libvchan_set_autoflush(libvchan_t *ctrl, size_t flush_bytes,
+                           unsigned int flush_usec) {
+    ctrl->flush_bytes = flush_bytes;
+    ctrl->flush_usec = flush_usec;
+    if (flush_due(ctrl))
+        return libvchan__flush(ctrl, false);
+    return 0;
+}
+
+int libvchan_set_buffered_writes(libvchan_t *ctrl, bool enable) {
+    ctrl->buffered = enable;
+    start_timer(ctrl, -1);
+    if (!enable)
+        return libvchan__flush(ctrl, true);
+    return 0;
+}
+
+/*
+ * There is no I/O thread, so spilled data is sent only as the buffer is
+ * flushed: by later calls, or libvchan_process() (which waits for POLLOUT
+ * until it's all sent).
+ */
+int libvchan_set_spill(libvchan_t *ctrl, size_t max_size) {
+    ctrl->spill.max = max_size;
+    return 0;
+}
+
 /*
  * Wait for state to change: either new data to read, or connect/disconnect.
  *
@@ -125,6 +657,22 @@ static int do_write(libvchan_t *ctrl, const void *data,
  * (it will either read pending data, or accept a connection).
  */
 int libvchan_wait(libvchan_t *ctrl) {
+    return libvchan_wait_timeout(ctrl, -1);
+}
+
+int libvchan_wait_timeout(libvchan_t *ctrl, int timeout) {
+    start_timer(ctrl, timeout);
+    return wait_event(ctrl);
+}
+
+int libvchan_set_timeout(libvchan_t *ctrl, int timeout) {
+    ctrl->timeout = timeout < 0 ? -1 : timeout;
+    return 0;
+}
+
+static int wait_event(libvchan_t *ctrl) {
+    if (flush_due(ctrl) && libvchan__flush(ctrl, false) < 0)
+        return 0;
     if (ctrl->socket_fd > 0)
         return wait_for_read(ctrl);
     if (ctrl->server_fd > 0 && ctrl->is_new)
@@ -132,32 +680,37 @@ int libvchan_wait(libvchan_t *ctrl) {
     return 0;
 }
 
-// Wait for socket to become readable (or disconnection)
+// Wait for socket to become readable (or disconnection), until at least
+// read_lowat bytes are buffered
 static int wait_for_read(libvchan_t *ctrl) {
     assert(ctrl->socket_fd >= 0);
 
     // Some data already available?
-    if (read_pending(ctrl) > 0)
-        return 0;
-
-    // Got disconnected while reading?
-    if (ctrl->socket_fd < 0)
+    if (read_pending(ctrl) > 0 &&
+        ring_filled(&ctrl->read_ring) >= ctrl->read_lowat)
         return 0;
 
     struct pollfd fds[1];
-    fds[0].fd = ctrl->socket_fd;
-    fds[0].events = POLLIN | POLLHUP;
-    while (poll(fds, 1, -1) < 0) {
-        if (errno != EINTR) {
-            perror("poll wait socket");
+    // Got disconnected while reading?
+    while (ctrl->socket_fd >= 0) {
+        fds[0].fd = ctrl->socket_fd;
+        // Keep sending buffered data in the meantime
+        fds[0].events = POLLIN | POLLHUP;
+        if (flush_due(ctrl))
+            fds[0].events |= POLLOUT;
+        if (poll_deadline(ctrl, fds, "poll wait socket") < 0)
             return -1;
-        }
-    }
 
-    if (fds[0].revents & POLLIN)
-        read_pending(ctrl);
-    if (ctrl->socket_fd >= 0 && fds[0].revents & POLLHUP)
-        close_socket(ctrl);
+        if (fds[0].revents & POLLOUT)
+            libvchan__flush(ctrl, false);
+        if (ctrl->socket_fd >= 0 && fds[0].revents & POLLIN)
+            read_pending(ctrl);
+        if (ctrl->socket_fd >= 0 && fds[0].revents & POLLHUP)
+            close_socket(ctrl);
+
+        if (ring_filled(&ctrl->read_ring) >= ctrl->read_lowat)
+            break;
+    }
 
     return 0;
 }
@@ -167,12 +720,24 @@ static int wait_for_connection(libvchan_t *ctrl) {
     assert(ctrl->server_fd >= 0);
     assert(ctrl->socket_fd < 0);
 
+    struct pollfd fds[1];
+    fds[0].fd = ctrl->server_fd;
+    fds[0].events = POLLIN;
+    if (poll_deadline(ctrl, fds, "poll wait connection") < 0)
+        return -1;
+
     int socket_fd = accept4(ctrl->server_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
     if (socket_fd < 0) {
         perror("accept");
         return -1;
     }
 
+    // The rings are allocated once a client connects (see init)
+    if (ring_map(&ctrl->read_ring) < 0 || ring_map(&ctrl->write_ring) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
     ctrl->socket_fd = socket_fd;
     return 0;
 }
@@ -184,44 +749,881 @@ static int wait_for_write(libvchan_t *ctrl) {
     struct pollfd fds[1];
     fds[0].fd = ctrl->socket_fd;
     fds[0].events = POLLOUT | POLLHUP;
+    if (poll_deadline(ctrl, fds, "poll wait") < 0)
+        return -1;
+
+    if (fds[0].revents & POLLHUP)
+        close_socket(ctrl);
+
+    return 0;
+}
+
+/*
+ * Wait on many channels at once. There is no I/O thread, so this polls the
+ * sockets directly, reading and flushing the channels as they become ready.
+ * The set can differ on every call, so this uses poll(): an epoll instance
+ * would have to be built and torn down each time.
+ */
+int libvchan_poll(struct libvchan_pollfd *fds, size_t nfds, int timeout) {
+    struct timespec deadline_buf;
+    struct timespec *deadline = get_deadline(timeout, &deadline_buf);
+
+    struct pollfd *pfds = calloc(nfds > 0 ? nfds : 1, sizeof(*pfds));
+    if (!pfds) {
+        perror("calloc");
+        return -1;
+    }
+
+    int ready;
+    for (;;) {
+        ready = 0;
+        for (size_t i = 0; i < nfds; i++) {
+            fds[i].revents = poll_prepare(fds[i].ctrl, fds[i].events, &pfds[i]);
+            if (fds[i].revents)
+                ready++;
+        }
+
+        int wait_ms = ready > 0 ? 0 : poll_timeout(deadline);
+        for (size_t i = 0; i < nfds; i++)
+            wait_ms = throttle_events(fds[i].ctrl, &pfds[i], wait_ms);
+        int ret = poll(pfds, nfds, wait_ms);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll channels");
+            free(pfds);
+            return -1;
+        }
+
+        for (size_t i = 0; i < nfds && ret > 0; i++) {
+            if (!pfds[i].revents)
+                continue;
+            short old_revents = fds[i].revents;
+            fds[i].revents = poll_check(fds[i].ctrl, fds[i].events,
+                                        pfds[i].revents);
+            if (!old_revents && fds[i].revents)
+                ready++;
+        }
+
+        // Stop waiting at the deadline, not when a rate limit runs out
+        if (ready > 0 || (ret == 0 && poll_timeout(deadline) == 0))
+            break;
+    }
+
+    free(pfds);
+    return ready;
+}
+
+/*
+ * Check which of the requested events are ready without touching the socket,
+ * and set up pfd to wait for the rest.
+ */
+static short poll_prepare(libvchan_t *ctrl, short events, struct pollfd *pfd) {
+    short revents = 0;
+    bool ring_writes = ctrl->buffered || holding_writes(ctrl) ||
+        ring_filled(&ctrl->write_ring) > 0;
+
+    pfd->fd = -1;
+    pfd->events = 0;
+    switch (libvchan_is_open(ctrl)) {
+    case VCHAN_DISCONNECTED:
+        if (events & LIBVCHAN_POLLIN && ring_filled(&ctrl->read_ring) > 0)
+            revents |= LIBVCHAN_POLLIN;
+        return revents | LIBVCHAN_POLLHUP;
 
-    while (poll(fds, 1, -1) < 0) {
+    case VCHAN_WAITING:
+        pfd->fd = ctrl->server_fd;
+        pfd->events = POLLIN;
+        break;
+
+    case VCHAN_CONNECTED:
+        // Always watched: poll() reports POLLHUP even with no events set
+        pfd->fd = ctrl->socket_fd;
+        if (events & LIBVCHAN_POLLIN)
+            pfd->events |= POLLIN;
+        if ((events & LIBVCHAN_POLLOUT && !ring_writes) || flush_due(ctrl))
+            pfd->events |= POLLOUT;
+        break;
+    }
+
+    if (events & LIBVCHAN_POLLIN &&
+        ring_filled(&ctrl->read_ring) >= ctrl->read_lowat)
+        revents |= LIBVCHAN_POLLIN;
+    if (events & LIBVCHAN_POLLOUT && ring_writes &&
+        ring_available(&ctrl->write_ring) >= ctrl->write_lowat)
+        revents |= LIBVCHAN_POLLOUT;
+    return revents;
+}
+
+// Handle the events on socket (or server socket) and check again
+static short poll_check(libvchan_t *ctrl, short events, short revents) {
+    if (ctrl->socket_fd < 0) {
+        if (ctrl->server_fd >= 0 && ctrl->is_new && revents & POLLIN &&
+            wait_for_connection(ctrl) < 0)
+            return 0;
+    } else {
+        if (revents & POLLOUT && flush_due(ctrl))
+            libvchan__flush(ctrl, false);
+        if (ctrl->socket_fd >= 0 && !ctrl->forward_to &&
+            revents & (POLLIN | POLLHUP | POLLERR))
+            read_pending(ctrl);
+    }
+
+    struct pollfd pfd;
+    short result = poll_prepare(ctrl, events, &pfd);
+    // Socket writable, and writes go there directly
+    if (events & LIBVCHAN_POLLOUT && revents & POLLOUT &&
+        ctrl->socket_fd >= 0 && !ctrl->buffered && !holding_writes(ctrl) &&
+        ring_filled(&ctrl->write_ring) == 0)
+        result |= LIBVCHAN_POLLOUT;
+    return result;
+}
+
+// Deadline for a timeout in milliseconds, or NULL if there is none
+static struct timespec *get_deadline(int timeout, struct timespec *deadline) {
+    if (timeout < 0)
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+    return deadline;
+}
+
+// Set the deadline for the current call (see libvchan_set_timeout)
+static void start_timer(libvchan_t *ctrl, int timeout) {
+    ctrl->call_timeout = timeout;
+    get_deadline(timeout, &ctrl->deadline);
+}
+
+static bool timed_out(void) {
+    return errno == ETIMEDOUT || errno == EAGAIN;
+}
+
+/*
+ * poll() until the deadline of the current call. Returns -1 with errno set to
+ * ETIMEDOUT (EAGAIN if the timeout is 0) if it passed.
+ */
+static int poll_deadline(libvchan_t *ctrl, struct pollfd *fds, const char *what) {
+    const struct timespec *deadline =
+        ctrl->call_timeout >= 0 ? &ctrl->deadline : NULL;
+    int timeout = poll_timeout(deadline);
+    int limited = throttle_events(ctrl, &fds[0], timeout);
+    int ret;
+
+    while ((ret = poll(fds, 1, limited)) < 0) {
         if (errno != EINTR) {
-            perror("poll wait");
+            perror(what);
             return -1;
         }
     }
+    if (ret == 0) {
+        // Woken up by the rate limit, the caller can try again
+        if (limited != timeout && poll_timeout(deadline) != 0)
+            return 0;
+        errno = ctrl->call_timeout == 0 ? EAGAIN : ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
 
-    if (fds[0].revents & POLLHUP)
-        close_socket(ctrl);
+/*
+ * While over the rate limit, don't wait for the socket to become ready in
+ * that direction, but for the limit to allow more. Returns the new poll()
+ * timeout.
+ */
+static int throttle_events(libvchan_t *ctrl, struct pollfd *pfd, int timeout) {
+    long long delay = -1;
 
+    if (pfd->fd < 0 || pfd->fd != ctrl->socket_fd)
+        return timeout;
+    if (pfd->events & POLLIN) {
+        long long read_delay = rate_delay(&ctrl->read_rate);
+        if (read_delay > 0) {
+            pfd->events &= ~POLLIN;
+            ctrl->read_rate.throttled++;
+            delay = read_delay;
+        }
+    }
+    if (pfd->events & POLLOUT) {
+        long long write_delay = rate_delay(&ctrl->write_rate);
+        if (write_delay > 0) {
+            pfd->events &= ~POLLOUT;
+            ctrl->write_rate.throttled++;
+            if (delay < 0 || write_delay < delay)
+                delay = write_delay;
+        }
+    }
+    if (delay > 0) {
+        long long ms = (delay + 999999) / 1000000;
+        if (timeout < 0 || ms < timeout)
+            timeout = ms;
+    }
+    return timeout;
+}
+
+/*
+ * Socket transfers, within the rate limits. Over the limit, fail with EAGAIN
+ * as if the socket wasn't ready (see throttle_events).
+ */
+static ssize_t socket_read(libvchan_t *ctrl, void *data, size_t size) {
+    if (rate_delay(&ctrl->read_rate) > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t ret = read(ctrl->socket_fd, data,
+                   rate_allowance(&ctrl->read_rate, size));
+    if (ret > 0)
+        rate_account(&ctrl->read_rate, ret);
+    return ret;
+}
+
+static ssize_t socket_write(libvchan_t *ctrl, const void *data, size_t size) {
+    struct iovec iov = { (void *)data, size };
+    return socket_writev(ctrl, &iov, 1, 0, size);
+}
+
+// Write size bytes of iov, starting at skip, with one writev()
+static ssize_t socket_writev(libvchan_t *ctrl, const struct iovec *iov,
+                             int iovcnt, size_t skip, size_t size) {
+    if (rate_delay(&ctrl->write_rate) > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    struct iovec slice[IOV_SLICE_MAX];
+    int count = iov_slice(slice, iov, iovcnt, skip,
+                          rate_allowance(&ctrl->write_rate, size));
+    ssize_t ret = writev(ctrl->socket_fd, slice, count);
+    if (ret > 0)
+        rate_account(&ctrl->write_rate, ret);
+    return ret;
+}
+
+int libvchan_set_rate_limit(libvchan_t *ctrl, int direction,
+                            uint64_t bytes_per_sec, uint64_t ops_per_sec) {
+    if (direction & ~(LIBVCHAN_RATE_READ | LIBVCHAN_RATE_WRITE)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (direction & LIBVCHAN_RATE_READ)
+        rate_set(&ctrl->read_rate, bytes_per_sec, ops_per_sec);
+    if (direction & LIBVCHAN_RATE_WRITE)
+        rate_set(&ctrl->write_rate, bytes_per_sec, ops_per_sec);
+    return 0;
+}
+
+int libvchan_get_stats(libvchan_t *ctrl, struct libvchan_stats *stats) {
+    stats->bytes_read = ctrl->read_rate.total_bytes;
+    stats->bytes_written = ctrl->write_rate.total_bytes;
+    stats->reads = ctrl->read_rate.total_ops;
+    stats->writes = ctrl->write_rate.total_ops;
+    stats->read_throttled = ctrl->read_rate.throttled;
+    stats->write_throttled = ctrl->write_rate.throttled;
+    stats->read_bytes_per_sec = ctrl->read_rate.bytes_per_sec;
+    stats->read_ops_per_sec = ctrl->read_rate.ops_per_sec;
+    stats->write_bytes_per_sec = ctrl->write_rate.bytes_per_sec;
+    stats->write_ops_per_sec = ctrl->write_rate.ops_per_sec;
+    stats->numa_node = ring_node(&ctrl->read_ring);
+    stats->spilled_bytes = ctrl->spill.total;
+    stats->spill_pending = spill_pending(&ctrl->spill);
+    stats->spill_peak = ctrl->spill.peak;
     return 0;
 }
 
+// Time left until deadline in milliseconds (rounded up), for poll()
+static int poll_timeout(const struct timespec *deadline) {
+    if (!deadline)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long remaining = (deadline->tv_sec - now.tv_sec) * 1000000000LL +
+        (deadline->tv_nsec - now.tv_nsec);
+    return remaining > 0 ? (remaining + 999999) / 1000000 : 0;
+}
+
 int libvchan_data_ready(libvchan_t *ctrl) {
+    if (ctrl->forward_to) {
+        errno = EBUSY;
+        return -1;
+    }
+    return int_size(libvchan_data_ready64(ctrl));
+}
+
+int libvchan_find(libvchan_t *ctrl, uint8_t byte, size_t *offset) {
+    // Reading here would put the data out of order (see stop_forward)
+    if (ctrl->forward_to) {
+        errno = EBUSY;
+        return -1;
+    }
     if (ctrl->socket_fd >= 0)
         read_pending(ctrl);
-    return ring_filled(&ctrl->read_ring);
+    size_t filled = ring_filled(&ctrl->read_ring);
+    uint8_t *head = ring_head(&ctrl->read_ring);
+    uint8_t *found = filled > 0 ? find_byte(head, byte, filled) : NULL;
+    if (found)
+        *offset = found - head;
+    return found != NULL;
 }
 
 /*
- * How much data we can write without blocking.
- * In the socket case, there's no way to measure that, so we can answer
- * at most 1 byte.
+ * Search only the data that arrived since the last check, and copy out
+ * nothing until the record is complete.
  */
-int libvchan_buffer_space(libvchan_t *ctrl) {
-    if (ctrl->socket_fd <= 0) {
+int libvchan_read_until(libvchan_t *ctrl, void *data, size_t size,
+                        uint8_t delim) {
+    struct ring *ring = &ctrl->read_ring;
+    size_t limit = int_size(size);
+    if (limit > ring->size)
+        limit = ring->size;
+    if (ctrl->forward_to) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    start_timer(ctrl, ctrl->timeout);
+    if (ctrl->socket_fd >= 0)
+        read_pending(ctrl);
+    size_t scanned = 0;
+    size_t count;
+    for (;;) {
+        size_t filled = ring_filled(ring);
+        if (filled > limit)
+            filled = limit;
+        if (filled > scanned) {
+            uint8_t *found = find_byte(ring_head(ring) + scanned, delim,
+                                       filled - scanned);
+            if (found) {
+                count = found - ring_head(ring) + 1;
+                break;
+            }
+            scanned = filled;
+        }
+        // Too long, or the last record without a delimiter
+        if (filled == limit ||
+            libvchan_is_open(ctrl) == VCHAN_DISCONNECTED) {
+            count = filled;
+            break;
+        }
+
+        // Make sure the other side gets our request before we wait for a
+        // reply
+        if (!ctrl->corked)
+            libvchan__flush(ctrl, true);
+        if (wait_event(ctrl) < 0)
+            return -1;
+    }
+
+    if (count == 0)
+        return -1;
+    copy_data(data, ring_head(ring), count);
+    ring_advance_head(ring, count);
+    return count;
+}
+
+size_t libvchan_data_ready64(libvchan_t *ctrl) {
+    // None of it is for the caller
+    if (ctrl->forward_to) {
+        errno = EBUSY;
         return 0;
     }
+    if (ctrl->socket_fd >= 0)
+        read_pending(ctrl);
+    return ring_filled(&ctrl->read_ring);
+}
 
-    struct pollfd fds[1];
+int libvchan_process(libvchan_t *ctrl) {
+    if (ctrl->socket_fd < 0 && ctrl->server_fd >= 0 && ctrl->is_new) {
+        struct pollfd fds[1];
+        fds[0].fd = ctrl->server_fd;
+        fds[0].events = POLLIN;
+        if (poll(fds, 1, 0) < 0) {
+            perror("poll process");
+            return -1;
+        }
+        if (!(fds[0].revents & POLLIN))
+            return POLLIN;
+        if (wait_for_connection(ctrl) < 0)
+            return -1;
+    }
+
+    if (ctrl->forward_from)
+        forward_step(ctrl->forward_from);
+    if (ctrl->forward_to)
+        forward_step(ctrl);
+    if (ctrl->socket_fd >= 0 && flush_due(ctrl))
+        libvchan__flush(ctrl, false);
+    if (ctrl->socket_fd >= 0 && !ctrl->forward_to)
+        read_pending(ctrl);
+    if (ctrl->socket_fd < 0)
+        return 0;
+
+    int events = 0;
+    if (ctrl->forward_to) {
+        // Only once the destination took everything
+        if (ctrl->forward_pending == 0 &&
+            ring_filled(&ctrl->read_ring) == 0 &&
+            ring_filled(&ctrl->forward_to->write_ring) == 0)
+            events |= POLLIN;
+    } else if (ring_available(&ctrl->read_ring) > 0) {
+        events |= POLLIN;
+    }
+    if (flush_due(ctrl) || (ctrl->forward_from &&
+                            (ring_filled(&ctrl->write_ring) > 0 ||
+                             ctrl->forward_from->forward_pending > 0)))
+        events |= POLLOUT;
+    return events;
+}
+
+int libvchan_forward(libvchan_t *from, libvchan_t *to, int flags) {
+    if ((flags & ~LIBVCHAN_FORWARD_BOTH) || from == to) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bool both = flags & LIBVCHAN_FORWARD_BOTH;
+    if (!to) {
+        stop_forward(from);
+        if (both && from->forward_from)
+            stop_forward(from->forward_from);
+        return 0;
+    }
+
+    if (from->forward_to || to->forward_from ||
+        (both && (to->forward_to || from->forward_from))) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (add_link(from, to) < 0)
+        return -1;
+    if (both && add_link(to, from) < 0) {
+        stop_forward(from);
+        return -1;
+    }
+    return 0;
+}
+
+static int add_link(libvchan_t *from, libvchan_t *to) {
+    if (pipe2(from->forward_pipe, O_CLOEXEC | O_NONBLOCK)) {
+        perror("pipe2");
+        return -1;
+    }
+    // Try to move as much at once as read_ring would hold (this can fail
+    // over the unprivileged limit, the default size is fine then)
+    fcntl(from->forward_pipe[1], F_SETPIPE_SZ,
+          (int)int_size(from->read_ring.size));
+    from->forward_pending = 0;
+    from->forward_to = to;
+    to->forward_from = from;
+    return 0;
+}
+
+void libvchan__forward_stop(libvchan_t *ctrl) {
+    stop_forward(ctrl);
+    if (ctrl->forward_from)
+        stop_forward(ctrl->forward_from);
+}
+
+/*
+ * Stop forwarding the data of from. Anything still in the pipe goes back to
+ * read_ring (which is empty while the pipe is not, see forward_splice).
+ */
+static void stop_forward(libvchan_t *from) {
+    if (!from->forward_to)
+        return;
+
+    while (from->forward_pending > 0) {
+        ssize_t ret = read(from->forward_pipe[0], ring_tail(&from->read_ring),
+                           from->forward_pending);
+        if (ret <= 0) {
+            perror("read forward pipe");
+            break;
+        }
+        ring_advance_tail(&from->read_ring, ret);
+        from->forward_pending -= ret;
+    }
+    close(from->forward_pipe[0]);
+    close(from->forward_pipe[1]);
+    from->forward_to->forward_from = NULL;
+    from->forward_to = NULL;
+}
+
+/*
+ * Move the data of from to its destination: whatever is buffered first,
+ * then, as long as nothing is, from socket to socket, through the pipe.
+ * Stop when either side would block.
+ */
+static void forward_step(libvchan_t *from) {
+    libvchan_t *to = from->forward_to;
+    for (;;) {
+        if (from->forward_pending == 0 && ring_filled(&from->read_ring) > 0 &&
+            spill_pending(&to->spill) == 0) {
+            struct iovec iov = {
+                ring_head(&from->read_ring), ring_filled(&from->read_ring)
+            };
+            size_t count = queue_write(to, &iov, 1, 0, iov.iov_len);
+            ring_advance_head(&from->read_ring, count);
+        }
+        if (to->socket_fd < 0)
+            return;
+        if (ring_filled(&to->write_ring) > 0) {
+            if (libvchan__flush(to, false) < 0 ||
+                ring_filled(&to->write_ring) > 0)
+                return;
+            continue;
+        }
+        if (!forward_splice(from))
+            return;
+    }
+}
+
+// One splice() into or out of the pipe. Returns false if nothing moved.
+static bool forward_splice(libvchan_t *from) {
+    libvchan_t *to = from->forward_to;
+    ssize_t ret;
+    if (from->forward_pending > 0) {
+        if (rate_delay(&to->write_rate) > 0)
+            return false;
+        ret = splice(from->forward_pipe[0], NULL, to->socket_fd, NULL,
+                     rate_allowance(&to->write_rate, from->forward_pending),
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret > 0) {
+            rate_account(&to->write_rate, ret);
+            from->forward_pending -= ret;
+            return true;
+        }
+        if (ret < 0 && (errno == EPIPE || errno == ECONNRESET))
+            close_socket(to);
+        else if (ret < 0 && errno != EAGAIN)
+            perror("splice to socket");
+        return false;
+    }
+
+    if (from->socket_fd < 0 || rate_delay(&from->read_rate) > 0)
+        return false;
+    // No more than read_ring holds, so that it can take the data back
+    ret = splice(from->socket_fd, NULL, from->forward_pipe[1], NULL,
+                 rate_allowance(&from->read_rate, from->read_ring.size),
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret > 0) {
+        rate_account(&from->read_rate, ret);
+        from->forward_pending += ret;
+        return true;
+    }
+    if (ret == 0 || (ret < 0 && errno == ECONNRESET)) {
+        close_socket(from);
+    } else if (ret < 0 && errno == EINVAL) {
+        // Can't splice these, copy through read_ring instead
+        return read_pending(from) > 0;
+    } else if (ret < 0 && errno != EAGAIN) {
+        perror("splice from socket");
+    }
+    return false;
+}
+
+int libvchan_pump(libvchan_t *ctrl, int in_fd, int out_fd, unsigned int flags) {
+    // No I/O thread to run it on
+    if ((flags & ~LIBVCHAN_PUMP_HANGUP) || in_fd < 0 || out_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ctrl->forward_to) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (set_nonblock(in_fd) < 0 || set_nonblock(out_fd) < 0)
+        return -1;
+
+    start_timer(ctrl, -1);
+    if (ctrl->socket_fd < 0 && ctrl->server_fd >= 0 && ctrl->is_new &&
+        wait_for_connection(ctrl) < 0)
+        return -1;
+
+    // Try everything once before waiting
+    struct pump pump = {
+        .in_fd = in_fd,
+        .out_fd = out_fd,
+        .in_splice = is_pipe(in_fd),
+        .out_splice = is_pipe(out_fd),
+        .in_ready = POLLIN,
+        .out_ready = POLLOUT,
+        .socket_ready = POLLIN | POLLOUT,
+        .hangup = flags & LIBVCHAN_PUMP_HANGUP,
+    };
+    for (;;) {
+        while (pump_in(ctrl, &pump) | pump_out(ctrl, &pump))
+            ;
+        // We can't close just one direction of the channel, but the peer
+        // disconnects when it gets EOF, and we still get what it sent so far
+        if (pump.in_done && pump.hangup && !pump.hung_up &&
+            ring_filled(&ctrl->write_ring) == 0 && ctrl->socket_fd >= 0) {
+            if (shutdown(ctrl->socket_fd, SHUT_WR))
+                perror("shutdown");
+            pump.hung_up = true;
+        }
+        if (pump.out_done)
+            return 0;
+        if (pump_poll(ctrl, &pump) < 0)
+            return -1;
+    }
+}
+
+/*
+ * in_fd to the channel: through write_ring, or spliced from a pipe straight
+ * to the socket when write_ring is empty. Returns true if anything moved.
+ */
+static bool pump_in(libvchan_t *ctrl, struct pump *pump) {
+    struct ring *ring = &ctrl->write_ring;
+    while (!pump->in_done) {
+        if (ctrl->socket_fd < 0 || pump->hung_up) {
+            pump->in_done = true;
+            break;
+        }
+
+        if (ring_filled(ring) > 0) {
+            if (!(pump->socket_ready & POLLOUT))
+                return false;
+            size_t filled = ring_filled(ring);
+            libvchan__flush(ctrl, false);
+            if (ring_filled(ring) == filled) {
+                pump->socket_ready &= ~POLLOUT;
+                return false;
+            }
+            return true;
+        }
+
+        if (!pump->in_ready)
+            return false;
+        ssize_t ret;
+        if (pump->in_splice) {
+            if (!(pump->socket_ready & POLLOUT) ||
+                rate_delay(&ctrl->write_rate) > 0) {
+                pump->socket_ready &= ~POLLOUT;
+                return false;
+            }
+            ret = splice(pump->in_fd, NULL, ctrl->socket_fd, NULL,
+                         rate_allowance(&ctrl->write_rate, ring->size),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret > 0)
+                rate_account(&ctrl->write_rate, ret);
+            else if (ret < 0 && errno == EAGAIN)
+                // Don't know which side, wait for both
+                pump->socket_ready &= ~POLLOUT;
+        } else {
+            ret = read(pump->in_fd, ring_tail(ring), ring_available(ring));
+            if (ret > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &ctrl->write_start);
+                ring_advance_tail(ring, ret);
+            }
+        }
+
+        if (ret > 0)
+            return true;
+        if (ret < 0 && errno == EAGAIN) {
+            pump->in_ready = 0;
+        } else if (ret < 0 && errno == EINVAL && pump->in_splice) {
+            pump->in_splice = false;
+            continue;
+        } else if (ret < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+            close_socket(ctrl);
+        } else {
+            if (ret < 0)
+                perror("read pump");
+            pump->in_done = true;
+        }
+        return false;
+    }
+    return false;
+}
+
+/*
+ * The channel to out_fd: through read_ring, or spliced from the socket
+ * straight to a pipe when read_ring is empty. Done once the channel is
+ * disconnected and read_ring is empty. Returns true if anything moved.
+ */
+static bool pump_out(libvchan_t *ctrl, struct pump *pump) {
+    struct ring *ring = &ctrl->read_ring;
+    while (!pump->out_done) {
+        ssize_t ret;
+        if (ring_filled(ring) > 0) {
+            if (!pump->out_ready)
+                return false;
+            ret = write(pump->out_fd, ring_head(ring), ring_filled(ring));
+            if (ret > 0) {
+                ring_advance_head(ring, ret);
+                return true;
+            }
+            if (ret < 0 && errno == EAGAIN) {
+                pump->out_ready = 0;
+            } else {
+                perror("write pump");
+                pump->out_done = true;
+            }
+            return false;
+        }
+
+        if (ctrl->socket_fd < 0) {
+            pump->out_done = true;
+            break;
+        }
+        if (!(pump->socket_ready & POLLIN))
+            return false;
+
+        if (!pump->out_splice) {
+            if (read_pending(ctrl) > 0)
+                return true;
+            if (ctrl->socket_fd >= 0)
+                pump->socket_ready &= ~POLLIN;
+            continue;
+        }
+
+        if (!pump->out_ready)
+            return false;
+        if (rate_delay(&ctrl->read_rate) > 0) {
+            pump->socket_ready &= ~POLLIN;
+            return false;
+        }
+        ret = splice(ctrl->socket_fd, NULL, pump->out_fd, NULL,
+                     rate_allowance(&ctrl->read_rate, ring->size),
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret > 0) {
+            rate_account(&ctrl->read_rate, ret);
+            return true;
+        }
+        if (ret == 0 || (ret < 0 && errno == ECONNRESET)) {
+            close_socket(ctrl);
+        } else if (ret < 0 && errno == EAGAIN) {
+            // Don't know which side, wait for both
+            pump->socket_ready &= ~POLLIN;
+            pump->out_ready = 0;
+            return false;
+        } else if (ret < 0 && errno == EINVAL) {
+            pump->out_splice = false;
+        } else {
+            perror("splice pump");
+            pump->out_done = true;
+        }
+    }
+    return false;
+}
+
+// Wait for what's not ready yet, in the directions that are still going
+static int pump_poll(libvchan_t *ctrl, struct pump *pump) {
+    struct pollfd fds[3];
     fds[0].fd = ctrl->socket_fd;
-    fds[0].events = POLLOUT;
+    fds[0].events = 0;
+    if (!pump->in_done && !(pump->socket_ready & POLLOUT))
+        fds[0].events |= POLLOUT;
+    if (!(pump->socket_ready & POLLIN))
+        fds[0].events |= POLLIN;
+    fds[1].fd = pump->in_done || pump->in_ready ? -1 : pump->in_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = pump->out_ready ? -1 : pump->out_fd;
+    fds[2].events = POLLOUT;
+    int timeout = throttle_events(ctrl, &fds[0], -1);
+
+    if (poll(fds, 3, timeout) < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("poll pump");
+        return -1;
+    }
+    pump->socket_ready |= fds[0].revents & (POLLIN | POLLOUT);
+    if (fds[0].revents & (POLLHUP | POLLERR))
+        pump->socket_ready |= POLLIN | POLLOUT;
+    if (fds[1].revents)
+        pump->in_ready = POLLIN;
+    if (fds[2].revents)
+        pump->out_ready = POLLOUT;
+    // Throttled: try again once the limit allows
+    if (timeout >= 0)
+        pump->socket_ready |= POLLIN | POLLOUT;
+    return 0;
+}
 
-    if (poll(fds, 1, 0) < 0) {
-        perror("poll buffer_space");
+static bool is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static int set_nonblock(int fd) {
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        perror("fcntl pump");
+        return -1;
     }
-    return fds[0].revents & POLLOUT ? 1 : 0;
+    return 0;
+}
+
+/*
+ * How much data we can write without blocking: free space in the socket send
+ * buffer, plus in write_ring if writes are buffered.
+ * The socket part is an estimate, because the kernel also counts its own
+ * overhead against SO_SNDBUF.
+ */
+int libvchan_buffer_space(libvchan_t *ctrl) {
+    return int_size(libvchan_buffer_space64(ctrl));
+}
+
+size_t libvchan_buffer_space64(libvchan_t *ctrl) {
+    size_t space = 0;
+
+    if (ctrl->buffered || holding_writes(ctrl)) {
+        if (flush_due(ctrl))
+            libvchan__flush(ctrl, false);
+        if (libvchan_is_open(ctrl) == VCHAN_DISCONNECTED)
+            return 0;
+        space = ring_available(&ctrl->write_ring);
+    }
+
+    // Buffered data goes first
+    if (ctrl->socket_fd >= 0 && ring_filled(&ctrl->write_ring) == 0)
+        space += socket_space(ctrl);
+
+    return space;
+}
+
+static size_t socket_space(libvchan_t *ctrl) {
+    int sndbuf, outq;
+    socklen_t len = sizeof(sndbuf);
+
+    if (getsockopt(ctrl->socket_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len)) {
+        perror("getsockopt SO_SNDBUF");
+        return 0;
+    }
+    if (ioctl(ctrl->socket_fd, SIOCOUTQ, &outq)) {
+        perror("ioctl SIOCOUTQ");
+        return 0;
+    }
+    return sndbuf > outq ? sndbuf - outq : 0;
+}
+
+int libvchan_set_read_lowat(libvchan_t *ctrl, size_t size) {
+    if (size < 1)
+        size = 1;
+    if (size > ctrl->read_ring.size)
+        size = ctrl->read_ring.size;
+    ctrl->read_lowat = size;
+    return 0;
+}
+
+/*
+ * Makes libvchan_write() keep writing until that much data is sent. With
+ * data going through write_ring (see libvchan_set_buffered_writes), it's
+ * also the space libvchan_poll() waits for there, so it can't be larger than
+ * the ring.
+ */
+int libvchan_set_write_lowat(libvchan_t *ctrl, size_t size) {
+    if (size < 1)
+        size = 1;
+    if (size > ctrl->write_ring.size)
+        size = ctrl->write_ring.size;
+    ctrl->write_lowat = size;
+    return 0;
 }
 
 int libvchan_is_open(libvchan_t *ctrl) {
@@ -236,22 +1638,24 @@ int libvchan_is_open(libvchan_t *ctrl) {
  * Read pending data from socket, if any.
  * In case of disconnect, sets socket_fd to -1.
  */
-static int read_pending(libvchan_t *ctrl) {
+static size_t read_pending(libvchan_t *ctrl) {
     assert(ctrl->socket_fd >= 0);
-    int total = 0;
+    size_t total = 0;
 
     for (;;) {
         size_t available = ring_available(&ctrl->read_ring);
         if (available == 0)
             break;
-        int ret = read(ctrl->socket_fd, ring_tail(&ctrl->read_ring),
-                       available);
+        ssize_t ret = socket_read(ctrl, ring_tail(&ctrl->read_ring),
+                                  available);
         if (ret == 0) {
             close_socket(ctrl);
             break;
         }
         if (ret < 0) {
-            if (errno != EAGAIN)
+            if (errno == ECONNRESET)
+                close_socket(ctrl);
+            else if (errno != EAGAIN)
                 perror("read pending");
             break;
         }
@@ -25,6 +25,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef int EVTCHN;
 
@@ -42,6 +44,74 @@ typedef struct libvchan libvchan_t;
 libvchan_t *libvchan_server_init(int domain, int port, size_t read_min, size_t write_min);
 
 libvchan_t *libvchan_client_init(int domain, int port);
+
+/* flags for libvchan_server_init_flags() and libvchan_client_init_flags() */
+/* Don't start a separate I/O thread. Instead, wait for
+ * libvchan_fd_for_select() and call libvchan_process(). */
+#define LIBVCHAN_NO_THREAD (1 << 0)
+/* Credit-based flow control: the peer advertises free space in its read
+ * buffer, and we send only as much data as it can take, so that
+ * libvchan_buffer_space() and libvchan_send() reflect the end-to-end capacity.
+ * This changes the protocol (data is sent in frames), so both sides need to
+ * use it. Not supported with libvchan_submit_read()/libvchan_submit_write().
+ */
+#define LIBVCHAN_CREDITS (1 << 1)
+/* Several threads write to the channel: each libvchan_send() and
+ * libvchan_sendv() lands in the buffer as a whole, without data of other
+ * writers in between. Writers claim their space in the buffer and copy their
+ * data in parallel. Sends larger than the buffer fail with EMSGSIZE.
+ */
+#define LIBVCHAN_MULTI_WRITER (1 << 2)
+/* Fault in the buffers when creating the channel, instead of on first use,
+ * so that the first transfers aren't slower than the rest. */
+#define LIBVCHAN_PREFAULT (1 << 3)
+/* Lock the buffers in memory (see mlock(2)), so that they are never swapped
+ * out. Creating the channel fails if they can't be locked (for instance,
+ * because of RLIMIT_MEMLOCK). Implies LIBVCHAN_PREFAULT. */
+#define LIBVCHAN_MLOCK (1 << 4)
+
+libvchan_t *libvchan_server_init_flags(int domain, int port,
+                                       size_t read_min, size_t write_min,
+                                       unsigned int flags);
+libvchan_t *libvchan_client_init_flags(int domain, int port,
+                                       unsigned int flags);
+
+/* With LIBVCHAN_NO_THREAD: accept the connection, and transfer as much data
+ * as possible without blocking. Returns poll events (POLLIN/POLLOUT) to wait
+ * for on libvchan_fd_for_select() before calling it again, or -1 on error.
+ * The fd can change after the connection is accepted.
+ */
+int libvchan_process(libvchan_t *ctrl);
+
+/* Settings for the I/O thread (named "vchan/<remote domain>/<port>"):
+ * the CPUs it can run on, and its scheduling policy (SCHED_*) with either
+ * realtime priority (SCHED_FIFO, SCHED_RR) or nice value (other policies).
+ * Return -1 if there is no I/O thread, or the settings cannot be applied;
+ * before the thread is started, they are checked right away.
+ * The stack size (0 for the default) can be set only before the thread is
+ * started: for a server, until a client connects. A client's thread starts
+ * with the channel, so use the VCHAN_THREAD_STACK_SIZE environment variable
+ * (the default for all channels) instead; otherwise it's the C library's
+ * default.
+ */
+int libvchan_set_thread_affinity(libvchan_t *ctrl,
+                                 const int *cpus, size_t ncpus);
+int libvchan_set_thread_priority(libvchan_t *ctrl, int policy, int priority);
+int libvchan_set_thread_stack_size(libvchan_t *ctrl, size_t size);
+/* Allocate the rings on a NUMA node: a node number, LIBVCHAN_NUMA_THREAD
+ * for the node of the first CPU the I/O thread is pinned to (see
+ * libvchan_set_thread_affinity), or LIBVCHAN_NUMA_DEFAULT for the kernel's
+ * choice (the node that first touches the memory). Empty rings are moved
+ * right away; data already in a ring stays where it is. Does nothing on a
+ * machine with a single node.
+ * Return -1 (with errno EINVAL) if there is no such node, or for
+ * LIBVCHAN_NUMA_THREAD if the I/O thread isn't pinned to any CPUs (or there
+ * is no I/O thread). If the rings can't be moved, they stay where they are.
+ */
+#define LIBVCHAN_NUMA_DEFAULT (-1)
+#define LIBVCHAN_NUMA_THREAD (-2)
+
+int libvchan_set_numa_node(libvchan_t *ctrl, int node);
 /* An alternative path for client connection:
  * 1. Call libvchan_client_init_async().
  * 2. Wait for watch_fd to become readable.
@@ -55,17 +125,261 @@ libvchan_t *libvchan_client_init(int domain, int port);
 libvchan_t *libvchan_client_init_async(int domain, int port, EVTCHN *watch_fd);
 int libvchan_client_init_async_finish(libvchan_t *ctrl, bool blocking);
 
-
 int libvchan_write(libvchan_t *ctrl, const void *data, size_t size);
 int libvchan_send(libvchan_t *ctrl, const void *data, size_t size);
+/* Like libvchan_send(), but gather the data from iovcnt buffers */
+int libvchan_sendv(libvchan_t *ctrl, const struct iovec *iov, int iovcnt);
+/* Send as many of the n messages as fit in the buffer at once, waiting only
+ * for the first one. Sets sent to the number of messages sent, and returns
+ * their total size.
+ */
+int libvchan_send_batch(libvchan_t *ctrl, const struct iovec *msgs, int n,
+                        int *sent);
 int libvchan_read(libvchan_t *ctrl, void *data, size_t size);
 int libvchan_recv(libvchan_t *ctrl, void *data, size_t size);
+/* The functions returning int transfer at most INT_MAX bytes at once: reads
+ * and writes are cut short, and larger sends and receives fail with
+ * EOVERFLOW. These have no such limit. A send or receive larger than the
+ * buffer is done in parts; if it fails in the middle, the parts already
+ * transferred are not undone.
+ */
+ssize_t libvchan_write64(libvchan_t *ctrl, const void *data, size_t size);
+ssize_t libvchan_send64(libvchan_t *ctrl, const void *data, size_t size);
+ssize_t libvchan_read64(libvchan_t *ctrl, void *data, size_t size);
+ssize_t libvchan_recv64(libvchan_t *ctrl, void *data, size_t size);
 int libvchan_wait(libvchan_t *ctrl);
+/* Like libvchan_wait(), but give up after timeout milliseconds (-1 means no
+ * timeout), returning -1 with errno set to ETIMEDOUT (EAGAIN for 0).
+ */
+int libvchan_wait_timeout(libvchan_t *ctrl, int timeout);
 void libvchan_close(libvchan_t *ctrl);
 EVTCHN libvchan_fd_for_select(libvchan_t *ctrl);
+/* Separate file descriptors for readers and writers, so that one thread can
+ * read and another write on the same channel. Poll them for POLLIN: they stay
+ * readable as long as data is ready / space is free (see the low-water marks
+ * below), or the peer is disconnected.
+ */
+EVTCHN libvchan_fd_for_read(libvchan_t *ctrl);
+EVTCHN libvchan_fd_for_write(libvchan_t *ctrl);
 int libvchan_is_open(libvchan_t *ctrl);
 
+/* Wait until any of the channels is ready, similar to poll(). Set events to
+ * LIBVCHAN_POLLIN and/or LIBVCHAN_POLLOUT; on return, revents says which are
+ * ready (according to the low-water marks below). LIBVCHAN_POLLHUP is set
+ * for disconnected channels.
+ * Timeout is in milliseconds, -1 means no timeout. Returns the number of
+ * ready channels, 0 on timeout, or -1 on error.
+ */
+#define LIBVCHAN_POLLIN  (1 << 0)
+#define LIBVCHAN_POLLOUT (1 << 1)
+#define LIBVCHAN_POLLHUP (1 << 2)
+
+struct libvchan_pollfd {
+    libvchan_t *ctrl;
+    short events;
+    short revents;
+};
+
+int libvchan_poll(struct libvchan_pollfd *fds, size_t nfds, int timeout);
+
 int libvchan_data_ready(libvchan_t *ctrl);
 int libvchan_buffer_space(libvchan_t *ctrl);
+/* Same, for buffers larger than INT_MAX (which the above cap at that) */
+size_t libvchan_data_ready64(libvchan_t *ctrl);
+size_t libvchan_buffer_space64(libvchan_t *ctrl);
+
+/* Delimited records (lines, NUL-terminated strings...), searched for in the
+ * buffer without copying. libvchan_find() looks for byte in the data ready
+ * to read, without consuming it: returns 1 and sets offset if found, 0 if
+ * not (yet), -1 on error.
+ * libvchan_read_until() reads one record, up to and including delim. It
+ * waits for the delimiter (see libvchan_set_timeout), but returns a record
+ * without it if it's longer than size (or the buffer), or if it's the last
+ * one before disconnect.
+ */
+int libvchan_find(libvchan_t *ctrl, uint8_t byte, size_t *offset);
+int libvchan_read_until(libvchan_t *ctrl, void *data, size_t size,
+                        uint8_t delim);
+
+/* Relay: pass all data arriving on from to to, without going through the
+ * caller. Meanwhile, reads on from (including libvchan_find() and
+ * libvchan_read_until()) fail with EBUSY; writes to to are allowed, but the
+ * data is interleaved at arbitrary points. Data waits in from's buffer as
+ * long as to has no space, so the sender of from is slowed down to the pace
+ * of the receiver of to.
+ * With LIBVCHAN_FORWARD_BOTH, also forward to to from. Passing NULL as to
+ * stops forwarding (undelivered data is left in the buffers); so does
+ * libvchan_close() of either channel, but don't close both at the same time
+ * from different threads.
+ * The data moves in libvchan_process() of either channel: call it for both of
+ * them whenever one is ready. As long as nothing is buffered, it goes from
+ * socket to socket with splice(), without copying.
+ */
+#define LIBVCHAN_FORWARD_BOTH (1 << 0)
+
+int libvchan_forward(libvchan_t *from, libvchan_t *to, int flags);
+
+/* Bridge the channel to file descriptors in both directions at once, like
+ * netcat: data from in_fd is sent to the channel, data from the channel is
+ * written to out_fd (which can be the same as in_fd, for a socket). Both are
+ * switched to non-blocking mode. Meanwhile, reads on the channel fail with
+ * EBUSY.
+ * EOF on in_fd stops only that direction, as a channel can't be closed in one
+ * direction only; with LIBVCHAN_PUMP_HANGUP, the channel is disconnected
+ * instead, once the rest of the data is sent. The pump ends when the channel
+ * is disconnected and the data from it is written out, or when writing to
+ * out_fd fails.
+ * By default, it runs on the caller's thread, and returns when done.
+ * LIBVCHAN_PUMP_THREAD (running it on the I/O thread) is not supported, as
+ * this implementation has no threads. Data goes between a pipe and the
+ * channel's socket with splice(), without copying, as long as nothing is
+ * buffered.
+ */
+#define LIBVCHAN_PUMP_HANGUP (1 << 0)
+#define LIBVCHAN_PUMP_THREAD (1 << 1)
+
+int libvchan_pump(libvchan_t *ctrl, int in_fd, int out_fd, unsigned int flags);
+
+/* Low-water marks, similar to SO_RCVLOWAT/SO_SNDLOWAT. libvchan_read(),
+ * libvchan_wait() and libvchan_poll() wait until at least read_lowat bytes
+ * are ready; libvchan_fd_for_select() is the socket itself, and becomes
+ * readable as soon as any data arrives. libvchan_write() keeps writing until
+ * at least write_lowat bytes are sent, and with buffered writes,
+ * libvchan_poll() waits for that much space in the write buffer. Values are
+ * limited to the buffer size; the default is 1.
+ */
+int libvchan_set_read_lowat(libvchan_t *ctrl, size_t size);
+int libvchan_set_write_lowat(libvchan_t *ctrl, size_t size);
+
+/* Timeout for libvchan_read(), libvchan_write(), libvchan_recv() and
+ * libvchan_send(), in milliseconds. If nothing (or, for libvchan_recv() and
+ * libvchan_send(), not all of the data) can be transferred in time, they
+ * return -1 with errno set to ETIMEDOUT. A timeout of 0 makes them
+ * non-blocking, failing with EAGAIN instead. The default is -1 (no timeout).
+ * A libvchan_send() that has started sending is finished past the timeout,
+ * so it never sends part of the data.
+ */
+int libvchan_set_timeout(libvchan_t *ctrl, int timeout);
+
+/* Write coalescing. While corked, written data is kept in the buffer until it
+ * fills up or libvchan_uncork() is called.
+ * With autoflush, written data is kept until at least flush_bytes are
+ * buffered, or the oldest data is flush_usec microseconds old (0 disables
+ * either limit). These limits apply also while corked.
+ */
+int libvchan_cork(libvchan_t *ctrl);
+int libvchan_uncork(libvchan_t *ctrl);
+int libvchan_set_autoflush(libvchan_t *ctrl, size_t flush_bytes,
+                           unsigned int flush_usec);
+/* Let libvchan_write() return after buffering the data, instead of waiting
+ * for the socket. This is always the case with a separate I/O thread.
+ */
+int libvchan_set_buffered_writes(libvchan_t *ctrl, bool enable);
+/* Spill buffer, for writers that must not wait for the peer: when the buffer
+ * is full, libvchan_write() and libvchan_send() queue the rest in a growable
+ * memory-backed file (up to max_size bytes), passed on through the buffer in
+ * order as it frees up. Only once that is full as well do they wait as usual.
+ * 0 disables it (the default); data already spilled still goes out first.
+ * Not supported with LIBVCHAN_MULTI_WRITER.
+ */
+int libvchan_set_spill(libvchan_t *ctrl, size_t max_size);
+
+/* Asynchronous reads and writes. The I/O thread transfers size bytes directly
+ * into or out of data, which must stay valid until the operation completes.
+ * Operations in each direction complete in order, and before any later
+ * libvchan_read()/libvchan_write(). When libvchan_fd_for_completion() is
+ * readable, collect them with libvchan_get_completions(), which returns the
+ * number of completions stored (at most max). The result is the number of
+ * bytes transferred: less than size if the peer disconnected.
+ */
+struct libvchan_completion {
+    void *user_data;
+    int result;
+};
+
+int libvchan_submit_read(libvchan_t *ctrl, void *data, size_t size,
+                         void *user_data);
+int libvchan_submit_write(libvchan_t *ctrl, const void *data, size_t size,
+                          void *user_data);
+EVTCHN libvchan_fd_for_completion(libvchan_t *ctrl);
+int libvchan_get_completions(libvchan_t *ctrl,
+                             struct libvchan_completion *completions,
+                             int max);
+
+/* Sub-streams, with LIBVCHAN_CREDITS. Each stream has its own buffers and
+ * flow control, so that a stream that isn't read doesn't block the others.
+ * Both sides need to open the same streams. Data of streams with higher
+ * priority is sent first, and long transfers are split up so that they can
+ * be preempted. Stream 0 is the channel itself (libvchan_read() etc.),
+ * with priority 0.
+ * libvchan_wait() and libvchan_fd_for_select() signal changes in any stream.
+ */
+#define LIBVCHAN_MAX_STREAMS 16
+
+int libvchan_stream_open(libvchan_t *ctrl, unsigned int stream,
+                         size_t read_min, size_t write_min, int priority);
+int libvchan_stream_write(libvchan_t *ctrl, unsigned int stream,
+                          const void *data, size_t size);
+int libvchan_stream_send(libvchan_t *ctrl, unsigned int stream,
+                         const void *data, size_t size);
+int libvchan_stream_read(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size);
+int libvchan_stream_recv(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size);
+int libvchan_stream_data_ready(libvchan_t *ctrl, unsigned int stream);
+int libvchan_stream_buffer_space(libvchan_t *ctrl, unsigned int stream);
+
+/* Limit the data received (LIBVCHAN_RATE_READ) and/or sent
+ * (LIBVCHAN_RATE_WRITE) through the channel, in bytes and in socket
+ * transfers per second. 0 means unlimited. Can be changed at any time.
+ */
+#define LIBVCHAN_RATE_READ (1<<0)
+#define LIBVCHAN_RATE_WRITE (1<<1)
+
+int libvchan_set_rate_limit(libvchan_t *ctrl, int direction,
+                            uint64_t bytes_per_sec, uint64_t ops_per_sec);
+
+struct libvchan_stats {
+    /* Data received and sent, and the number of socket transfers */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t reads;
+    uint64_t writes;
+    /* How many times the rate limit held back I/O */
+    uint64_t read_throttled;
+    uint64_t write_throttled;
+    /* Current rate limits, 0 if unlimited */
+    uint64_t read_bytes_per_sec;
+    uint64_t read_ops_per_sec;
+    uint64_t write_bytes_per_sec;
+    uint64_t write_ops_per_sec;
+    /* NUMA node of the read ring, -1 if not allocated yet */
+    int64_t numa_node;
+    /* Spill buffer (see libvchan_set_spill): data queued there in total, the
+     * data there now, and the most at once */
+    uint64_t spilled_bytes;
+    uint64_t spill_pending;
+    uint64_t spill_peak;
+};
+
+int libvchan_get_stats(libvchan_t *ctrl, struct libvchan_stats *stats);
+
+/* Memory used by all the channels of this process.
+ * A server's buffers are allocated only once a client connects (or the
+ * channel is written to), unless it uses LIBVCHAN_PREFAULT or LIBVCHAN_MLOCK.
+ * This implementation has no threads.
+ */
+struct libvchan_memory {
+    uint64_t channels;
+    /* I/O threads (including the ones that exited, until libvchan_close()),
+     * and their stacks */
+    uint64_t threads;
+    uint64_t thread_stack_bytes;
+    /* Allocated buffers, and their size */
+    uint64_t rings;
+    uint64_t ring_bytes;
+};
+
+int libvchan_get_memory(struct libvchan_memory *memory);
 
 #endif /* _LIBVCHAN_H */
@@ -24,9 +24,15 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "libvchan.h"
 #include "ring.h"
+#include "rate.h"
+#include "iov.h"
+#include "copy.h"
+#include "find.h"
+#include "spill.h"
 
 struct libvchan {
     char *socket_path;
@@ -35,10 +41,47 @@ struct libvchan {
     // distinguish VCHAN_WAITING vs. VCHAN_DISCONNECTED
     bool is_new;
     struct ring read_ring;
+    // Written data not sent yet (see libvchan_cork, libvchan_set_autoflush,
+    // libvchan_set_buffered_writes)
+    struct ring write_ring;
+    // RING_* flags (prefault, mlock)
+    int ring_flags;
+    // NUMA node for the rings, or -1
+    int numa_node;
+    bool buffered;
+    bool corked;
+    size_t flush_bytes;
+    unsigned int flush_usec;
+    // When the data was added to empty write_ring, for flush_usec
+    struct timespec write_start;
+    // Data written while write_ring was full (see libvchan_set_spill), sent
+    // through write_ring as it empties
+    struct spill spill;
+    // Low-water marks (see libvchan_set_read_lowat)
+    size_t read_lowat;
+    size_t write_lowat;
+    // Timeout for blocking calls in milliseconds, -1 for none
+    // (see libvchan_set_timeout)
+    int timeout;
+    // Timeout and deadline of the current call
+    int call_timeout;
+    struct timespec deadline;
+    // Rate limits and counters for each direction (see
+    // libvchan_set_rate_limit, libvchan_get_stats)
+    struct rate_limit read_rate;
+    struct rate_limit write_rate;
+    // Forwarding to / from another channel (see libvchan_forward). Our data
+    // goes through forward_pipe, with forward_pending bytes in it.
+    libvchan_t *forward_to;
+    libvchan_t *forward_from;
+    int forward_pipe[2];
+    size_t forward_pending;
     int connect_watch_fd;
 };
 
 int libvchan__listen(const char *socket_path);
 int libvchan__connect(const char *socket_path);
+int libvchan__flush(libvchan_t *ctrl, bool block);
+void libvchan__forward_stop(libvchan_t *ctrl);
 
 #endif
@@ -33,12 +33,28 @@ struct ring {
 
     // "Magic buffer trick": the buffer is mapped twice, so that ring_head()
     // and ring_tail() will point to a contiguous chunk of memory.
+    // NULL until the ring is mapped (see RING_LAZY)
     uint8_t *data;
     int fd;
+    int flags;
+    // NUMA node to allocate the pages on, or -1
+    int node;
 };
 
-int ring_init(struct ring *ring, size_t min_size);
+// Flags for ring_init(): fault all the pages in right away, and keep them
+// in memory
+#define RING_PREFAULT (1 << 0)
+#define RING_MLOCK (1 << 1)
+// Don't allocate the buffer until ring_map(). Until then, the ring is empty
+// (but reports its full size as available).
+#define RING_LAZY (1 << 2)
+
+int ring_init(struct ring *ring, size_t min_size, int flags, int node);
+int ring_map(struct ring *ring);
 void ring_destroy(struct ring *ring);
+int ring_set_node(struct ring *ring, int node);
+int ring_node(struct ring *ring);
+void ring_usage(size_t *count, size_t *bytes);
 
 inline size_t ring_available(struct ring *ring) {
     return ring->size - ring->count;
@@ -0,0 +1,59 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#ifndef _SPILL_H
+#define _SPILL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Overflow queue behind write_ring (see libvchan_set_spill), kept in an
+ * anonymous memfd so that it can grow without holding on to heap memory.
+ * Data is appended at tail and taken from head; the file is emptied again
+ * once everything is taken.
+ */
+struct spill {
+    int fd;
+    uint64_t head;
+    uint64_t tail;
+    // Most data queued at once, 0 if disabled
+    size_t max;
+
+    // Total data queued, and the most that was queued at once
+    uint64_t total;
+    size_t peak;
+};
+
+void spill_init(struct spill *spill);
+size_t spill_space(struct spill *spill);
+int spill_write(struct spill *spill, const struct iovec *iov, int iovcnt,
+                size_t skip, size_t size);
+int spill_read(struct spill *spill, void *dest, size_t size);
+void spill_destroy(struct spill *spill);
+
+inline size_t spill_pending(struct spill *spill) {
+    return spill->tail - spill->head;
+}
+
+#endif
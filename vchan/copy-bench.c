@@ -0,0 +1,178 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Measure the copy kernels (see copy.c) for different sizes, to find the
+ * crossover points, and the byte search kernels (see find.c).
+ * Usage: copy-bench [max_size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "copy.h"
+#include "find.h"
+
+#define MIN_SIZE 64
+#define DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+// Bytes to copy for each measurement
+#define TOTAL (512 * 1024 * 1024)
+// Misalign the buffers, like the data in the rings usually is
+#define SRC_OFFSET 3
+#define DEST_OFFSET 5
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Check the kernel on all sizes around n, then return the speed in GB/s
+static double measure(copy_fn fn, char *dest, const char *src, size_t n) {
+    for (size_t len = n - 33; len <= n + 33; len++) {
+        memset(dest, 0, len + 1);
+        fn(dest, src, len);
+        if (memcmp(dest, src, len) != 0 || dest[len] != 0) {
+            fprintf(stderr, "copy of %zu bytes failed\n", len);
+            exit(1);
+        }
+    }
+
+    size_t count = TOTAL / n;
+    if (count < 4)
+        count = 4;
+    double start = now();
+    for (size_t i = 0; i < count; i++)
+        fn(dest, src, n);
+    return (double)count * n / (now() - start) / 1e9;
+}
+
+// Same for a search through n bytes without a match
+static double measure_find(find_fn fn, char *buf, size_t n) {
+    for (size_t len = n - 33; len <= n + 33; len++) {
+        for (size_t pos = len - 33; pos <= len; pos++) {
+            memset(buf, 'x', len + 1);
+            if (pos < len)
+                buf[pos] = '\n';
+            if (fn(buf, '\n', len) != (pos < len ? buf + pos : NULL)) {
+                fprintf(stderr, "search in %zu bytes failed\n", len);
+                exit(1);
+            }
+        }
+    }
+
+    memset(buf, 'x', n);
+    size_t count = TOTAL / n;
+    if (count < 4)
+        count = 4;
+    double start = now();
+    for (size_t i = 0; i < count; i++) {
+        if (fn(buf, '\n', n)) {
+            fprintf(stderr, "unexpected match\n");
+            exit(1);
+        }
+    }
+    return (double)count * n / (now() - start) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t max_size = DEFAULT_MAX_SIZE;
+    if (argc > 1)
+        max_size = strtoull(argv[1], NULL, 0);
+    if (max_size < MIN_SIZE) {
+        fprintf(stderr, "usage: copy-bench [max_size]\n");
+        return 1;
+    }
+
+    char *src_buf = malloc(max_size + 64 + SRC_OFFSET);
+    char *dest_buf = malloc(max_size + 64 + DEST_OFFSET);
+    if (!src_buf || !dest_buf) {
+        perror("malloc");
+        return 1;
+    }
+    char *src = src_buf + SRC_OFFSET;
+    char *dest = dest_buf + DEST_OFFSET;
+    for (size_t i = 0; i < max_size + 64; i++)
+        src[i] = rand();
+
+    printf("# medium: %s, large: %s, non-temporal from %zu bytes\n",
+           copy_medium_name(), copy_large_name(), copy_nt_threshold);
+    printf("# GB/s\n");
+    printf("%10s", "size");
+    for (struct copy_kernel *k = copy_kernels; k->name; k++) {
+        if (k->supported)
+            printf(" %12s", k->name);
+    }
+    printf(" %12s  %s\n", "auto", "fastest");
+
+    for (size_t n = MIN_SIZE; n <= max_size; n *= 4) {
+        const char *fastest = NULL;
+        double best = 0;
+
+        printf("%10zu", n);
+        for (struct copy_kernel *k = copy_kernels; k->name; k++) {
+            if (!k->supported)
+                continue;
+            double speed = measure(k->fn, dest, src, n);
+            if (speed > best) {
+                best = speed;
+                fastest = k->name;
+            }
+            printf(" %12.2f", speed);
+        }
+        printf(" %12.2f  %s\n", measure(copy_data, dest, src, n), fastest);
+        fflush(stdout);
+    }
+
+    printf("\n# search: %s\n", find_kernel_name());
+    printf("# GB/s\n");
+    printf("%10s", "size");
+    for (struct find_kernel *k = find_kernels; k->name; k++) {
+        if (k->supported)
+            printf(" %12s", k->name);
+    }
+    printf("  %s\n", "fastest");
+
+    for (size_t n = MIN_SIZE; n <= max_size; n *= 4) {
+        const char *fastest = NULL;
+        double best = 0;
+
+        printf("%10zu", n);
+        for (struct find_kernel *k = find_kernels; k->name; k++) {
+            if (!k->supported)
+                continue;
+            double speed = measure_find(k->fn, dest, n);
+            if (speed > best) {
+                best = speed;
+                fastest = k->name;
+            }
+            printf(" %12.2f", speed);
+        }
+        printf("  %s\n", fastest);
+        fflush(stdout);
+    }
+
+    free(src_buf);
+    free(dest_buf);
+    return 0;
+}
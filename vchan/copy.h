@@ -0,0 +1,51 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _COPY_H
+#define _COPY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef void *(*copy_fn)(void *dest, const void *src, size_t n);
+
+struct copy_kernel {
+    const char *name;
+    copy_fn fn;
+    // Set at load time, depending on the CPU
+    bool supported;
+};
+
+// All the kernels, terminated by one with a NULL name (for copy-bench)
+extern struct copy_kernel copy_kernels[];
+
+// Copies below this size use plain memcpy(): the other kernels take longer
+// to start
+#define COPY_MEDIUM_MIN 4096
+
+// Copies of at least this size use streaming (non-temporal) stores
+extern size_t copy_nt_threshold;
+
+void *copy_data(void *dest, const void *src, size_t n);
+const char *copy_medium_name(void);
+const char *copy_large_name(void);
+
+#endif
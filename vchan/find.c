@@ -0,0 +1,216 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+/*
+ * Searching the rings for a delimiter (see libvchan_read_until). The vector
+ * kernels compare a block at a time, and find the first match in the
+ * comparison mask.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#ifdef __aarch64__
+#include <arm_neon.h>
+#endif
+
+#include "find.h"
+
+// Whatever is left after the vector loop
+static void *find_scalar(const uint8_t *p, int byte, size_t n) {
+    for (; n > 0; n--, p++) {
+        if (*p == (uint8_t)byte)
+            return (void *)p;
+    }
+    return NULL;
+}
+
+#ifdef __x86_64__
+
+static void *find_sse2(const void *data, int byte, size_t n) {
+    const uint8_t *p = data;
+    __m128i needle = _mm_set1_epi8(byte);
+
+    for (; n >= 64; n -= 64, p += 64) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p),
+                                   needle);
+        __m128i b = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p + 16)), needle);
+        __m128i c = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p + 32)), needle);
+        __m128i d = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p + 48)), needle);
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(any)) {
+            uint64_t mask = (uint64_t)_mm_movemask_epi8(a) |
+                (uint64_t)_mm_movemask_epi8(b) << 16 |
+                (uint64_t)_mm_movemask_epi8(c) << 32 |
+                (uint64_t)_mm_movemask_epi8(d) << 48;
+            return (void *)(p + __builtin_ctzll(mask));
+        }
+    }
+    for (; n >= 16; n -= 16, p += 16) {
+        int mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+        if (mask)
+            return (void *)(p + __builtin_ctz(mask));
+    }
+    return find_scalar(p, byte, n);
+}
+
+__attribute__((target("avx2")))
+static void *find_avx2(const void *data, int byte, size_t n) {
+    const uint8_t *p = data;
+    __m256i needle = _mm256_set1_epi8(byte);
+
+    if (n < 32)
+        return find_scalar(p, byte, n);
+
+    // Check the first (unaligned) block, then continue from the next
+    // aligned one. The last block is checked unaligned again, overlapping
+    // what's already known not to match.
+    const uint8_t *last = p + n - 32;
+    uint32_t first = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)p), needle));
+    if (first)
+        return (void *)(p + __builtin_ctz(first));
+    size_t skip = 32 - ((uintptr_t)p & 31);
+    p += skip;
+    n -= skip;
+
+    for (; n >= 128; n -= 128, p += 128) {
+        __m256i a = _mm256_cmpeq_epi8(
+            _mm256_load_si256((const __m256i *)p), needle);
+        __m256i b = _mm256_cmpeq_epi8(
+            _mm256_load_si256((const __m256i *)(p + 32)), needle);
+        __m256i c = _mm256_cmpeq_epi8(
+            _mm256_load_si256((const __m256i *)(p + 64)), needle);
+        __m256i d = _mm256_cmpeq_epi8(
+            _mm256_load_si256((const __m256i *)(p + 96)), needle);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b),
+                                      _mm256_or_si256(c, d));
+        if (_mm256_movemask_epi8(any)) {
+            uint64_t lo = (uint32_t)_mm256_movemask_epi8(a) |
+                (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+            if (lo)
+                return (void *)(p + __builtin_ctzll(lo));
+            uint64_t hi = (uint32_t)_mm256_movemask_epi8(c) |
+                (uint64_t)(uint32_t)_mm256_movemask_epi8(d) << 32;
+            return (void *)(p + 64 + __builtin_ctzll(hi));
+        }
+    }
+    for (; n >= 32; n -= 32, p += 32) {
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_load_si256((const __m256i *)p), needle));
+        if (mask)
+            return (void *)(p + __builtin_ctz(mask));
+    }
+    if (n > 0) {
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)last), needle));
+        if (mask)
+            return (void *)(last + __builtin_ctz(mask));
+    }
+    return NULL;
+}
+
+#endif
+
+#ifdef __aarch64__
+
+static void *find_neon(const void *data, int byte, size_t n) {
+    const uint8_t *p = data;
+    uint8x16_t needle = vdupq_n_u8(byte);
+
+    for (; n >= 16; n -= 16, p += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(p), needle);
+        // No movemask: narrow each byte of the result to 4 bits instead
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask)
+            return (void *)(p + (__builtin_ctzll(mask) >> 2));
+    }
+    return find_scalar(p, byte, n);
+}
+
+#endif
+
+enum {
+    KERNEL_MEMCHR,
+#ifdef __x86_64__
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+#endif
+#ifdef __aarch64__
+    KERNEL_NEON,
+#endif
+};
+
+struct find_kernel find_kernels[] = {
+    [KERNEL_MEMCHR] = { "memchr", memchr, true },
+#ifdef __x86_64__
+    [KERNEL_SSE2] = { "sse2", find_sse2, true },
+    [KERNEL_AVX2] = { "avx2", find_avx2, false },
+#endif
+#ifdef __aarch64__
+    [KERNEL_NEON] = { "neon", find_neon, true },
+#endif
+    { NULL, NULL, false },
+};
+
+static struct find_kernel *kernel = &find_kernels[KERNEL_MEMCHR];
+
+/*
+ * glibc's memchr() is already vectorized and tuned for each CPU, and beats
+ * or matches ours (see copy-bench). Other C libraries (such as musl) search
+ * a word at a time, so use our kernels there.
+ */
+__attribute__((constructor))
+static void find_init(void) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        find_kernels[KERNEL_AVX2].supported = true;
+#endif
+
+#ifndef __GLIBC__
+#if defined(__x86_64__)
+    if (find_kernels[KERNEL_AVX2].supported)
+        kernel = &find_kernels[KERNEL_AVX2];
+    else
+        kernel = &find_kernels[KERNEL_SSE2];
+#elif defined(__aarch64__)
+    kernel = &find_kernels[KERNEL_NEON];
+#endif
+#endif
+}
+
+void *find_byte(const void *data, int byte, size_t n) {
+    return kernel->fn(data, byte, n);
+}
+
+const char *find_kernel_name(void) {
+    return kernel->name;
+}
@@ -25,21 +25,58 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "libvchan.h"
 #include "libvchan_private.h"
+#include "numa.h"
 
 #define SOCKET_DIR "/var/run/vchan"
 
+// How long the waiter sleeps when out of memory
+#define WAITER_RETRY_MS 100
+
+static int start_thread(libvchan_t *ctrl, void *(*func)(void *));
+static int apply_thread_settings(libvchan_t *ctrl, pthread_t thread,
+                                 pid_t tid);
+static int check_thread_settings(libvchan_t *ctrl);
+static int wait_for_client(libvchan_t *ctrl);
+static void stop_waiting(libvchan_t *ctrl);
+
+// For libvchan_get_memory (rings are counted in ring.c)
+static size_t channel_count;
+static size_t thread_count;
+static size_t thread_stack_bytes;
+
 static int get_current_domain() {
     const char *s = getenv("VCHAN_DOMAIN");
     return s ? atoi(s) : 0;
 }
 
+// mlock() faults the pages in as well
+static int ring_flags(unsigned int flags) {
+    int result = 0;
+    if (flags & LIBVCHAN_PREFAULT)
+        result |= RING_PREFAULT;
+    if (flags & LIBVCHAN_MLOCK)
+        result |= RING_MLOCK;
+    return result;
+}
+
+/*
+ * With lazy_rings, the rings are allocated only when a client connects (or
+ * when the user writes something before that), unless the user wants them
+ * ready up front.
+ */
 static libvchan_t *init(
     int server_domain, int client_domain, int port,
-    size_t read_min, size_t write_min) {
+    size_t read_min, size_t write_min, unsigned int flags, bool lazy_rings) {
 
     libvchan_t *ctrl = malloc(sizeof(*ctrl));
     if (!ctrl)
@@ -47,6 +84,19 @@ static libvchan_t *init(
 
     memset(ctrl, 0, sizeof(*ctrl));
     ctrl->socket_fd = -1;
+    ctrl->conn_fd = -1;
+    ctrl->read_lowat = 1;
+    ctrl->write_lowat = 1;
+    ctrl->timeout = -1;
+    ctrl->ring_flags = ring_flags(flags);
+    ctrl->numa_node = -1;
+    ctrl->process_timeout.tv_sec = -1;
+    ctrl->pump.in_fd = -1;
+    ctrl->pump.out_fd = -1;
+    spill_init(&ctrl->spill);
+    ctrl->main_stream.read_ring = &ctrl->read_ring;
+    ctrl->main_stream.write_ring = &ctrl->write_ring;
+    ctrl->streams[0] = &ctrl->main_stream;
 
     const char *socket_dir = getenv("VCHAN_SOCKET_DIR");
     if (!socket_dir)
@@ -58,16 +108,25 @@ static libvchan_t *init(
         free(ctrl);
         return NULL;
     }
+    // From now on, failures go through libvchan_close()
+    __atomic_add_fetch(&channel_count, 1, __ATOMIC_RELAXED);
 
     if (pipe2(ctrl->user_event_pipe, O_NONBLOCK|O_CLOEXEC) ||
-        pipe2(ctrl->socket_event_pipe, O_NONBLOCK|O_CLOEXEC)) {
+        pipe2(ctrl->socket_event_pipe, O_NONBLOCK|O_CLOEXEC) ||
+        pipe2(ctrl->read_event_pipe, O_NONBLOCK|O_CLOEXEC) ||
+        pipe2(ctrl->write_event_pipe, O_NONBLOCK|O_CLOEXEC) ||
+        pipe2(ctrl->hup_event_pipe, O_NONBLOCK|O_CLOEXEC) ||
+        pipe2(ctrl->completion_pipe, O_NONBLOCK|O_CLOEXEC)) {
         perror("pipe");
         libvchan_close(ctrl);
         return NULL;
     }
 
-    if (ring_init(&ctrl->read_ring, read_min) ||
-        ring_init(&ctrl->write_ring, write_min)) {
+    int main_ring_flags = ctrl->ring_flags;
+    if (lazy_rings && !(main_ring_flags & (RING_PREFAULT | RING_MLOCK)))
+        main_ring_flags |= RING_LAZY;
+    if (ring_init(&ctrl->read_ring, read_min, main_ring_flags, ctrl->numa_node) ||
+        ring_init(&ctrl->write_ring, write_min, main_ring_flags, ctrl->numa_node)) {
         perror("malloc");
         libvchan_close(ctrl);
         return NULL;
@@ -79,12 +138,46 @@ static libvchan_t *init(
         return NULL;
     }
 
+    // Monotonic clock for the timeouts in pthread_cond_timedwait()
+    pthread_condattr_t cond_attr;
+    if (pthread_condattr_init(&cond_attr) ||
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(&ctrl->event_cond, &cond_attr)) {
+        perror("pthread_cond_init");
+        libvchan_close(ctrl);
+        return NULL;
+    }
+    pthread_condattr_destroy(&cond_attr);
+
+    pthread_mutex_lock(&ctrl->mutex);
+    ctrl->state = VCHAN_WAITING;
+    libvchan__update_events(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+
     return ctrl;
 }
 
+static void set_flags(libvchan_t *ctrl, unsigned int flags) {
+    if (flags & LIBVCHAN_NO_THREAD)
+        ctrl->threadless = true;
+    if (flags & LIBVCHAN_MULTI_WRITER)
+        ctrl->multi_writer = true;
+    if (flags & LIBVCHAN_CREDITS) {
+        ctrl->credits = true;
+        // The first frame tells the peer how much we can take
+        ctrl->main_stream.credit_owed = ctrl->read_ring.size;
+    }
+}
+
 libvchan_t *libvchan_server_init(int domain, int port, size_t read_min, size_t write_min) {
+    return libvchan_server_init_flags(domain, port, read_min, write_min, 0);
+}
+
+libvchan_t *libvchan_server_init_flags(int domain, int port,
+                                       size_t read_min, size_t write_min,
+                                       unsigned int flags) {
     libvchan_t *ctrl = init(
-        get_current_domain(), domain, port, read_min, write_min);
+        get_current_domain(), domain, port, read_min, write_min, flags, true);
     if (!ctrl) {
         return NULL;
     }
@@ -95,21 +188,28 @@ libvchan_t *libvchan_server_init(int domain, int port, size_t read_min, size_t w
         return NULL;
     }
 
-    ctrl->state = VCHAN_WAITING;
+    set_flags(ctrl, flags);
+    if (flags & LIBVCHAN_NO_THREAD)
+        return ctrl;
 
-    if (pthread_create(&ctrl->thread, NULL, libvchan__server, ctrl)) {
-        perror("pthread_create");
+    snprintf(ctrl->thread_name, sizeof(ctrl->thread_name),
+             "vchan/%d/%d", domain, port);
+    if (wait_for_client(ctrl)) {
         libvchan_close(ctrl);
         return NULL;
     }
-    ctrl->thread_started = 1;
 
     return ctrl;
 }
 
 libvchan_t *libvchan_client_init(int domain, int port) {
+    return libvchan_client_init_flags(domain, port, 0);
+}
+
+libvchan_t *libvchan_client_init_flags(int domain, int port,
+                                       unsigned int flags) {
     libvchan_t *ctrl = init(
-        domain, get_current_domain(), port, 1024, 1024);
+        domain, get_current_domain(), port, 1024, 1024, flags, false);
     if (!ctrl) {
         return NULL;
     }
@@ -122,12 +222,18 @@ libvchan_t *libvchan_client_init(int domain, int port) {
 
     ctrl->state = VCHAN_CONNECTED;
 
-    if (pthread_create(&ctrl->thread, NULL, libvchan__client, ctrl)) {
-        perror("pthread_create");
+    set_flags(ctrl, flags);
+    if (flags & LIBVCHAN_NO_THREAD) {
+        ctrl->conn_fd = ctrl->socket_fd;
+        return ctrl;
+    }
+
+    snprintf(ctrl->thread_name, sizeof(ctrl->thread_name),
+             "vchan/%d/%d", domain, port);
+    if (start_thread(ctrl, libvchan__client)) {
         libvchan_close(ctrl);
         return NULL;
     }
-    ctrl->thread_started = 1;
 
     return ctrl;
 }
@@ -159,7 +265,432 @@ int libvchan_client_init_async_finish(libvchan_t *ctrl,
     return 0;
 }
 
+/*
+ * Start a thread with a stack of *stack_size bytes, or if that's 0, the size
+ * from VCHAN_THREAD_STACK_SIZE, or the C library's default. Sets *stack_size
+ * to the size used.
+ */
+static int create_thread(pthread_t *thread, void *(*func)(void *), void *arg,
+                         size_t *stack_size) {
+    pthread_attr_t attr;
+    size_t size = *stack_size;
+    const char *s = getenv("VCHAN_THREAD_STACK_SIZE");
+    if (size == 0 && s)
+        size = strtoul(s, NULL, 0);
+
+    if (pthread_attr_init(&attr)) {
+        perror("pthread_attr_init");
+        return -1;
+    }
+    if (size > 0 && (errno = pthread_attr_setstacksize(&attr, size))) {
+        perror("pthread_attr_setstacksize");
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    if ((errno = pthread_attr_getstacksize(&attr, &size))) {
+        perror("pthread_attr_getstacksize");
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    if ((errno = pthread_create(thread, &attr, func, arg))) {
+        perror("pthread_create");
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    *stack_size = size;
+    __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&thread_stack_bytes, size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void thread_exited(size_t stack_size) {
+    __atomic_sub_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&thread_stack_bytes, stack_size, __ATOMIC_RELAXED);
+}
+
+static int start_thread(libvchan_t *ctrl, void *(*func)(void *)) {
+    if (create_thread(&ctrl->thread, func, ctrl, &ctrl->thread_stack_size))
+        return -1;
+    ctrl->thread_started = 1;
+    if ((errno = pthread_setname_np(ctrl->thread, ctrl->thread_name)))
+        perror("pthread_setname_np");
+    return 0;
+}
+
+/*
+ * A server waiting for a client doesn't need its I/O thread yet, and there
+ * might be thousands of them, waiting for hours. Instead, one thread (the
+ * waiter) polls all their sockets, and starts the I/O thread of a server
+ * once a client connects. It exits when there is nobody left to wait for.
+ */
+static pthread_mutex_t waiter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static libvchan_t **waiting;
+static size_t nwaiting;
+static size_t waiting_alloc;
+static bool waiter_running;
+static size_t waiter_stack_size;
+// Wakes up the waiter when the list changes
+static int waiter_pipe[2] = { -1, -1 };
+
+static void wake_waiter(void) {
+    uint8_t byte = 0;
+    if (write(waiter_pipe[1], &byte, 1) != 1 && errno != EAGAIN)
+        perror("write waiter pipe");
+}
+
+// Called with waiter_mutex held
+static void remove_waiting(libvchan_t *ctrl) {
+    for (size_t i = 0; i < nwaiting; i++) {
+        if (waiting[i] == ctrl) {
+            waiting[i] = waiting[--nwaiting];
+            break;
+        }
+    }
+    ctrl->waiting = false;
+}
+
+// Called with waiter_mutex held. Is ctrl (still) waiting on socket_fd?
+static bool is_waiting(libvchan_t *ctrl, int socket_fd) {
+    for (size_t i = 0; i < nwaiting; i++) {
+        if (waiting[i] == ctrl)
+            return ctrl->socket_fd == socket_fd;
+    }
+    return false;
+}
+
+static void *waiter(void *arg) {
+    struct pollfd *fds = NULL;
+    libvchan_t **ctrls = NULL;
+    size_t alloc = 0;
+
+    (void)arg;
+    sigset_t set;
+    sigfillset(&set);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL))
+        perror("pthread_sigmask");
+
+    pthread_mutex_lock(&waiter_mutex);
+    while (nwaiting > 0) {
+        // Poll a copy of the list, so that it can change in the meantime
+        size_t n = nwaiting;
+        if (n + 1 > alloc) {
+            struct pollfd *new_fds = realloc(fds, (n + 1) * sizeof(*fds));
+            if (new_fds)
+                fds = new_fds;
+            libvchan_t **new_ctrls = realloc(ctrls, n * sizeof(*ctrls));
+            if (new_ctrls)
+                ctrls = new_ctrls;
+            if (!new_fds || !new_ctrls) {
+                perror("realloc");
+                pthread_mutex_unlock(&waiter_mutex);
+                poll(NULL, 0, WAITER_RETRY_MS);
+                pthread_mutex_lock(&waiter_mutex);
+                continue;
+            }
+            alloc = n + 1;
+        }
+        fds[0].fd = waiter_pipe[0];
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < n; i++) {
+            ctrls[i] = waiting[i];
+            fds[i + 1].fd = waiting[i]->socket_fd;
+            fds[i + 1].events = POLLIN;
+        }
+        pthread_mutex_unlock(&waiter_mutex);
+
+        if (poll(fds, n + 1, -1) < 0 && errno != EINTR)
+            perror("poll waiter");
+
+        pthread_mutex_lock(&waiter_mutex);
+        if (fds[0].revents & POLLIN)
+            libvchan__drain_pipe(waiter_pipe[0]);
+        for (size_t i = 0; i < n; i++) {
+            // Closed in the meantime?
+            if (!fds[i + 1].revents || !is_waiting(ctrls[i], fds[i + 1].fd))
+                continue;
+            // The I/O thread will accept the connection
+            remove_waiting(ctrls[i]);
+            if (start_thread(ctrls[i], libvchan__server) < 0)
+                libvchan__server_failed(ctrls[i]);
+        }
+    }
+    waiter_running = false;
+    thread_exited(waiter_stack_size);
+    pthread_mutex_unlock(&waiter_mutex);
+
+    free(fds);
+    free(ctrls);
+    return NULL;
+}
+
+static int wait_for_client(libvchan_t *ctrl) {
+    pthread_mutex_lock(&waiter_mutex);
+    if (nwaiting == waiting_alloc) {
+        size_t alloc = waiting_alloc > 0 ? waiting_alloc * 2 : 16;
+        libvchan_t **new_waiting = realloc(waiting, alloc * sizeof(*waiting));
+        if (!new_waiting) {
+            perror("realloc");
+            pthread_mutex_unlock(&waiter_mutex);
+            return -1;
+        }
+        waiting = new_waiting;
+        waiting_alloc = alloc;
+    }
+    if (waiter_pipe[0] < 0 &&
+        pipe2(waiter_pipe, O_NONBLOCK|O_CLOEXEC)) {
+        perror("pipe");
+        pthread_mutex_unlock(&waiter_mutex);
+        return -1;
+    }
+
+    if (waiter_running) {
+        wake_waiter();
+    } else {
+        pthread_t thread;
+        if (create_thread(&thread, waiter, NULL, &waiter_stack_size)) {
+            pthread_mutex_unlock(&waiter_mutex);
+            return -1;
+        }
+        pthread_detach(thread);
+        if ((errno = pthread_setname_np(thread, "vchan/waiter")))
+            perror("pthread_setname_np");
+        waiter_running = true;
+    }
+
+    waiting[nwaiting++] = ctrl;
+    ctrl->waiting = true;
+    pthread_mutex_unlock(&waiter_mutex);
+    return 0;
+}
+
+// After this, the waiter won't start the I/O thread anymore
+static void stop_waiting(libvchan_t *ctrl) {
+    pthread_mutex_lock(&waiter_mutex);
+    if (ctrl->waiting) {
+        remove_waiting(ctrl);
+        wake_waiter();
+    }
+    pthread_mutex_unlock(&waiter_mutex);
+}
+
+// Called from the I/O thread
+void libvchan__thread_started(libvchan_t *ctrl) {
+    pthread_mutex_lock(&ctrl->mutex);
+    ctrl->thread_tid = syscall(SYS_gettid);
+    // Already checked by the setters, see check_thread_settings
+    apply_thread_settings(ctrl, pthread_self(), ctrl->thread_tid);
+    pthread_mutex_unlock(&ctrl->mutex);
+}
+
+// Called with mutex held
+static int apply_thread_settings(libvchan_t *ctrl, pthread_t thread,
+                                 pid_t tid) {
+    int result = 0;
+
+    if (ctrl->thread_ncpus > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (size_t i = 0; i < ctrl->thread_ncpus; i++)
+            CPU_SET(ctrl->thread_cpus[i], &cpus);
+        if ((errno = pthread_setaffinity_np(thread, sizeof(cpus), &cpus))) {
+            perror("pthread_setaffinity_np");
+            result = -1;
+        }
+    }
+
+    if (ctrl->thread_sched_set) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        // For the non-realtime policies, priority is the nice value
+        if (ctrl->thread_policy == SCHED_FIFO ||
+            ctrl->thread_policy == SCHED_RR)
+            param.sched_priority = ctrl->thread_priority;
+        if ((errno = pthread_setschedparam(
+                 thread, ctrl->thread_policy, &param))) {
+            perror("pthread_setschedparam");
+            result = -1;
+        } else if (ctrl->thread_policy != SCHED_FIFO &&
+                   ctrl->thread_policy != SCHED_RR &&
+                   setpriority(PRIO_PROCESS, tid, ctrl->thread_priority)) {
+            perror("setpriority");
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+struct probe {
+    libvchan_t *ctrl;
+    int result;
+    int error;
+};
+
+static void *probe_thread(void *arg) {
+    struct probe *probe = arg;
+    probe->result = apply_thread_settings(probe->ctrl, pthread_self(),
+                                          syscall(SYS_gettid));
+    probe->error = errno;
+    return NULL;
+}
+
+/*
+ * Until the I/O thread is running, the settings are only stored. Try them on
+ * a short-lived thread instead, so that the caller learns right away if they
+ * can't be applied. Called with mutex held.
+ */
+static int check_thread_settings(libvchan_t *ctrl) {
+    struct probe probe = { ctrl, 0, 0 };
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, NULL, probe_thread, &probe))) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_join(thread, NULL);
+    errno = probe.error;
+    return probe.result;
+}
+
+int libvchan_set_thread_affinity(libvchan_t *ctrl,
+                                 const int *cpus, size_t ncpus) {
+    if (ctrl->threadless || ncpus == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < ncpus; i++) {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    int *copy = malloc(ncpus * sizeof(*copy));
+    if (!copy)
+        return -1;
+    memcpy(copy, cpus, ncpus * sizeof(*copy));
+
+    pthread_mutex_lock(&ctrl->mutex);
+    int *old_cpus = ctrl->thread_cpus;
+    size_t old_ncpus = ctrl->thread_ncpus;
+    ctrl->thread_cpus = copy;
+    ctrl->thread_ncpus = ncpus;
+    int result = ctrl->thread_tid ?
+        apply_thread_settings(ctrl, ctrl->thread, ctrl->thread_tid) :
+        check_thread_settings(ctrl);
+    if (result < 0) {
+        // Keep the settings that worked
+        int error = errno;
+        ctrl->thread_cpus = old_cpus;
+        ctrl->thread_ncpus = old_ncpus;
+        old_cpus = copy;
+        errno = error;
+    }
+    pthread_mutex_unlock(&ctrl->mutex);
+    free(old_cpus);
+    return result;
+}
+
+int libvchan_set_thread_priority(libvchan_t *ctrl, int policy, int priority) {
+    if (ctrl->threadless) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctrl->mutex);
+    bool old_set = ctrl->thread_sched_set;
+    int old_policy = ctrl->thread_policy;
+    int old_priority = ctrl->thread_priority;
+    ctrl->thread_sched_set = true;
+    ctrl->thread_policy = policy;
+    ctrl->thread_priority = priority;
+    int result = ctrl->thread_tid ?
+        apply_thread_settings(ctrl, ctrl->thread, ctrl->thread_tid) :
+        check_thread_settings(ctrl);
+    if (result < 0) {
+        // Keep the settings that worked
+        ctrl->thread_sched_set = old_set;
+        ctrl->thread_policy = old_policy;
+        ctrl->thread_priority = old_priority;
+    }
+    pthread_mutex_unlock(&ctrl->mutex);
+    return result;
+}
+
+/*
+ * Only before the I/O thread is started (so, for a server, until a client
+ * connects). It's started by the waiter (under waiter_mutex), or already in
+ * libvchan_client_init().
+ */
+int libvchan_set_thread_stack_size(libvchan_t *ctrl, size_t size) {
+    if (ctrl->threadless) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Would pthread_create() take it?
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr)) {
+        perror("pthread_attr_init");
+        return -1;
+    }
+    int error = size > 0 ? pthread_attr_setstacksize(&attr, size) : 0;
+    pthread_attr_destroy(&attr);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    pthread_mutex_lock(&waiter_mutex);
+    if (ctrl->thread_started) {
+        pthread_mutex_unlock(&waiter_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    ctrl->thread_stack_size = size;
+    pthread_mutex_unlock(&waiter_mutex);
+    return 0;
+}
+
+// Called with mutex held
+static int move_rings(libvchan_t *ctrl) {
+    int result = 0;
+    for (unsigned int i = 0; i < LIBVCHAN_MAX_STREAMS; i++) {
+        struct libvchan_stream *stream = ctrl->streams[i];
+        if (!stream)
+            continue;
+        if (ring_set_node(stream->read_ring, ctrl->numa_node))
+            result = -1;
+        // Writers are still copying into the space after the tail
+        if (stream->write_ring == &ctrl->write_ring && ctrl->write_claimed > 0)
+            continue;
+        if (ring_set_node(stream->write_ring, ctrl->numa_node))
+            result = -1;
+    }
+    return result;
+}
+
+int libvchan_set_numa_node(libvchan_t *ctrl, int node) {
+    int result = 0;
+
+    pthread_mutex_lock(&ctrl->mutex);
+    if (node == LIBVCHAN_NUMA_THREAD && ctrl->thread_ncpus > 0)
+        node = numa_cpu_node(ctrl->thread_cpus[0]);
+    if (node != LIBVCHAN_NUMA_DEFAULT && !numa_has_node(node)) {
+        errno = EINVAL;
+        result = -1;
+    } else if (numa_nodes() > 1) {
+        ctrl->numa_node = node;
+        result = move_rings(ctrl);
+    }
+    pthread_mutex_unlock(&ctrl->mutex);
+    return result;
+}
+
 void libvchan_close(libvchan_t *ctrl) {
+    libvchan__forward_stop(ctrl);
+    stop_waiting(ctrl);
     if (ctrl->thread_started) {
         pthread_mutex_lock(&ctrl->mutex);
         ctrl->shutdown = 1;
@@ -170,11 +701,35 @@ void libvchan_close(libvchan_t *ctrl) {
             return;
         }
         pthread_join(ctrl->thread, NULL);
+        thread_exited(ctrl->thread_stack_size);
+    } else if (ctrl->threadless && ctrl->conn_fd >= 0) {
+        // Do what the I/O thread would: flush, and close the connection
+        pthread_mutex_lock(&ctrl->mutex);
+        ctrl->shutdown = 1;
+        while (ctrl->state == VCHAN_CONNECTED &&
+               libvchan__write_pending(ctrl)) {
+            struct pollfd fds[1];
+            fds[0].fd = ctrl->conn_fd;
+            fds[0].events = libvchan__process(ctrl);
+            if (fds[0].events <= 0 || ctrl->conn_fd < 0)
+                break;
+            pthread_mutex_unlock(&ctrl->mutex);
+            poll(fds, 1, -1);
+            pthread_mutex_lock(&ctrl->mutex);
+        }
+        if (ctrl->conn_fd >= 0 && ctrl->conn_fd != ctrl->socket_fd)
+            close(ctrl->conn_fd);
+        pthread_mutex_unlock(&ctrl->mutex);
     }
+    // The I/O thread never got to it
+    libvchan__pump_stop(ctrl);
 
     if (ctrl->socket_path)
         free(ctrl->socket_path);
 
+    if (ctrl->thread_cpus)
+        free(ctrl->thread_cpus);
+
     if (ctrl->socket_fd != -1)
         close(ctrl->socket_fd);
 
@@ -186,15 +741,79 @@ void libvchan_close(libvchan_t *ctrl) {
         close(ctrl->socket_event_pipe[0]);
         close(ctrl->socket_event_pipe[1]);
     }
+    if (ctrl->read_event_pipe[0]) {
+        close(ctrl->read_event_pipe[0]);
+        close(ctrl->read_event_pipe[1]);
+    }
+    if (ctrl->write_event_pipe[0]) {
+        close(ctrl->write_event_pipe[0]);
+        close(ctrl->write_event_pipe[1]);
+    }
+    if (ctrl->hup_event_pipe[0]) {
+        close(ctrl->hup_event_pipe[0]);
+        close(ctrl->hup_event_pipe[1]);
+    }
+    if (ctrl->completion_pipe[0]) {
+        close(ctrl->completion_pipe[0]);
+        close(ctrl->completion_pipe[1]);
+    }
+    for (size_t i = 1; i < LIBVCHAN_MAX_STREAMS; i++) {
+        if (ctrl->streams[i]) {
+            ring_destroy(&ctrl->streams[i]->own_read_ring);
+            ring_destroy(&ctrl->streams[i]->own_write_ring);
+            free(ctrl->streams[i]);
+        }
+    }
+    struct libvchan_op_queue *queues[] = {
+        &ctrl->read_ops, &ctrl->write_ops, &ctrl->done_ops
+    };
+    for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+        while (queues[i]->head) {
+            struct libvchan_op *op = queues[i]->head;
+            queues[i]->head = op->next;
+            free(op);
+        }
+    }
     if (ctrl->read_ring.data)
         ring_destroy(&ctrl->read_ring);
     if (ctrl->write_ring.data)
         ring_destroy(&ctrl->write_ring);
+    spill_destroy(&ctrl->spill);
 
+    pthread_cond_destroy(&ctrl->event_cond);
     pthread_mutex_destroy(&ctrl->mutex);
     free(ctrl);
+    __atomic_sub_fetch(&channel_count, 1, __ATOMIC_RELAXED);
+}
+
+int libvchan_get_memory(struct libvchan_memory *memory) {
+    size_t rings, ring_bytes;
+    ring_usage(&rings, &ring_bytes);
+
+    memset(memory, 0, sizeof(*memory));
+    memory->channels = __atomic_load_n(&channel_count, __ATOMIC_RELAXED);
+    memory->threads = __atomic_load_n(&thread_count, __ATOMIC_RELAXED);
+    memory->thread_stack_bytes =
+        __atomic_load_n(&thread_stack_bytes, __ATOMIC_RELAXED);
+    memory->rings = rings;
+    memory->ring_bytes = ring_bytes;
+    return 0;
 }
 
 EVTCHN libvchan_fd_for_select(libvchan_t *ctrl) {
+    if (ctrl->threadless)
+        return ctrl->conn_fd >= 0 ? ctrl->conn_fd : ctrl->socket_fd;
     return ctrl->socket_event_pipe[0];
 }
+
+EVTCHN libvchan_fd_for_read(libvchan_t *ctrl) {
+    return ctrl->read_event_pipe[0];
+}
+
+EVTCHN libvchan_fd_for_write(libvchan_t *ctrl) {
+    return ctrl->write_event_pipe[0];
+}
+
+EVTCHN libvchan_fd_for_completion(libvchan_t *ctrl) {
+    return ctrl->completion_pipe[0];
+}
@@ -21,50 +21,254 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include "libvchan.h"
 #include "libvchan_private.h"
 
-static int do_read(libvchan_t *ctrl, void *data,
-                   size_t min_size, size_t max_size);
-static int do_write(libvchan_t *ctrl, const void *data,
-                    size_t min_size, size_t max_size);
+static ssize_t do_read(libvchan_t *ctrl, unsigned int id, void *data,
+                       size_t min_size, size_t max_size);
+static ssize_t read_parts(libvchan_t *ctrl, unsigned int id, void *data,
+                          size_t size);
+static ssize_t do_write(libvchan_t *ctrl, unsigned int id,
+                        const struct iovec *iov, int iovcnt,
+                        size_t min_size, size_t max_size, bool batch);
+static ssize_t send_parts(libvchan_t *ctrl, unsigned int id,
+                          const struct iovec *iov, int iovcnt, size_t size);
+static size_t int_size(size_t size);
+static bool fits_int(size_t size);
+static bool can_write_direct(libvchan_t *ctrl);
+static size_t direct_write(libvchan_t *ctrl, const struct iovec *iov,
+                           int iovcnt, size_t size);
+static bool spill_rest(libvchan_t *ctrl, const struct iovec *iov, int iovcnt,
+                       size_t *written, size_t min_size, size_t max_size,
+                       bool batch);
+static size_t ring_space(libvchan_t *ctrl, unsigned int id);
+static size_t read_available(libvchan_t *ctrl, unsigned int id);
+static void take_data(libvchan_t *ctrl, struct libvchan_stream *stream,
+                      void *data, size_t size);
+static void consume_data(libvchan_t *ctrl, struct libvchan_stream *stream,
+                         size_t size);
+static bool check_stream(libvchan_t *ctrl, unsigned int id);
+static bool read_busy(libvchan_t *ctrl);
+static struct libvchan_op *new_op(const void *data, size_t size,
+                                  void *user_data);
+static void push_op(struct libvchan_op_queue *queue, struct libvchan_op *op);
+static void set_event(int pipe_fds[2], bool *is_set, bool value);
+static void stream_totals(libvchan_t *ctrl, size_t *read_filled,
+                          size_t *write_space);
+static int wait_event(libvchan_t *ctrl, const struct timespec *deadline);
+static int wake_thread(libvchan_t *ctrl);
+static int add_link(libvchan_t *from, libvchan_t *to);
+static void stop_forward(libvchan_t *ctrl, bool out, bool in);
+static void stop_link(struct libvchan_link *link);
+static void forward_link(struct libvchan_link *link);
+static struct libvchan_link *get_link(struct libvchan_link *link);
+static void put_link(struct libvchan_link *link);
+static int pump_loop(libvchan_t *ctrl);
+static void pump_end(libvchan_t *ctrl, int *fd, int other_fd, int how);
+static int set_nonblock(int fd);
+static short poll_revents(libvchan_t *ctrl, short events);
+static struct timespec *get_deadline(int timeout, struct timespec *deadline);
+static int poll_timeout(const struct timespec *deadline);
 
 int libvchan_read(libvchan_t *ctrl, void *data, size_t size) {
-    return do_read(ctrl, data, 1, size);
+    return do_read(ctrl, 0, data, 1, int_size(size));
 }
 
 int libvchan_recv(libvchan_t *ctrl, void *data, size_t size) {
-    return do_read(ctrl, data, size, size);
+    if (!fits_int(size))
+        return -1;
+    return do_read(ctrl, 0, data, size, size);
 }
 
 int libvchan_write(libvchan_t *ctrl, const void *data, size_t size) {
-    return do_write(ctrl, data, 1, size);
+    struct iovec iov = { (void *)data, int_size(size) };
+    return do_write(ctrl, 0, &iov, 1, 1, iov.iov_len, false);
 }
 
 int libvchan_send(libvchan_t *ctrl, const void *data, size_t size) {
-    return do_write(ctrl, data, size, size);
+    if (!fits_int(size))
+        return -1;
+    struct iovec iov = { (void *)data, size };
+    return do_write(ctrl, 0, &iov, 1, size, size, false);
+}
+
+int libvchan_sendv(libvchan_t *ctrl, const struct iovec *iov, int iovcnt) {
+    size_t size = iov_size(iov, iovcnt);
+    if (!fits_int(size))
+        return -1;
+    return do_write(ctrl, 0, iov, iovcnt, size, size, false);
+}
+
+ssize_t libvchan_read64(libvchan_t *ctrl, void *data, size_t size) {
+    return do_read(ctrl, 0, data, 1, size);
+}
+
+ssize_t libvchan_recv64(libvchan_t *ctrl, void *data, size_t size) {
+    return do_read(ctrl, 0, data, size, size);
+}
+
+ssize_t libvchan_write64(libvchan_t *ctrl, const void *data, size_t size) {
+    struct iovec iov = { (void *)data, size };
+    return do_write(ctrl, 0, &iov, 1, 1, size, false);
+}
+
+ssize_t libvchan_send64(libvchan_t *ctrl, const void *data, size_t size) {
+    struct iovec iov = { (void *)data, size };
+    return do_write(ctrl, 0, &iov, 1, size, size, false);
+}
+
+int libvchan_send_batch(libvchan_t *ctrl, const struct iovec *msgs, int n,
+                        int *sent) {
+    *sent = 0;
+    if (n == 0)
+        return 0;
+
+    if (!fits_int(msgs[0].iov_len))
+        return -1;
+    int result = do_write(ctrl, 0, msgs, n, msgs[0].iov_len,
+                          int_size(iov_size(msgs, n)), true);
+    if (result > 0) {
+        size_t size;
+        *sent = iov_whole(msgs, n, result, &size);
+    }
+    return result;
+}
+
+int libvchan_stream_read(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size) {
+    return do_read(ctrl, stream, data, 1, int_size(size));
+}
+
+int libvchan_stream_recv(libvchan_t *ctrl, unsigned int stream,
+                         void *data, size_t size) {
+    if (!fits_int(size))
+        return -1;
+    return do_read(ctrl, stream, data, size, size);
+}
+
+int libvchan_stream_write(libvchan_t *ctrl, unsigned int stream,
+                          const void *data, size_t size) {
+    struct iovec iov = { (void *)data, int_size(size) };
+    return do_write(ctrl, stream, &iov, 1, 1, iov.iov_len, false);
+}
+
+int libvchan_stream_send(libvchan_t *ctrl, unsigned int stream,
+                         const void *data, size_t size) {
+    if (!fits_int(size))
+        return -1;
+    struct iovec iov = { (void *)data, size };
+    return do_write(ctrl, stream, &iov, 1, size, size, false);
+}
+
+// The int variants return at most INT_MAX
+static size_t int_size(size_t size) {
+    return size > INT_MAX ? INT_MAX : size;
+}
+
+// ... so a send or recv of more than that has to use the 64-bit variants
+static bool fits_int(size_t size) {
+    if (size > INT_MAX) {
+        errno = EOVERFLOW;
+        return false;
+    }
+    return true;
+}
+
+int libvchan_stream_open(libvchan_t *ctrl, unsigned int stream,
+                         size_t read_min, size_t write_min, int priority) {
+    if (!ctrl->credits || stream == 0 || stream >= LIBVCHAN_MAX_STREAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct libvchan_stream *new_stream = calloc(1, sizeof(*new_stream));
+    if (!new_stream)
+        return -1;
+    if (ring_init(&new_stream->own_read_ring, read_min, ctrl->ring_flags,
+                  ctrl->numa_node) ||
+        ring_init(&new_stream->own_write_ring, write_min, ctrl->ring_flags,
+                  ctrl->numa_node)) {
+        ring_destroy(&new_stream->own_read_ring);
+        free(new_stream);
+        return -1;
+    }
+    new_stream->read_ring = &new_stream->own_read_ring;
+    new_stream->write_ring = &new_stream->own_write_ring;
+    new_stream->priority = priority;
+    // Tell the peer how much we can take
+    new_stream->credit_owed = new_stream->read_ring->size;
+
+    pthread_mutex_lock(&ctrl->mutex);
+    if (ctrl->streams[stream]) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        ring_destroy(&new_stream->own_read_ring);
+        ring_destroy(&new_stream->own_write_ring);
+        free(new_stream);
+        errno = EEXIST;
+        return -1;
+    }
+    new_stream->credit = ctrl->unopened_credit[stream];
+    ctrl->unopened_credit[stream] = 0;
+    ctrl->streams[stream] = new_stream;
+    ctrl->nstreams++;
+    pthread_mutex_unlock(&ctrl->mutex);
+
+    return wake_thread(ctrl);
 }
 
-static int do_read(libvchan_t *ctrl, void *data, size_t min_size, size_t max_size) {
+// Read from stream id (0 is the channel itself)
+static ssize_t do_read(libvchan_t *ctrl, unsigned int id, void *data,
+                       size_t min_size, size_t max_size) {
     pthread_mutex_lock(&ctrl->mutex);
+    if (!check_stream(ctrl, id)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+    struct libvchan_stream *stream = ctrl->streams[id];
+    if (id == 0 && read_busy(ctrl)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+
+    // Would never fit in read_ring at once
+    if (min_size > stream->read_ring->size) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return read_parts(ctrl, id, data, min_size);
+    }
 
-    size_t size = ring_filled(&ctrl->read_ring);
-    while (size < min_size) {
+    // Low watermark applies only to stream 0
+    size_t lowat = id == 0 ? ctrl->read_lowat : 1;
+    size_t wanted = lowat < max_size ? lowat : max_size;
+    if (wanted < min_size)
+        wanted = min_size;
+
+    struct timespec deadline_buf;
+    struct timespec *deadline = get_deadline(ctrl->timeout, &deadline_buf);
+    int ret = 0;
+    size_t size = read_available(ctrl, id);
+    while (size < wanted && ret == 0) {
         if (ctrl->state == VCHAN_DISCONNECTED)
             break;
-        pthread_mutex_unlock(&ctrl->mutex);
-        if (libvchan_wait(ctrl) < 0) {
+        ret = wait_event(ctrl, deadline);
+        if (ret < 0 || (id == 0 && read_busy(ctrl))) {
+            pthread_mutex_unlock(&ctrl->mutex);
             return -1;
         }
-        pthread_mutex_lock(&ctrl->mutex);
-        size = ring_filled(&ctrl->read_ring);
+        size = read_available(ctrl, id);
     }
 
-    // Disconnected too early?
+    // Disconnected or timed out too early?
     if (size < min_size) {
+        if (ret > 0)
+            errno = ctrl->timeout == 0 ? EAGAIN : ETIMEDOUT;
         pthread_mutex_unlock(&ctrl->mutex);
         return -1;
     }
@@ -75,102 +279,1546 @@ static int do_read(libvchan_t *ctrl, void *data, size_t min_size, size_t max_siz
         size = max_size;
     }
 
-    memcpy(data, ring_head(&ctrl->read_ring), size);
-    ring_advance_head(&ctrl->read_ring, size);
-
+    take_data(ctrl, stream, data, size);
     pthread_mutex_unlock(&ctrl->mutex);
 
-    uint8_t byte = 0;
-    if (write(ctrl->user_event_pipe[1], &byte, 1) != 1) {
-        perror("write user pipe");
+    if (wake_thread(ctrl) < 0)
         return -1;
-    }
 
     return size;
 }
 
-static int do_write(libvchan_t *ctrl, const void *data,
-                    size_t min_size, size_t max_size) {
+// Copy out and consume the data from read_ring. Called with mutex held.
+static void take_data(libvchan_t *ctrl, struct libvchan_stream *stream,
+                      void *data, size_t size) {
+    copy_data(data, ring_head(stream->read_ring), size);
+    consume_data(ctrl, stream, size);
+}
+
+static void consume_data(libvchan_t *ctrl, struct libvchan_stream *stream,
+                         size_t size) {
+    ring_advance_head(stream->read_ring, size);
+    if (ctrl->credits)
+        stream->credit_owed += size;
+    libvchan__update_events(ctrl);
+}
+
+/*
+ * Receive a message larger than read_ring, as it arrives. If the channel
+ * is closed (or the call times out) in the middle, the part already read is
+ * lost.
+ */
+static ssize_t read_parts(libvchan_t *ctrl, unsigned int id, void *data,
+                          size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = do_read(ctrl, id, (uint8_t *)data + done,
+                                1, size - done);
+        if (count < 0)
+            return -1;
+        done += count;
+    }
+    return done;
+}
+
+/*
+ * Write to stream id (0 is the channel itself). With batch, iov entries are
+ * separate messages: write only whole ones, all into write_ring at once.
+ */
+static ssize_t do_write(libvchan_t *ctrl, unsigned int id,
+                        const struct iovec *iov, int iovcnt,
+                        size_t min_size, size_t max_size, bool batch) {
     pthread_mutex_lock(&ctrl->mutex);
+    if (!check_stream(ctrl, id)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+    struct ring *ring = ctrl->streams[id]->write_ring;
+    bool claim = id == 0 && ctrl->multi_writer;
 
-    size_t size = ring_available(&ctrl->write_ring);
-    while (size < min_size) {
+    // A send has to fit in write_ring as a whole
+    if ((claim || batch) && min_size > ring->size) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        errno = EMSGSIZE;
+        return -1;
+    }
+    // Otherwise, a larger one goes in parts
+    if (min_size > ring->size) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return send_parts(ctrl, id, iov, iovcnt, min_size);
+    }
+
+    size_t lowat = id == 0 ? ctrl->write_lowat : 1;
+    size_t wanted = lowat < max_size ? lowat : max_size;
+    if (wanted < min_size)
+        wanted = min_size;
+
+    size_t written = id == 0 && !batch ?
+        direct_write(ctrl, iov, iovcnt, max_size) : 0;
+    if (written == max_size) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return written;
+    }
+
+    // Spill what doesn't fit, rather than wait
+    if (id == 0 && ctrl->spill.max > 0 &&
+        ctrl->state != VCHAN_DISCONNECTED &&
+        written + libvchan__stream_space(ctrl, id) < wanted &&
+        spill_rest(ctrl, iov, iovcnt, &written, min_size, max_size, batch)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        if (wake_thread(ctrl) < 0)
+            return -1;
+        return written;
+    }
+
+    struct timespec deadline_buf;
+    struct timespec *deadline = get_deadline(ctrl->timeout, &deadline_buf);
+    int ret = 0;
+    size_t size = libvchan__stream_space(ctrl, id);
+    while (written + size < wanted && ret == 0) {
         if (ctrl->state == VCHAN_DISCONNECTED)
             break;
-        pthread_mutex_unlock(&ctrl->mutex);
-        if (libvchan_wait(ctrl) < 0) {
+        ret = wait_event(ctrl, deadline);
+        if (ret < 0) {
+            pthread_mutex_unlock(&ctrl->mutex);
             return -1;
         }
-        pthread_mutex_lock(&ctrl->mutex);
-        size = ring_available(&ctrl->write_ring);
+        size = libvchan__stream_space(ctrl, id);
     }
 
-    // Disconnected too early?
-    if (size < min_size || ctrl->state == VCHAN_DISCONNECTED) {
+    // Disconnected or timed out too early?
+    if (written + size < min_size || ctrl->state == VCHAN_DISCONNECTED) {
+        if (ret > 0 && ctrl->state != VCHAN_DISCONNECTED)
+            errno = ctrl->timeout == 0 ? EAGAIN : ETIMEDOUT;
         pthread_mutex_unlock(&ctrl->mutex);
         return -1;
     }
 
-    if (size > max_size) {
-        size = max_size;
+    if (size > max_size - written) {
+        size = max_size - written;
     }
+    if (batch)
+        iov_whole(iov, iovcnt, size, &size);
 
-    memcpy(ring_tail(&ctrl->write_ring), data, size);
-    ring_advance_tail(&ctrl->write_ring, size);
+    // Written before a client connected?
+    if (size > 0 && ring_map(ring) < 0) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+
+    if (id == 0 && ring_filled(ring) == 0 && ctrl->write_claimed == 0)
+        clock_gettime(CLOCK_MONOTONIC, &ctrl->write_start);
+
+    if (claim) {
+        // Claim the space after the other writers' claims, and copy the
+        // data without holding the mutex. The I/O thread moves only the
+        // head, so the tail stays in place.
+        uint8_t *dest = ring_tail(ring) + ctrl->write_claimed;
+        ctrl->write_claimed += size;
+        ctrl->write_claims++;
+        pthread_mutex_unlock(&ctrl->mutex);
+        iov_gather(dest, iov, iovcnt, written, size);
+        pthread_mutex_lock(&ctrl->mutex);
+        if (--ctrl->write_claims > 0) {
+            // Someone is still copying, they will publish our data too
+            pthread_mutex_unlock(&ctrl->mutex);
+            return written + size;
+        }
+        ring_advance_tail(ring, ctrl->write_claimed);
+        ctrl->write_claimed = 0;
+    } else {
+        iov_gather(ring_tail(ring), iov, iovcnt, written, size);
+        ring_advance_tail(ring, size);
+    }
+    libvchan__update_events(ctrl);
+
+    // Don't wake up the I/O thread if it's going to hold the data anyway,
+    // unless it needs to start the flush_usec timer. Other streams are
+    // never held back.
+    struct timespec timeout;
+    int wake = id != 0 || libvchan__flush_due(ctrl, &timeout) ||
+        (ctrl->flush_usec > 0 && ring_filled(ring) == size) || claim;
 
     pthread_mutex_unlock(&ctrl->mutex);
 
-    uint8_t byte = 0;
-    if (write(ctrl->user_event_pipe[1], &byte, 1) != 1) {
-        perror("write user pipe");
+    if (wake && wake_thread(ctrl) < 0)
         return -1;
-    }
 
-    return size;
+    return written + size;
 }
 
-int libvchan_wait(libvchan_t *ctrl) {
-    struct pollfd fds[1];
-    fds[0].fd = ctrl->socket_event_pipe[0];
-    fds[0].events = POLLIN;
-    while (poll(fds, 1, -1) < 0) {
-        if (errno != EINTR) {
-            perror("poll wait");
+/*
+ * Send a message larger than write_ring, as the space frees up. If the
+ * channel is closed (or the call times out) in the middle, the part already
+ * written still goes out.
+ */
+static ssize_t send_parts(libvchan_t *ctrl, unsigned int id,
+                          const struct iovec *iov, int iovcnt, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        struct iovec slice[IOV_SLICE_MAX];
+        int count = iov_slice(slice, iov, iovcnt, done, size - done);
+        ssize_t written = do_write(ctrl, id, slice, count,
+                                   1, iov_size(slice, count), false);
+        if (written < 0)
             return -1;
-        }
+        done += written;
     }
+    return done;
+}
 
-    libvchan__drain_pipe(ctrl->socket_event_pipe[0]);
-    return 0;
+// Nothing queued before the data, and nothing holding it back
+static bool can_write_direct(libvchan_t *ctrl) {
+    return ctrl->conn_fd >= 0 &&
+        ring_filled(&ctrl->write_ring) == 0 &&
+        spill_pending(&ctrl->spill) == 0 &&
+        !ctrl->write_ops.head &&
+        !ctrl->credits &&
+        !ctrl->corked &&
+        ctrl->flush_bytes == 0 &&
+        ctrl->flush_usec == 0 &&
+        !rate_limited(&ctrl->write_rate) &&
+        !ctrl->multi_writer;
 }
 
-int libvchan__drain_pipe(int fd) {
-    const int BUF_SIZE = 16;
+/*
+ * If there is nothing queued in write_ring, and nothing to hold back, try
+ * writing to the socket directly instead of waking up the I/O thread.
+ * The I/O thread writes only with mutex held, so this preserves the order.
+ * Not with multiple writers: the rest of a partial write would have to wait
+ * for space, and others could write in between.
+ * Errors are left for the I/O thread to notice. Called with mutex held.
+ */
+static size_t direct_write(libvchan_t *ctrl, const struct iovec *iov,
+                           int iovcnt, size_t size) {
+    if (!can_write_direct(ctrl))
+        return 0;
 
-    uint8_t buf[BUF_SIZE];
-    int ret;
-    do {
-        ret = read(fd, buf, BUF_SIZE);
-    } while (ret == BUF_SIZE);
-    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        perror("read drain_pipe");
+    struct iovec slice[IOV_SLICE_MAX];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = slice;
+    msg.msg_iovlen = iov_slice(slice, iov, iovcnt, 0, size);
+    ssize_t count = sendmsg(ctrl->conn_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (count <= 0)
+        return 0;
+    rate_account(&ctrl->write_rate, count);
+    return count;
+}
+
+/*
+ * Instead of waiting for space, put what fits in write_ring, and the rest in
+ * the spill buffer, after anything spilled before. Returns false if less than
+ * min_size fits even then. Called with mutex held.
+ */
+static bool spill_rest(libvchan_t *ctrl, const struct iovec *iov, int iovcnt,
+                       size_t *written, size_t min_size, size_t max_size,
+                       bool batch) {
+    struct spill *spill = &ctrl->spill;
+    size_t ring_size = libvchan__stream_space(ctrl, 0);
+    size_t size = ring_size + spill_space(spill);
+    if (size > max_size - *written)
+        size = max_size - *written;
+    if (batch)
+        iov_whole(iov, iovcnt, size, &size);
+    if (size == 0 || *written + size < min_size)
+        return false;
+
+    if (ring_size > size)
+        ring_size = size;
+    if (ring_size > 0) {
+        if (ring_map(&ctrl->write_ring) < 0)
+            return false;
+        if (ring_filled(&ctrl->write_ring) == 0)
+            clock_gettime(CLOCK_MONOTONIC, &ctrl->write_start);
+        iov_gather(ring_tail(&ctrl->write_ring), iov, iovcnt,
+                   *written, ring_size);
+        ring_advance_tail(&ctrl->write_ring, ring_size);
+        *written += ring_size;
+    }
+    if (size > ring_size) {
+        if (spill_write(spill, iov, iovcnt, *written, size - ring_size) < 0)
+            return ring_size > 0 && *written >= min_size;
+        *written += size - ring_size;
+    }
+    libvchan__update_events(ctrl);
+    return true;
+}
+
+// A server's rings are allocated once a client connects (see init).
+// Called with mutex held.
+int libvchan__map_rings(libvchan_t *ctrl) {
+    if (ring_map(&ctrl->read_ring) || ring_map(&ctrl->write_ring))
         return -1;
+    return 0;
+}
+
+// Synchronous reads wait for the asynchronous ones to finish
+static size_t read_available(libvchan_t *ctrl, unsigned int id) {
+    if (id == 0 && ctrl->read_ops.head)
+        return 0;
+    return ring_filled(ctrl->streams[id]->read_ring);
+}
+
+/*
+ * Whether the data read goes elsewhere (see libvchan_forward, libvchan_pump),
+ * so that nobody else may consume it. Called with mutex held.
+ */
+static bool read_busy(libvchan_t *ctrl) {
+    if (ctrl->forward_out || ctrl->pump.out_fd >= 0) {
+        errno = EBUSY;
+        return true;
+    }
+    return false;
+}
+
+// Called with mutex held
+static bool check_stream(libvchan_t *ctrl, unsigned int id) {
+    if (id >= LIBVCHAN_MAX_STREAMS || !ctrl->streams[id]) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+size_t libvchan__write_space(libvchan_t *ctrl) {
+    return libvchan__stream_space(ctrl, 0);
+}
+
+/*
+ * Space for synchronous writes: free space in write_ring of the stream, but
+ * with credits, no more than the peer can take. Called with mutex held.
+ */
+size_t libvchan__stream_space(libvchan_t *ctrl, unsigned int id) {
+    // Asynchronous writes and spilled data go first
+    if (id == 0 && (ctrl->write_ops.head || spill_pending(&ctrl->spill) > 0))
+        return 0;
+    return ring_space(ctrl, id);
+}
+
+// Space in the stream's write_ring, as far as the credits allow
+static size_t ring_space(libvchan_t *ctrl, unsigned int id) {
+    struct libvchan_stream *stream = ctrl->streams[id];
+    size_t claimed = id == 0 ? ctrl->write_claimed : 0;
+    size_t space = ring_available(stream->write_ring) - claimed;
+    if (ctrl->credits) {
+        // Data in the current frame is already paid for
+        size_t unpaid = ring_filled(stream->write_ring) + claimed;
+        if (ctrl->tx_stream == id)
+            unpaid -= ctrl->tx_frame_left;
+        size_t credit = stream->credit > unpaid ? stream->credit - unpaid : 0;
+        if (credit < space)
+            space = credit;
     }
+    return space;
+}
+
+// Anything left to send? Called with mutex held.
+bool libvchan__write_pending(libvchan_t *ctrl) {
+    if (ctrl->write_ops.head || spill_pending(&ctrl->spill) > 0)
+        return true;
+    for (size_t i = 0; i < LIBVCHAN_MAX_STREAMS; i++)
+        if (ctrl->streams[i] && ring_filled(ctrl->streams[i]->write_ring) > 0)
+            return true;
+    return false;
+}
+
+/*
+ * Move spilled data into write_ring, as much as fits. Asynchronous writes
+ * submitted meanwhile go first. Called with mutex held.
+ */
+int libvchan__spill_drain(libvchan_t *ctrl) {
+    size_t size = spill_pending(&ctrl->spill);
+    if (size == 0 || ctrl->write_ops.head)
+        return 0;
+
+    size_t space = ring_space(ctrl, 0);
+    if (size > space)
+        size = space;
+    if (size == 0)
+        return 0;
+
+    if (ring_filled(&ctrl->write_ring) == 0)
+        clock_gettime(CLOCK_MONOTONIC, &ctrl->write_start);
+    if (spill_read(&ctrl->spill, ring_tail(&ctrl->write_ring), size) < 0)
+        return -1;
+    ring_advance_tail(&ctrl->write_ring, size);
+    libvchan__update_events(ctrl);
     return 0;
 }
 
-int libvchan_data_ready(libvchan_t *ctrl) {
+int libvchan_submit_read(libvchan_t *ctrl, void *data, size_t size,
+                         void *user_data) {
+    if (ctrl->credits) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct libvchan_op *op = new_op(data, size, user_data);
+    if (!op)
+        return -1;
+
     pthread_mutex_lock(&ctrl->mutex);
-    int result = ring_filled(&ctrl->read_ring);
+    if (read_busy(ctrl)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        free(op);
+        return -1;
+    }
+    if (ctrl->state == VCHAN_DISCONNECTED &&
+        ring_filled(&ctrl->read_ring) == 0) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        free(op);
+        errno = EPIPE;
+        return -1;
+    }
+
+    push_op(&ctrl->read_ops, op);
+    // Take what's already buffered, the I/O thread reads the rest
+    libvchan__fill_read_ops(ctrl);
+    if (ctrl->state == VCHAN_DISCONNECTED)
+        libvchan__cancel_ops(ctrl);
+    libvchan__update_events(ctrl);
+    bool pending = ctrl->read_ops.head != NULL;
     pthread_mutex_unlock(&ctrl->mutex);
-    return result;
+
+    return pending ? wake_thread(ctrl) : 0;
 }
 
-int libvchan_buffer_space(libvchan_t *ctrl) {
+int libvchan_submit_write(libvchan_t *ctrl, const void *data, size_t size,
+                          void *user_data) {
+    if (ctrl->credits) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct libvchan_op *op = new_op(data, size, user_data);
+    if (!op)
+        return -1;
+
     pthread_mutex_lock(&ctrl->mutex);
-    int result = ring_available(&ctrl->write_ring);
+    if (ctrl->state == VCHAN_DISCONNECTED) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        free(op);
+        errno = EPIPE;
+        return -1;
+    }
+
+    push_op(&ctrl->write_ops, op);
+    // Nothing to send before it, so try right away (see direct_write)
+    if (ctrl->conn_fd >= 0 && ctrl->write_ops.head == op &&
+        ring_filled(&ctrl->write_ring) == 0) {
+        ssize_t count = send(ctrl->conn_fd, op->data, op->size,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (count > 0)
+            op->done = count;
+    }
+    if (op->done == op->size) {
+        libvchan__complete_op(ctrl, &ctrl->write_ops);
+        pthread_mutex_unlock(&ctrl->mutex);
+        return 0;
+    }
     pthread_mutex_unlock(&ctrl->mutex);
-    return result;
+
+    return wake_thread(ctrl);
+}
+
+int libvchan_get_completions(libvchan_t *ctrl,
+                             struct libvchan_completion *completions,
+                             int max) {
+    int count = 0;
+
+    pthread_mutex_lock(&ctrl->mutex);
+    while (count < max && ctrl->done_ops.head) {
+        struct libvchan_op *op = ctrl->done_ops.head;
+        ctrl->done_ops.head = op->next;
+        completions[count].user_data = op->user_data;
+        completions[count].result = op->done;
+        free(op);
+        count++;
+    }
+    set_event(ctrl->completion_pipe, &ctrl->completion_event_set,
+              ctrl->done_ops.head != NULL);
+    pthread_mutex_unlock(&ctrl->mutex);
+    return count;
+}
+
+static struct libvchan_op *new_op(const void *data, size_t size,
+                                  void *user_data) {
+    if (size > INT_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct libvchan_op *op = malloc(sizeof(*op));
+    if (!op) {
+        perror("malloc");
+        return NULL;
+    }
+    op->next = NULL;
+    op->data = (uint8_t *)data;
+    op->size = size;
+    op->done = 0;
+    op->user_data = user_data;
+    return op;
+}
+
+static void push_op(struct libvchan_op_queue *queue, struct libvchan_op *op) {
+    if (queue->head)
+        queue->tail->next = op;
+    else
+        queue->head = op;
+    queue->tail = op;
+}
+
+// Copy data from read_ring to the pending reads. Called with mutex held.
+void libvchan__fill_read_ops(libvchan_t *ctrl) {
+    while (ctrl->read_ops.head) {
+        struct libvchan_op *op = ctrl->read_ops.head;
+        size_t count = ring_filled(&ctrl->read_ring);
+        if (count > op->size - op->done)
+            count = op->size - op->done;
+        copy_data(op->data + op->done, ring_head(&ctrl->read_ring), count);
+        ring_advance_head(&ctrl->read_ring, count);
+        op->done += count;
+        if (op->done < op->size)
+            break;
+        libvchan__complete_op(ctrl, &ctrl->read_ops);
+    }
+}
+
+// Move the first operation in queue to done_ops. Called with mutex held.
+void libvchan__complete_op(libvchan_t *ctrl, struct libvchan_op_queue *queue) {
+    struct libvchan_op *op = queue->head;
+    queue->head = op->next;
+    op->next = NULL;
+    push_op(&ctrl->done_ops, op);
+    set_event(ctrl->completion_pipe, &ctrl->completion_event_set, true);
+    pthread_cond_broadcast(&ctrl->event_cond);
+}
+
+// Finish everything pending after disconnect. Called with mutex held.
+void libvchan__cancel_ops(libvchan_t *ctrl) {
+    libvchan__fill_read_ops(ctrl);
+    while (ctrl->read_ops.head)
+        libvchan__complete_op(ctrl, &ctrl->read_ops);
+    while (ctrl->write_ops.head)
+        libvchan__complete_op(ctrl, &ctrl->write_ops);
+}
+
+// Data to read and space to write in all streams, to check for progress
+static void stream_totals(libvchan_t *ctrl, size_t *read_filled,
+                          size_t *write_space) {
+    *read_filled = 0;
+    *write_space = 0;
+    for (unsigned int i = 0; i < LIBVCHAN_MAX_STREAMS; i++) {
+        if (ctrl->streams[i]) {
+            *read_filled += ring_filled(ctrl->streams[i]->read_ring);
+            *write_space += libvchan__stream_space(ctrl, i);
+        }
+    }
+}
+
+/*
+ * Wait for the I/O thread to change something. Without I/O thread, do the
+ * I/O ourselves, blocking until there is some progress.
+ * Returns 1 if the deadline (if any) passed first.
+ * Called with mutex held.
+ */
+static int wait_event(libvchan_t *ctrl, const struct timespec *deadline) {
+    if (!ctrl->threadless) {
+        if (!deadline) {
+            pthread_cond_wait(&ctrl->event_cond, &ctrl->mutex);
+            return 0;
+        }
+        int ret = pthread_cond_timedwait(&ctrl->event_cond, &ctrl->mutex,
+                                         deadline);
+        return ret == ETIMEDOUT ? 1 : 0;
+    }
+
+    size_t read_filled, write_space;
+    stream_totals(ctrl, &read_filled, &write_space);
+    int state = ctrl->state;
+
+    struct pollfd fds[1];
+    fds[0].events = libvchan__process(ctrl);
+    if (fds[0].events < 0)
+        return -1;
+    size_t new_read_filled, new_write_space;
+    stream_totals(ctrl, &new_read_filled, &new_write_space);
+    if (new_read_filled != read_filled || new_write_space != write_space ||
+        ctrl->state != state ||
+        (fds[0].events == 0 && ctrl->process_timeout.tv_sec < 0))
+        return 0;
+
+    // Wake up early if there is something to do later (e.g. the rate limit
+    // allows more I/O)
+    int timeout = poll_timeout(deadline);
+    if (ctrl->process_timeout.tv_sec >= 0) {
+        long long ms = ctrl->process_timeout.tv_sec * 1000LL +
+            (ctrl->process_timeout.tv_nsec + 999999) / 1000000;
+        if (timeout < 0 || ms < timeout)
+            timeout = ms;
+    }
+
+    fds[0].fd = libvchan_fd_for_select(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+    int ret;
+    while ((ret = poll(fds, 1, timeout)) < 0) {
+        if (errno != EINTR) {
+            perror("poll wait");
+            pthread_mutex_lock(&ctrl->mutex);
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&ctrl->mutex);
+    if (ret == 0 && deadline && poll_timeout(deadline) == 0)
+        return 1;
+    return libvchan__process(ctrl) < 0 ? -1 : 0;
+}
+
+int libvchan_wait(libvchan_t *ctrl) {
+    return libvchan_wait_timeout(ctrl, -1);
+}
+
+int libvchan_wait_timeout(libvchan_t *ctrl, int timeout) {
+    struct timespec deadline_buf;
+    struct timespec *deadline = get_deadline(timeout, &deadline_buf);
+
+    if (ctrl->threadless) {
+        pthread_mutex_lock(&ctrl->mutex);
+        int result = wait_event(ctrl, deadline);
+        pthread_mutex_unlock(&ctrl->mutex);
+        if (result > 0) {
+            errno = timeout == 0 ? EAGAIN : ETIMEDOUT;
+            return -1;
+        }
+        return result;
+    }
+
+    struct pollfd fds[1];
+    fds[0].fd = ctrl->socket_event_pipe[0];
+    fds[0].events = POLLIN;
+    int ret;
+    while ((ret = poll(fds, 1, poll_timeout(deadline))) < 0) {
+        if (errno != EINTR) {
+            perror("poll wait");
+            return -1;
+        }
+    }
+    if (ret == 0) {
+        errno = timeout == 0 ? EAGAIN : ETIMEDOUT;
+        return -1;
+    }
+
+    libvchan__drain_pipe(ctrl->socket_event_pipe[0]);
+    return 0;
+}
+
+int libvchan_set_timeout(libvchan_t *ctrl, int timeout) {
+    pthread_mutex_lock(&ctrl->mutex);
+    ctrl->timeout = timeout < 0 ? -1 : timeout;
+    pthread_mutex_unlock(&ctrl->mutex);
+    return 0;
+}
+
+int libvchan_set_rate_limit(libvchan_t *ctrl, int direction,
+                            uint64_t bytes_per_sec, uint64_t ops_per_sec) {
+    if (direction & ~(LIBVCHAN_RATE_READ | LIBVCHAN_RATE_WRITE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&ctrl->mutex);
+    if (direction & LIBVCHAN_RATE_READ)
+        rate_set(&ctrl->read_rate, bytes_per_sec, ops_per_sec);
+    if (direction & LIBVCHAN_RATE_WRITE)
+        rate_set(&ctrl->write_rate, bytes_per_sec, ops_per_sec);
+    pthread_mutex_unlock(&ctrl->mutex);
+    // The I/O thread might be waiting for the old limit
+    return wake_thread(ctrl);
+}
+
+int libvchan_get_stats(libvchan_t *ctrl, struct libvchan_stats *stats) {
+    pthread_mutex_lock(&ctrl->mutex);
+    stats->bytes_read = ctrl->read_rate.total_bytes;
+    stats->bytes_written = ctrl->write_rate.total_bytes;
+    stats->reads = ctrl->read_rate.total_ops;
+    stats->writes = ctrl->write_rate.total_ops;
+    stats->read_throttled = ctrl->read_rate.throttled;
+    stats->write_throttled = ctrl->write_rate.throttled;
+    stats->read_bytes_per_sec = ctrl->read_rate.bytes_per_sec;
+    stats->read_ops_per_sec = ctrl->read_rate.ops_per_sec;
+    stats->write_bytes_per_sec = ctrl->write_rate.bytes_per_sec;
+    stats->write_ops_per_sec = ctrl->write_rate.ops_per_sec;
+    stats->numa_node = ring_node(&ctrl->read_ring);
+    stats->spilled_bytes = ctrl->spill.total;
+    stats->spill_pending = spill_pending(&ctrl->spill);
+    stats->spill_peak = ctrl->spill.peak;
+    pthread_mutex_unlock(&ctrl->mutex);
+    return 0;
+}
+
+/*
+ * Wait on many channels at once. With an I/O thread, the read/write event
+ * pipes already track the channel state, so only the channels that fired are
+ * locked and checked. Without one, each channel has to be processed first.
+ * The set can differ on every call, so this uses poll(): an epoll instance
+ * would have to be built and torn down each time.
+ */
+int libvchan_poll(struct libvchan_pollfd *fds, size_t nfds, int timeout) {
+    struct timespec deadline_buf;
+    struct timespec *deadline = get_deadline(timeout, &deadline_buf);
+
+    // Two entries per channel: read and write event pipe, or the socket
+    struct pollfd *pfds = calloc(nfds > 0 ? 2 * nfds : 1, sizeof(*pfds));
+    if (!pfds) {
+        perror("calloc");
+        return -1;
+    }
+
+    int ready;
+    for (;;) {
+        ready = 0;
+        for (size_t i = 0; i < nfds; i++) {
+            libvchan_t *ctrl = fds[i].ctrl;
+            struct pollfd *pfd = &pfds[2 * i];
+
+            fds[i].revents = 0;
+            pfd[0].fd = pfd[1].fd = -1;
+            pfd[0].events = pfd[1].events = POLLIN;
+            if (!ctrl->threadless) {
+                if (fds[i].events & LIBVCHAN_POLLIN)
+                    pfd[0].fd = ctrl->read_event_pipe[0];
+                if (fds[i].events & LIBVCHAN_POLLOUT)
+                    pfd[1].fd = ctrl->write_event_pipe[0];
+                // Both event pipes fire on hangup too; without them, still
+                // wait for it since LIBVCHAN_POLLHUP is always reported
+                if (pfd[0].fd < 0 && pfd[1].fd < 0)
+                    pfd[0].fd = ctrl->hup_event_pipe[0];
+                continue;
+            }
+
+            pthread_mutex_lock(&ctrl->mutex);
+            int events = libvchan__process(ctrl);
+            fds[i].revents = poll_revents(ctrl, fds[i].events);
+            if (events > 0) {
+                pfd[0].fd = libvchan_fd_for_select(ctrl);
+                pfd[0].events = events;
+            }
+            pthread_mutex_unlock(&ctrl->mutex);
+            if (events < 0) {
+                free(pfds);
+                return -1;
+            }
+            if (fds[i].revents)
+                ready++;
+        }
+
+        int ret = poll(pfds, 2 * nfds,
+                       ready > 0 ? 0 : poll_timeout(deadline));
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll channels");
+            free(pfds);
+            return -1;
+        }
+
+        for (size_t i = 0; i < nfds && ret > 0; i++) {
+            libvchan_t *ctrl = fds[i].ctrl;
+            struct pollfd *pfd = &pfds[2 * i];
+
+            if (!pfd[0].revents && !pfd[1].revents)
+                continue;
+            short old_revents = fds[i].revents;
+            pthread_mutex_lock(&ctrl->mutex);
+            if (ctrl->threadless && libvchan__process(ctrl) < 0) {
+                pthread_mutex_unlock(&ctrl->mutex);
+                free(pfds);
+                return -1;
+            }
+            fds[i].revents = poll_revents(ctrl, fds[i].events);
+            pthread_mutex_unlock(&ctrl->mutex);
+            if (!old_revents && fds[i].revents)
+                ready++;
+        }
+
+        if (ready > 0 || ret == 0)
+            break;
+    }
+
+    free(pfds);
+    return ready;
+}
+
+// Which of the requested events are ready. Called with mutex held.
+static short poll_revents(libvchan_t *ctrl, short events) {
+    bool closed = ctrl->state == VCHAN_DISCONNECTED;
+    size_t filled = ring_filled(&ctrl->read_ring);
+    short revents = 0;
+
+    if (events & LIBVCHAN_POLLIN &&
+        (filled >= ctrl->read_lowat || (closed && filled > 0)))
+        revents |= LIBVCHAN_POLLIN;
+    if (events & LIBVCHAN_POLLOUT && !closed &&
+        libvchan__write_space(ctrl) >= ctrl->write_lowat)
+        revents |= LIBVCHAN_POLLOUT;
+    if (closed)
+        revents |= LIBVCHAN_POLLHUP;
+    return revents;
+}
+
+// Deadline for a timeout in milliseconds, or NULL if there is none
+static struct timespec *get_deadline(int timeout, struct timespec *deadline) {
+    if (timeout < 0)
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+    return deadline;
+}
+
+// Time left until deadline in milliseconds (rounded up), for poll()
+static int poll_timeout(const struct timespec *deadline) {
+    if (!deadline)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long remaining = (deadline->tv_sec - now.tv_sec) * 1000000000LL +
+        (deadline->tv_nsec - now.tv_nsec);
+    return remaining > 0 ? (remaining + 999999) / 1000000 : 0;
+}
+
+int libvchan__drain_pipe(int fd) {
+    const int BUF_SIZE = 16;
+
+    uint8_t buf[BUF_SIZE];
+    int ret;
+    do {
+        ret = read(fd, buf, BUF_SIZE);
+    } while (ret == BUF_SIZE);
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("read drain_pipe");
+        return -1;
+    }
+    return 0;
+}
+
+static void set_event(int pipe_fds[2], bool *is_set, bool value) {
+    if (value && !*is_set) {
+        uint8_t byte = 0;
+        if (write(pipe_fds[1], &byte, 1) != 1) {
+            perror("write event pipe");
+            return;
+        }
+    } else if (!value && *is_set) {
+        if (libvchan__drain_pipe(pipe_fds[0]) < 0)
+            return;
+    }
+    *is_set = value;
+}
+
+/*
+ * Update the level-triggered read/write event pipes to match the ring state,
+ * and wake up threads blocked in read/write. Called with mutex held.
+ */
+void libvchan__update_events(libvchan_t *ctrl) {
+    bool closed = ctrl->state == VCHAN_DISCONNECTED;
+
+    set_event(ctrl->read_event_pipe, &ctrl->read_event_set,
+              closed || ring_filled(&ctrl->read_ring) >= ctrl->read_lowat);
+    set_event(ctrl->write_event_pipe, &ctrl->write_event_set,
+              closed || libvchan__write_space(ctrl) >= ctrl->write_lowat);
+    pthread_cond_broadcast(&ctrl->event_cond);
+}
+
+/*
+ * Check if the I/O thread should write out write_ring now. If not, and the
+ * data will become due after some time, set timeout to that; otherwise set
+ * timeout->tv_sec to -1. Called with mutex held.
+ */
+bool libvchan__flush_due(libvchan_t *ctrl, struct timespec *timeout) {
+    size_t filled = ring_filled(&ctrl->write_ring);
+
+    timeout->tv_sec = -1;
+    timeout->tv_nsec = 0;
+
+    if (filled == 0) {
+        ctrl->flush = false;
+        // Asynchronous writes are never held back
+        return ctrl->write_ops.head != NULL;
+    }
+    if (ctrl->flush || ctrl->shutdown || ctrl->write_ops.head)
+        return true;
+    if (!ctrl->corked && ctrl->flush_bytes == 0 && ctrl->flush_usec == 0)
+        return true;
+
+    if (ring_available(&ctrl->write_ring) == 0 ||
+        (ctrl->flush_bytes > 0 && filled >= ctrl->flush_bytes)) {
+        ctrl->flush = true;
+        return true;
+    }
+
+    if (ctrl->flush_usec > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long elapsed =
+            (now.tv_sec - ctrl->write_start.tv_sec) * 1000000LL +
+            (now.tv_nsec - ctrl->write_start.tv_nsec) / 1000;
+        if (elapsed >= ctrl->flush_usec) {
+            ctrl->flush = true;
+            return true;
+        }
+        long long remaining = ctrl->flush_usec - elapsed;
+        timeout->tv_sec = remaining / 1000000;
+        timeout->tv_nsec = (remaining % 1000000) * 1000;
+    }
+    return false;
+}
+
+static int wake_thread(libvchan_t *ctrl) {
+    if (ctrl->threadless) {
+        // Nobody to wake up, do the I/O right away instead
+        pthread_mutex_lock(&ctrl->mutex);
+        int result = libvchan__process(ctrl);
+        pthread_mutex_unlock(&ctrl->mutex);
+        return result < 0 ? -1 : 0;
+    }
+
+    // A full pipe will wake up the thread anyway (and a server waiting for
+    // a client has no thread to empty it yet)
+    uint8_t byte = 0;
+    if (write(ctrl->user_event_pipe[1], &byte, 1) != 1 && errno != EAGAIN) {
+        perror("write user pipe");
+        return -1;
+    }
+    return 0;
+}
+
+int libvchan_cork(libvchan_t *ctrl) {
+    pthread_mutex_lock(&ctrl->mutex);
+    ctrl->corked = true;
+    pthread_mutex_unlock(&ctrl->mutex);
+    return 0;
+}
+
+int libvchan_uncork(libvchan_t *ctrl) {
+    pthread_mutex_lock(&ctrl->mutex);
+    ctrl->corked = false;
+    if (ring_filled(&ctrl->write_ring) > 0)
+        ctrl->flush = true;
+    pthread_mutex_unlock(&ctrl->mutex);
+    return wake_thread(ctrl);
+}
+
+int libvchan_set_autoflush(libvchan_t *ctrl, size_t flush_bytes,
+                           unsigned int flush_usec) {
+    pthread_mutex_lock(&ctrl->mutex);
+    ctrl->flush_bytes = flush_bytes;
+    ctrl->flush_usec = flush_usec;
+    pthread_mutex_unlock(&ctrl->mutex);
+    return wake_thread(ctrl);
+}
+
+// Writes always go through write_ring here
+int libvchan_set_buffered_writes(__attribute__((unused)) libvchan_t *ctrl,
+                                 __attribute__((unused)) bool enable) {
+    return 0;
+}
+
+int libvchan_set_spill(libvchan_t *ctrl, size_t max_size) {
+    pthread_mutex_lock(&ctrl->mutex);
+    if (ctrl->multi_writer) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        errno = EINVAL;
+        return -1;
+    }
+    ctrl->spill.max = max_size;
+    pthread_mutex_unlock(&ctrl->mutex);
+    return 0;
+}
+
+int libvchan_data_ready(libvchan_t *ctrl) {
+    return int_size(libvchan_data_ready64(ctrl));
+}
+
+int libvchan_buffer_space(libvchan_t *ctrl) {
+    return int_size(libvchan_buffer_space64(ctrl));
+}
+
+int libvchan_find(libvchan_t *ctrl, uint8_t byte, size_t *offset) {
+    pthread_mutex_lock(&ctrl->mutex);
+    if (read_busy(ctrl)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+    if (ctrl->threadless && libvchan__process(ctrl) < 0) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+    size_t filled = read_available(ctrl, 0);
+    uint8_t *head = ring_head(&ctrl->read_ring);
+    uint8_t *found = filled > 0 ? find_byte(head, byte, filled) : NULL;
+    if (found)
+        *offset = found - head;
+    pthread_mutex_unlock(&ctrl->mutex);
+    return found != NULL;
+}
+
+/*
+ * Search only the data that arrived since the last check, and copy out
+ * nothing until the record is complete.
+ */
+int libvchan_read_until(libvchan_t *ctrl, void *data, size_t size,
+                        uint8_t delim) {
+    struct ring *ring = &ctrl->read_ring;
+    size_t limit = int_size(size);
+    if (limit > ring->size)
+        limit = ring->size;
+
+    struct timespec deadline_buf;
+    struct timespec *deadline = get_deadline(ctrl->timeout, &deadline_buf);
+
+    pthread_mutex_lock(&ctrl->mutex);
+    size_t start = ring->start;
+    size_t scanned = 0;
+    size_t count;
+    for (;;) {
+        if (read_busy(ctrl)) {
+            pthread_mutex_unlock(&ctrl->mutex);
+            return -1;
+        }
+        // Someone else read in the meantime?
+        if (ring->start != start) {
+            start = ring->start;
+            scanned = 0;
+        }
+        size_t filled = read_available(ctrl, 0);
+        if (filled > limit)
+            filled = limit;
+        if (filled > scanned) {
+            uint8_t *found = find_byte(ring_head(ring) + scanned, delim,
+                                       filled - scanned);
+            if (found) {
+                count = found - ring_head(ring) + 1;
+                break;
+            }
+            scanned = filled;
+        }
+        // Too long, or the last record without a delimiter
+        if (filled == limit || ctrl->state == VCHAN_DISCONNECTED) {
+            count = filled;
+            break;
+        }
+
+        int ret = wait_event(ctrl, deadline);
+        if (ret != 0) {
+            if (ret > 0)
+                errno = ctrl->timeout == 0 ? EAGAIN : ETIMEDOUT;
+            pthread_mutex_unlock(&ctrl->mutex);
+            return -1;
+        }
+    }
+
+    if (count == 0) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+    libvchan__drain_pipe(ctrl->socket_event_pipe[0]);
+    take_data(ctrl, &ctrl->main_stream, data, count);
+    pthread_mutex_unlock(&ctrl->mutex);
+
+    if (wake_thread(ctrl) < 0)
+        return -1;
+
+    return count;
+}
+
+int libvchan_forward(libvchan_t *from, libvchan_t *to, int flags) {
+    if ((flags & ~LIBVCHAN_FORWARD_BOTH) || from == to || from->threadless ||
+        (to && to->threadless)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bool both = flags & LIBVCHAN_FORWARD_BOTH;
+    if (!to) {
+        stop_forward(from, true, both);
+        return 0;
+    }
+
+    if (add_link(from, to) < 0)
+        return -1;
+    if (both && add_link(to, from) < 0) {
+        stop_forward(from, true, false);
+        return -1;
+    }
+    return 0;
+}
+
+static int add_link(libvchan_t *from, libvchan_t *to) {
+    struct libvchan_link *link = malloc(sizeof(*link));
+    if (!link) {
+        perror("malloc");
+        return -1;
+    }
+    pthread_mutex_init(&link->mutex, NULL);
+    link->from = from;
+    link->to = to;
+    link->refs = 2;
+
+    // Both at once, always in the same order, so that nobody sees a
+    // half-made link
+    libvchan_t *first = (uintptr_t)from < (uintptr_t)to ? from : to;
+    libvchan_t *second = first == from ? to : from;
+    pthread_mutex_lock(&first->mutex);
+    pthread_mutex_lock(&second->mutex);
+    bool busy = from->forward_out || to->forward_in ||
+        from->pump.out_fd >= 0 || from->read_ops.head;
+    if (!busy) {
+        from->forward_out = link;
+        to->forward_in = link;
+    }
+    pthread_mutex_unlock(&second->mutex);
+    pthread_mutex_unlock(&first->mutex);
+
+    if (busy) {
+        pthread_mutex_destroy(&link->mutex);
+        free(link);
+        errno = EBUSY;
+        return -1;
+    }
+
+    // Move anything that's already waiting
+    if (wake_thread(from) < 0 || wake_thread(to) < 0)
+        return -1;
+    return 0;
+}
+
+void libvchan__forward_stop(libvchan_t *ctrl) {
+    stop_forward(ctrl, true, true);
+}
+
+static void stop_forward(libvchan_t *ctrl, bool out, bool in) {
+    pthread_mutex_lock(&ctrl->mutex);
+    struct libvchan_link *links[2] = {
+        out ? get_link(ctrl->forward_out) : NULL,
+        in ? get_link(ctrl->forward_in) : NULL,
+    };
+    pthread_mutex_unlock(&ctrl->mutex);
+
+    for (size_t i = 0; i < 2; i++) {
+        if (links[i]) {
+            stop_link(links[i]);
+            put_link(links[i]);
+        }
+    }
+}
+
+// Called with a reference held
+static void stop_link(struct libvchan_link *link) {
+    pthread_mutex_lock(&link->mutex);
+    if (link->from) {
+        pthread_mutex_lock(&link->from->mutex);
+        link->from->forward_out = NULL;
+        pthread_mutex_unlock(&link->from->mutex);
+        pthread_mutex_lock(&link->to->mutex);
+        link->to->forward_in = NULL;
+        pthread_mutex_unlock(&link->to->mutex);
+        link->from = NULL;
+        link->to = NULL;
+        // Drop the channels' references
+        __atomic_sub_fetch(&link->refs, 2, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&link->mutex);
+}
+
+/*
+ * Run by the I/O thread, without mutex held: the source's thread moves data
+ * as it arrives, the destination's one as it frees up space.
+ */
+void libvchan__forward_step(libvchan_t *ctrl) {
+    pthread_mutex_lock(&ctrl->mutex);
+    struct libvchan_link *links[2] = {
+        get_link(ctrl->forward_out),
+        get_link(ctrl->forward_in),
+    };
+    pthread_mutex_unlock(&ctrl->mutex);
+
+    for (size_t i = 0; i < 2; i++) {
+        if (links[i]) {
+            forward_link(links[i]);
+            put_link(links[i]);
+        }
+    }
+}
+
+/*
+ * Move as much as fits from read_ring of the source to write_ring of the
+ * destination. Nothing else consumes the source's data, so it stays in place
+ * while we copy it without the source's mutex.
+ */
+static void forward_link(struct libvchan_link *link) {
+    pthread_mutex_lock(&link->mutex);
+    libvchan_t *from = link->from;
+    libvchan_t *to = link->to;
+    if (!from) {
+        pthread_mutex_unlock(&link->mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&from->mutex);
+    size_t size = read_available(from, 0);
+    const uint8_t *data = ring_head(&from->read_ring);
+    pthread_mutex_unlock(&from->mutex);
+
+    if (size > 0) {
+        pthread_mutex_lock(&to->mutex);
+        // Not in the middle of the other writers' claims
+        size_t space = to->write_claimed > 0 ||
+            to->state == VCHAN_DISCONNECTED ? 0 : libvchan__write_space(to);
+        if (size > space)
+            size = space;
+        if (size > 0 && ring_map(&to->write_ring) < 0)
+            size = 0;
+        if (size > 0) {
+            if (ring_filled(&to->write_ring) == 0)
+                clock_gettime(CLOCK_MONOTONIC, &to->write_start);
+            copy_data(ring_tail(&to->write_ring), data, size);
+            ring_advance_tail(&to->write_ring, size);
+            libvchan__update_events(to);
+        }
+        pthread_mutex_unlock(&to->mutex);
+    }
+
+    if (size > 0) {
+        pthread_mutex_lock(&from->mutex);
+        consume_data(from, &from->main_stream, size);
+        pthread_mutex_unlock(&from->mutex);
+        wake_thread(to);
+        wake_thread(from);
+    }
+    pthread_mutex_unlock(&link->mutex);
+}
+
+static struct libvchan_link *get_link(struct libvchan_link *link) {
+    if (link)
+        __atomic_add_fetch(&link->refs, 1, __ATOMIC_RELAXED);
+    return link;
+}
+
+static void put_link(struct libvchan_link *link) {
+    if (__atomic_sub_fetch(&link->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&link->mutex);
+        free(link);
+    }
+}
+
+int libvchan_pump(libvchan_t *ctrl, int in_fd, int out_fd, unsigned int flags) {
+    if ((flags & ~(LIBVCHAN_PUMP_HANGUP | LIBVCHAN_PUMP_THREAD)) ||
+        in_fd < 0 || out_fd < 0 || ctrl->threadless) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (set_nonblock(in_fd) < 0 || set_nonblock(out_fd) < 0)
+        return -1;
+
+    pthread_mutex_lock(&ctrl->mutex);
+    if (ctrl->pump.in_fd >= 0 || ctrl->pump.out_fd >= 0 || ctrl->forward_out ||
+        ctrl->read_ops.head) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    // Nobody would run it (see libvchan__pump_finish)
+    if ((flags & LIBVCHAN_PUMP_THREAD) && ctrl->state == VCHAN_DISCONNECTED) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        errno = ENOTCONN;
+        return -1;
+    }
+    memset(&ctrl->pump, 0, sizeof(ctrl->pump));
+    ctrl->pump.in_fd = in_fd;
+    ctrl->pump.out_fd = out_fd;
+    ctrl->pump.hangup = flags & LIBVCHAN_PUMP_HANGUP;
+    ctrl->pump.thread = flags & LIBVCHAN_PUMP_THREAD;
+    pthread_mutex_unlock(&ctrl->mutex);
+
+    if (flags & LIBVCHAN_PUMP_THREAD)
+        return wake_thread(ctrl);
+    return pump_loop(ctrl);
+}
+
+/*
+ * Run the pump on the caller's thread. Wait for the fd of each direction if
+ * it's blocked, otherwise for the ring (read_event_pipe and write_event_pipe
+ * are readable while there is data / space, or after disconnect).
+ */
+static int pump_loop(libvchan_t *ctrl) {
+    struct pollfd fds[2];
+    short in_revents = 0;
+    short out_revents = 0;
+    int ret = 0;
+    for (;;) {
+        pthread_mutex_lock(&ctrl->mutex);
+        bool moved = libvchan__pump_step(ctrl, in_revents, out_revents);
+        struct libvchan_pump *pump = &ctrl->pump;
+        bool in_blocked = pump->in_fd >= 0 && pump->in_blocked;
+        bool out_blocked = pump->out_fd >= 0 && pump->out_blocked;
+        fds[0].fd = pump->in_fd < 0 ? -1 :
+            in_blocked ? pump->in_fd : ctrl->write_event_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = pump->out_fd < 0 ? -1 :
+            out_blocked ? pump->out_fd : ctrl->read_event_pipe[0];
+        fds[1].events = out_blocked ? POLLOUT : POLLIN;
+        bool wake = moved || pump->disconnect;
+        bool done = pump->out_fd < 0;
+        pthread_mutex_unlock(&ctrl->mutex);
+
+        // Send what we got, read more once there is space
+        if (wake && wake_thread(ctrl) < 0) {
+            ret = -1;
+            break;
+        }
+        if (done)
+            break;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll pump");
+            ret = -1;
+            break;
+        }
+        in_revents = in_blocked ? fds[0].revents : 0;
+        out_revents = out_blocked ? fds[1].revents : 0;
+    }
+
+    pthread_mutex_lock(&ctrl->mutex);
+    libvchan__pump_stop(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+    return ret;
+}
+
+/*
+ * Move data between the pump's fds and the rings, as much as possible without
+ * blocking: read in_fd straight into write_ring, write out_fd straight from
+ * read_ring. revents of each fd mean it's worth trying again. Returns true
+ * if anything moved. Called with mutex held.
+ */
+bool libvchan__pump_step(libvchan_t *ctrl, short in_revents, short out_revents) {
+    struct libvchan_pump *pump = &ctrl->pump;
+    bool moved = false;
+    if (in_revents)
+        pump->in_blocked = false;
+    if (out_revents)
+        pump->out_blocked = false;
+
+    // Nowhere to send it anymore
+    if (pump->in_fd >= 0 && ctrl->state == VCHAN_DISCONNECTED)
+        pump_end(ctrl, &pump->in_fd, pump->out_fd, SHUT_RD);
+
+    while (pump->in_fd >= 0 && !pump->in_blocked) {
+        struct ring *ring = &ctrl->write_ring;
+        // Not in the middle of the other writers' claims
+        size_t space = ctrl->write_claimed > 0 ?
+            0 : libvchan__write_space(ctrl);
+        if (space == 0 || ring_map(ring) < 0)
+            break;
+        ssize_t count = read(pump->in_fd, ring_tail(ring), space);
+        if (count > 0) {
+            if (ring_filled(ring) == 0)
+                clock_gettime(CLOCK_MONOTONIC, &ctrl->write_start);
+            ring_advance_tail(ring, count);
+            libvchan__update_events(ctrl);
+            moved = true;
+        } else if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+            pump->in_blocked = errno == EAGAIN;
+        } else {
+            if (count < 0)
+                perror("read pump");
+            pump_end(ctrl, &pump->in_fd, pump->out_fd, SHUT_RD);
+            pump->disconnect = pump->hangup;
+        }
+    }
+
+    while (pump->out_fd >= 0 && !pump->out_blocked) {
+        size_t size = read_available(ctrl, 0);
+        if (size == 0) {
+            // Nothing more to come
+            if (ctrl->state == VCHAN_DISCONNECTED)
+                pump_end(ctrl, &pump->out_fd, pump->in_fd, SHUT_WR);
+            break;
+        }
+        ssize_t count = write(pump->out_fd, ring_head(&ctrl->read_ring), size);
+        if (count > 0) {
+            consume_data(ctrl, &ctrl->main_stream, count);
+            moved = true;
+        } else if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+            pump->out_blocked = errno == EAGAIN;
+        } else {
+            perror("write pump");
+            pump_end(ctrl, &pump->out_fd, pump->in_fd, SHUT_WR);
+        }
+    }
+    return moved;
+}
+
+// For the I/O thread. Called with mutex held.
+void libvchan__pump_events(libvchan_t *ctrl, struct pollfd *in_pfd,
+                           struct pollfd *out_pfd) {
+    struct libvchan_pump *pump = &ctrl->pump;
+    in_pfd->fd = -1;
+    in_pfd->events = POLLIN;
+    out_pfd->fd = -1;
+    out_pfd->events = POLLOUT;
+    if (!pump->thread)
+        return;
+    if (pump->in_blocked && libvchan__write_space(ctrl) > 0)
+        in_pfd->fd = pump->in_fd;
+    if (pump->out_blocked && ring_filled(&ctrl->read_ring) > 0)
+        out_pfd->fd = pump->out_fd;
+}
+
+/*
+ * The I/O thread is exiting after disconnect: write out what's left for
+ * out_fd first (unless the channel is being closed).
+ */
+void libvchan__pump_finish(libvchan_t *ctrl) {
+    struct pollfd fds[2];
+    fds[1].fd = ctrl->user_event_pipe[0];
+    fds[1].events = POLLIN;
+    short revents = 0;
+
+    pthread_mutex_lock(&ctrl->mutex);
+    while (ctrl->pump.thread && !ctrl->shutdown) {
+        libvchan__pump_step(ctrl, 0, revents);
+        if (ctrl->pump.out_fd < 0)
+            break;
+        fds[0].fd = ctrl->pump.out_fd;
+        fds[0].events = POLLOUT;
+        pthread_mutex_unlock(&ctrl->mutex);
+
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            perror("poll pump");
+            pthread_mutex_lock(&ctrl->mutex);
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            libvchan__drain_pipe(ctrl->user_event_pipe[0]);
+        revents = fds[0].revents;
+        pthread_mutex_lock(&ctrl->mutex);
+    }
+    libvchan__pump_stop(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+}
+
+/*
+ * Called with mutex held, or once there is no I/O thread. Closes the fds if
+ * they belong to the I/O thread.
+ */
+void libvchan__pump_stop(libvchan_t *ctrl) {
+    struct libvchan_pump *pump = &ctrl->pump;
+    if (pump->in_fd >= 0)
+        pump_end(ctrl, &pump->in_fd, -1, SHUT_RD);
+    if (pump->out_fd >= 0)
+        pump_end(ctrl, &pump->out_fd, -1, SHUT_WR);
+    pump->thread = false;
+    pump->disconnect = false;
+}
+
+/*
+ * One direction is done: the I/O thread closes its fd, so that the other side
+ * gets EOF, but only shuts down a socket that is still used the other way.
+ */
+static void pump_end(libvchan_t *ctrl, int *fd, int other_fd, int how) {
+    if (ctrl->pump.thread) {
+        if (*fd == other_fd) {
+            if (shutdown(*fd, how) && errno != ENOTSOCK)
+                perror("shutdown pump");
+        } else if (close(*fd)) {
+            perror("close pump");
+        }
+    }
+    *fd = -1;
+}
+
+static int set_nonblock(int fd) {
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        perror("fcntl pump");
+        return -1;
+    }
+    return 0;
+}
+
+size_t libvchan_data_ready64(libvchan_t *ctrl) {
+    pthread_mutex_lock(&ctrl->mutex);
+    if (ctrl->threadless)
+        libvchan__process(ctrl);
+    size_t result = ring_filled(&ctrl->read_ring);
+    pthread_mutex_unlock(&ctrl->mutex);
+    return result;
+}
+
+size_t libvchan_buffer_space64(libvchan_t *ctrl) {
+    pthread_mutex_lock(&ctrl->mutex);
+    size_t result = libvchan__write_space(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+    return result;
+}
+
+int libvchan_stream_data_ready(libvchan_t *ctrl, unsigned int stream) {
+    pthread_mutex_lock(&ctrl->mutex);
+    if (!check_stream(ctrl, stream)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+    if (ctrl->threadless)
+        libvchan__process(ctrl);
+    int result = int_size(ring_filled(ctrl->streams[stream]->read_ring));
+    pthread_mutex_unlock(&ctrl->mutex);
+    return result;
+}
+
+int libvchan_stream_buffer_space(libvchan_t *ctrl, unsigned int stream) {
+    pthread_mutex_lock(&ctrl->mutex);
+    if (!check_stream(ctrl, stream)) {
+        pthread_mutex_unlock(&ctrl->mutex);
+        return -1;
+    }
+    int result = int_size(libvchan__stream_space(ctrl, stream));
+    pthread_mutex_unlock(&ctrl->mutex);
+    return result;
+}
+
+int libvchan_set_read_lowat(libvchan_t *ctrl, size_t size) {
+    pthread_mutex_lock(&ctrl->mutex);
+    if (size < 1)
+        size = 1;
+    if (size > ctrl->read_ring.size)
+        size = ctrl->read_ring.size;
+    ctrl->read_lowat = size;
+    libvchan__update_events(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+    return 0;
+}
+
+int libvchan_set_write_lowat(libvchan_t *ctrl, size_t size) {
+    pthread_mutex_lock(&ctrl->mutex);
+    if (size < 1)
+        size = 1;
+    if (size > ctrl->write_ring.size)
+        size = ctrl->write_ring.size;
+    ctrl->write_lowat = size;
+    libvchan__update_events(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+    return 0;
 }
 
 int libvchan_is_open(libvchan_t *ctrl) {
@@ -0,0 +1,90 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+
+#include "iov.h"
+#include "copy.h"
+
+size_t iov_size(const struct iovec *iov, int iovcnt) {
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    return size;
+}
+
+/*
+ * Describe size bytes of iov, starting at skip, in dest (IOV_SLICE_MAX
+ * entries). Returns the number of entries, which might cover less than size
+ * bytes if there are too many.
+ */
+int iov_slice(struct iovec *dest, const struct iovec *iov, int iovcnt,
+              size_t skip, size_t size) {
+    int count = 0;
+    for (int i = 0; i < iovcnt && size > 0 && count < IOV_SLICE_MAX; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t len = iov[i].iov_len - skip;
+        if (len > size)
+            len = size;
+        dest[count].iov_base = (char *)iov[i].iov_base + skip;
+        dest[count].iov_len = len;
+        count++;
+        size -= len;
+        skip = 0;
+    }
+    return count;
+}
+
+/*
+ * How many entries of iov fit in size bytes as a whole. Sets whole_size to
+ * their total size.
+ */
+int iov_whole(const struct iovec *iov, int iovcnt, size_t size,
+              size_t *whole_size) {
+    int count = 0;
+    *whole_size = 0;
+    while (count < iovcnt && iov[count].iov_len <= size - *whole_size) {
+        *whole_size += iov[count].iov_len;
+        count++;
+    }
+    return count;
+}
+
+// Copy size bytes of iov, starting at skip, to dest
+void iov_gather(void *dest, const struct iovec *iov, int iovcnt,
+                size_t skip, size_t size) {
+    for (int i = 0; i < iovcnt && size > 0; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t len = iov[i].iov_len - skip;
+        if (len > size)
+            len = size;
+        copy_data(dest, (char *)iov[i].iov_base + skip, len);
+        dest = (char *)dest + len;
+        size -= len;
+        skip = 0;
+    }
+}
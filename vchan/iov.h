@@ -0,0 +1,39 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _IOV_H
+#define _IOV_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Most iovec entries passed to one writev()/sendmsg() (UIO_MAXIOV on Linux)
+#define IOV_SLICE_MAX 1024
+
+size_t iov_size(const struct iovec *iov, int iovcnt);
+int iov_slice(struct iovec *dest, const struct iovec *iov, int iovcnt,
+              size_t skip, size_t size);
+void iov_gather(void *dest, const struct iovec *iov, int iovcnt,
+                size_t skip, size_t size);
+int iov_whole(const struct iovec *iov, int iovcnt, size_t size,
+              size_t *whole_size);
+
+#endif
@@ -23,23 +23,114 @@
 #define _LIBVCHAN_PRIVATE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
 
 #include "libvchan.h"
 #include "ring.h"
+#include "rate.h"
+#include "iov.h"
+#include "copy.h"
+#include "find.h"
+#include "spill.h"
+
+// Asynchronous read or write (see libvchan_submit_read)
+struct libvchan_op {
+    struct libvchan_op *next;
+    uint8_t *data;
+    size_t size;
+    size_t done;
+    void *user_data;
+};
+
+struct libvchan_op_queue {
+    struct libvchan_op *head;
+    struct libvchan_op *tail;
+};
+
+/*
+ * Data moving from one channel to another (see libvchan_forward). Both point
+ * to it, and both I/O threads move the data, with mutex held (the channels'
+ * mutexes are taken one at a time, after it). from and to are NULL once
+ * forwarding stops. Freed when the last reference is dropped: one for each
+ * channel, and one for each forward step in progress.
+ */
+struct libvchan_link {
+    pthread_mutex_t mutex;
+    libvchan_t *from;
+    libvchan_t *to;
+    unsigned int refs;
+};
+
+// Bridging the channel to file descriptors (see libvchan_pump)
+struct libvchan_pump {
+    // Data from in_fd goes to write_ring, data from read_ring to out_fd; -1
+    // when not pumping, or when that direction is done
+    int in_fd;
+    int out_fd;
+    // The last read / write would block, wait for poll() first
+    bool in_blocked;
+    bool out_blocked;
+    // LIBVCHAN_PUMP_HANGUP, and EOF reached: disconnect once everything is
+    // sent
+    bool hangup;
+    bool disconnect;
+    // LIBVCHAN_PUMP_THREAD: the I/O thread runs it, and closes the fds
+    bool thread;
+};
+
+// A sub-stream of the channel (see libvchan_stream_open). Stream 0 is the
+// channel itself, and uses its rings.
+struct libvchan_stream {
+    struct ring *read_ring;
+    struct ring *write_ring;
+    // How much more data the peer can take
+    size_t credit;
+    // Data taken out of read_ring, not reported to the peer yet
+    size_t credit_owed;
+    // Streams with higher priority are sent first
+    int priority;
+    // Rings of the other streams
+    struct ring own_read_ring;
+    struct ring own_write_ring;
+};
 
 struct libvchan {
     char *socket_path;
     // server socket (for server), connection (for client)
     int socket_fd;
+    // connection being handled by the I/O thread, or -1
+    int conn_fd;
 
     // Controls access to rings and state
     pthread_mutex_t mutex;
 
     pthread_t thread;
 
-    // Thread started
+    // No I/O thread, the user calls libvchan_process() (LIBVCHAN_NO_THREAD)
+    bool threadless;
+
+    // I/O thread settings, applied once the thread is running (thread_tid
+    // is set)
+    char thread_name[16];
+    pid_t thread_tid;
+    int *thread_cpus;
+    size_t thread_ncpus;
+    bool thread_sched_set;
+    int thread_policy;
+    int thread_priority;
+
+    // Thread started, and its stack size (for libvchan_get_memory)
     volatile int thread_started;
+    size_t thread_stack_size;
+
+    // A server without a client yet: instead of its own I/O thread, the
+    // shared waiter (see init.c) watches its socket, and starts the thread
+    // once a client connects. Protected by the waiter's mutex.
+    bool waiting;
 
     // Thread exiting / exited
     volatile int shutdown;
@@ -54,17 +145,137 @@ struct libvchan {
     // status
     int socket_event_pipe[2];
 
+    // Level-triggered: readable as long as there is data to read / space to
+    // write (or the connection is closed)
+    int read_event_pipe[2];
+    int write_event_pipe[2];
+    bool read_event_set;
+    bool write_event_set;
+    // Readable once the connection is closed, for libvchan_poll() callers
+    // that only wait for LIBVCHAN_POLLHUP
+    int hup_event_pipe[2];
+
+    // Write coalescing (see libvchan_cork, libvchan_set_autoflush)
+    bool corked;
+    size_t flush_bytes;
+    unsigned int flush_usec;
+    // When the data was added to empty write_ring, for flush_usec
+    struct timespec write_start;
+    // Write out write_ring until empty, regardless of the above
+    bool flush;
+
+    // LIBVCHAN_MULTI_WRITER: space after the tail of write_ring claimed by
+    // writers copying their data, and how many are still copying. The last
+    // one to finish adds all of it to write_ring.
+    bool multi_writer;
+    size_t write_claimed;
+    unsigned int write_claims;
+
+    // Data written while write_ring was full (see libvchan_set_spill). It
+    // goes out before anything written after it.
+    struct spill spill;
+
+    // Signalled on any change in rings or state, for blocking read/write
+    pthread_cond_t event_cond;
+
     // volatile EVTCHN state;
     struct ring read_ring;
     struct ring write_ring;
+    // RING_* flags for these and the sub-streams' rings
+    int ring_flags;
+    // NUMA node for these and the sub-streams' rings, or -1
+    int numa_node;
+
+    // Forwarding our read_ring to another channel, and the other way
+    struct libvchan_link *forward_out;
+    struct libvchan_link *forward_in;
+    struct libvchan_pump pump;
+
+    // Low-water marks: notify only when that much data / space is available
+    size_t read_lowat;
+    size_t write_lowat;
+
+    // Timeout for blocking calls in milliseconds, -1 for none
+    // (see libvchan_set_timeout)
+    int timeout;
+
+    // Rate limits and counters for each direction (see
+    // libvchan_set_rate_limit, libvchan_get_stats)
+    struct rate_limit read_rate;
+    struct rate_limit write_rate;
+    // Without I/O thread: when libvchan__process() needs to run again even
+    // if there are no events, tv_sec is -1 if never
+    struct timespec process_timeout;
+
+    // Asynchronous reads and writes in progress, in submission order. These
+    // go before any data read or written synchronously.
+    struct libvchan_op_queue read_ops;
+    struct libvchan_op_queue write_ops;
+    // Finished ones, to be collected by libvchan_get_completions()
+    struct libvchan_op_queue done_ops;
+    // Level-triggered: readable as long as done_ops is not empty
+    int completion_pipe[2];
+    bool completion_event_set;
+
+    // Credit-based flow control (LIBVCHAN_CREDITS). The stream is split into
+    // frames, each starting with a 32-bit header: stream number, and either
+    // data length, or CREDIT_FRAME and the amount of space freed in the
+    // receiver's read_ring.
+    bool credits;
+    // Streams opened so far (streams[0] is main_stream), and how many
+    // besides stream 0
+    struct libvchan_stream *streams[LIBVCHAN_MAX_STREAMS];
+    struct libvchan_stream main_stream;
+    unsigned int nstreams;
+    // Credit received for streams we haven't opened yet
+    size_t unopened_credit[LIBVCHAN_MAX_STREAMS];
+    // Frame being sent: header bytes left, then data left (from write_ring
+    // of tx_stream)
+    uint32_t tx_header;
+    size_t tx_header_left;
+    size_t tx_frame_left;
+    unsigned int tx_stream;
+    // Frame being received: header bytes received, then data left (for
+    // rx_stream)
+    uint32_t rx_header;
+    size_t rx_header_got;
+    size_t rx_frame_left;
+    unsigned int rx_stream;
 
     // used for cleanup after libvchan_client_init_async()
     int connect_watch_fd;
 };
 
+#define CREDIT_FRAME (1U << 31)
+#define FRAME_STREAM_SHIFT 24
+#define FRAME_STREAM_MASK 0x7f
+#define FRAME_MAX ((1U << FRAME_STREAM_SHIFT) - 1)
+// Smaller frames while there are other streams, so that they don't wait long
+#define STREAM_FRAME_MAX 16384
+
 void *libvchan__server(void *arg);
 void *libvchan__client(void *arg);
+void libvchan__server_failed(libvchan_t *ctrl);
 int libvchan__drain_pipe(int fd);
+void libvchan__update_events(libvchan_t *ctrl);
+bool libvchan__flush_due(libvchan_t *ctrl, struct timespec *timeout);
+size_t libvchan__write_space(libvchan_t *ctrl);
+size_t libvchan__stream_space(libvchan_t *ctrl, unsigned int id);
+bool libvchan__write_pending(libvchan_t *ctrl);
+int libvchan__spill_drain(libvchan_t *ctrl);
+int libvchan__process(libvchan_t *ctrl);
+void libvchan__fill_read_ops(libvchan_t *ctrl);
+void libvchan__complete_op(libvchan_t *ctrl, struct libvchan_op_queue *queue);
+void libvchan__cancel_ops(libvchan_t *ctrl);
+void libvchan__thread_started(libvchan_t *ctrl);
+int libvchan__map_rings(libvchan_t *ctrl);
+void libvchan__forward_step(libvchan_t *ctrl);
+void libvchan__forward_stop(libvchan_t *ctrl);
+bool libvchan__pump_step(libvchan_t *ctrl, short in_revents, short out_revents);
+void libvchan__pump_events(libvchan_t *ctrl, struct pollfd *in_pfd,
+                           struct pollfd *out_pfd);
+void libvchan__pump_finish(libvchan_t *ctrl);
+void libvchan__pump_stop(libvchan_t *ctrl);
 int libvchan__listen(const char *socket_path);
 int libvchan__connect(const char *socket_path);
 
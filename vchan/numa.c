@@ -0,0 +1,117 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * NUMA placement without libnuma: the node layout comes from sysfs, and
+ * memory policy is set using the raw system calls.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "numa.h"
+
+#define NODE_DIR "/sys/devices/system/node"
+#define CPU_DIR "/sys/devices/system/cpu"
+
+// Nodes supported by numa_bind()
+#define MAX_NODES 1024
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+// Parse "node<N>", or return -1
+static int node_number(const char *name) {
+    if (strncmp(name, "node", 4) != 0 || name[4] < '0' || name[4] > '9')
+        return -1;
+    return atoi(name + 4);
+}
+
+// Number of nodes with memory (1 without NUMA support)
+int numa_nodes(void) {
+    DIR *dir = opendir(NODE_DIR);
+    if (!dir)
+        return 1;
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+        if (node_number(entry->d_name) >= 0)
+            count++;
+    closedir(dir);
+    return count > 0 ? count : 1;
+}
+
+int numa_has_node(int node) {
+    char path[64];
+    if (node < 0)
+        return 0;
+    snprintf(path, sizeof(path), NODE_DIR "/node%d", node);
+    // Without NUMA support, everything is on node 0
+    return access(path, F_OK) == 0 || (node == 0 && access(NODE_DIR, F_OK));
+}
+
+// Node of a CPU, or -1 if unknown
+int numa_cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), CPU_DIR "/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    int node = -1;
+    struct dirent *entry;
+    while (node < 0 && (entry = readdir(dir)))
+        node = node_number(entry->d_name);
+    closedir(dir);
+    return node;
+}
+
+// Allocate the pages of a mapping on the node from now on
+int numa_bind(void *addr, size_t size, int node) {
+    unsigned long mask[MAX_NODES / BITS_PER_LONG];
+
+    if (node < 0 || node >= MAX_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / BITS_PER_LONG] = 1UL << (node % BITS_PER_LONG);
+    if (syscall(SYS_mbind, addr, size, MPOL_BIND, mask, MAX_NODES + 1, 0)) {
+        perror("mbind");
+        return -1;
+    }
+    return 0;
+}
+
+// Node of the page at addr (faulting it in), or -1 if unknown
+int numa_addr_node(void *addr) {
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+                MPOL_F_NODE | MPOL_F_ADDR))
+        return -1;
+    return node;
+}
@@ -0,0 +1,91 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#include "rate.h"
+
+// How much the bucket can hold: 100 ms worth of transfers, so that a
+// limited channel can't send in bursts much bigger than its rate
+#define BURST_DIV 10
+
+static double burst(uint64_t per_sec) {
+    double size = (double)per_sec / BURST_DIV;
+    return size > 1 ? size : 1;
+}
+
+void rate_set(struct rate_limit *rate,
+              uint64_t bytes_per_sec, uint64_t ops_per_sec) {
+    rate->bytes_per_sec = bytes_per_sec;
+    rate->ops_per_sec = ops_per_sec;
+    rate->bytes = burst(bytes_per_sec);
+    rate->ops = burst(ops_per_sec);
+    clock_gettime(CLOCK_MONOTONIC, &rate->last);
+}
+
+static void refill(struct rate_limit *rate) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - rate->last.tv_sec) +
+        (now.tv_nsec - rate->last.tv_nsec) / 1e9;
+    rate->last = now;
+
+    if (rate->bytes_per_sec > 0) {
+        rate->bytes += elapsed * rate->bytes_per_sec;
+        if (rate->bytes > burst(rate->bytes_per_sec))
+            rate->bytes = burst(rate->bytes_per_sec);
+    }
+    if (rate->ops_per_sec > 0) {
+        rate->ops += elapsed * rate->ops_per_sec;
+        if (rate->ops > burst(rate->ops_per_sec))
+            rate->ops = burst(rate->ops_per_sec);
+    }
+}
+
+// Nanoseconds until the next transfer is allowed, 0 if it is now
+long long rate_delay(struct rate_limit *rate) {
+    if (!rate_limited(rate))
+        return 0;
+
+    refill(rate);
+    double wait = 0;
+    if (rate->bytes_per_sec > 0 && rate->bytes < 1)
+        wait = (1 - rate->bytes) / rate->bytes_per_sec;
+    if (rate->ops_per_sec > 0 && rate->ops < 1 &&
+        (1 - rate->ops) / rate->ops_per_sec > wait)
+        wait = (1 - rate->ops) / rate->ops_per_sec;
+    // Round up, so that we don't wake up too early
+    return wait > 0 ? (long long)(wait * 1e9) + 1 : 0;
+}
+
+// Limit the size of the next transfer to the available tokens
+size_t rate_allowance(struct rate_limit *rate, size_t size) {
+    if (rate->bytes_per_sec > 0 && size > rate->bytes)
+        size = rate->bytes >= 1 ? (size_t)rate->bytes : 0;
+    return size;
+}
+
+void rate_account(struct rate_limit *rate, size_t count) {
+    rate->total_bytes += count;
+    rate->total_ops++;
+    if (rate->bytes_per_sec > 0)
+        rate->bytes -= count;
+    if (rate->ops_per_sec > 0)
+        rate->ops--;
+}
@@ -0,0 +1,61 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+#ifndef _RATE_H
+#define _RATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Token bucket limiting the transfers in one direction (see
+ * libvchan_set_rate_limit), and the counters for libvchan_get_stats.
+ * Tokens can go below zero when a transfer overshoots; the next one then
+ * waits until they are paid back.
+ */
+struct rate_limit {
+    // Limits, 0 if unlimited
+    uint64_t bytes_per_sec;
+    uint64_t ops_per_sec;
+    // Tokens left, and when they were last refilled
+    double bytes;
+    double ops;
+    struct timespec last;
+
+    // Totals transferred, and how many times the limit held back I/O
+    uint64_t total_bytes;
+    uint64_t total_ops;
+    uint64_t throttled;
+};
+
+void rate_set(struct rate_limit *rate,
+              uint64_t bytes_per_sec, uint64_t ops_per_sec);
+long long rate_delay(struct rate_limit *rate);
+size_t rate_allowance(struct rate_limit *rate, size_t size);
+void rate_account(struct rate_limit *rate, size_t count);
+
+inline bool rate_limited(struct rate_limit *rate) {
+    return rate->bytes_per_sec > 0 || rate->ops_per_sec > 0;
+}
+
+#endif
@@ -26,16 +26,50 @@
 #include <unistd.h>
 
 #include "ring.h"
+#include "numa.h"
+
+// Rings mapped in this process, and their size (for libvchan_get_memory)
+static size_t mapped_count;
+static size_t mapped_bytes;
+
+/*
+ * Otherwise, the first pass over the ring takes a page fault on every page,
+ * twice (once in each mapping). Without MADV_POPULATE_WRITE (before Linux
+ * 5.14), write to every page instead: the ring is empty anyway.
+ */
+static void prefault(struct ring *ring) {
+    if (madvise(ring->data, 2 * ring->size, MADV_POPULATE_WRITE) == 0)
+        return;
+
+    size_t page_size = getpagesize();
+    for (size_t i = 0; i < 2 * ring->size; i += page_size)
+        ((volatile uint8_t *)ring->data)[i] = 0;
+}
 
 // https://lo.calho.st/posts/black-magic-buffer/
 
-int ring_init(struct ring *ring, size_t min_size) {
+int ring_init(struct ring *ring, size_t min_size, int flags, int node) {
     ring->size = getpagesize();
     while (ring->size < min_size)
         ring->size <<= 1;
 
     ring->start = 0;
     ring->count = 0;
+    ring->data = NULL;
+    ring->fd = -1;
+    ring->flags = flags;
+    ring->node = node;
+
+    if (flags & RING_LAZY)
+        return 0;
+    return ring_map(ring);
+}
+
+int ring_map(struct ring *ring) {
+    int flags = ring->flags;
+
+    if (ring->data)
+        return 0;
 
     ring->fd = memfd_create("ring_buffer", MFD_CLOEXEC);
     if (ring->fd < 0) {
@@ -68,6 +102,21 @@ int ring_init(struct ring *ring, size_t min_size) {
         goto fail_mmap;
     }
 
+    // Before any page is allocated. The policy belongs to the memfd, so it
+    // covers the second mapping as well.
+    if (ring->node >= 0 && numa_bind(ring->data, ring->size, ring->node))
+        goto fail_mmap;
+
+    if (flags & RING_PREFAULT)
+        prefault(ring);
+
+    if ((flags & RING_MLOCK) && mlock(ring->data, 2 * ring->size)) {
+        perror("mlock");
+        goto fail_mmap;
+    }
+
+    __atomic_add_fetch(&mapped_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mapped_bytes, ring->size, __ATOMIC_RELAXED);
     return 0;
 
   fail_mmap:
@@ -75,6 +124,7 @@ int ring_init(struct ring *ring, size_t min_size) {
     ring->data = NULL;
   fail_fd:
     close(ring->fd);
+    ring->fd = -1;
 
     return -1;
 }
@@ -85,5 +135,46 @@ void ring_destroy(struct ring *ring) {
         munmap(ring->data, ring->size * 2);
         ring->data = NULL;
         close(ring->fd);
+        __atomic_sub_fetch(&mapped_count, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&mapped_bytes, ring->size, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Allocate the pages on the node from now on. The pages of an empty ring
+ * are allocated anew right away; the ones holding data stay where they are.
+ * The caller has to make sure nobody is using the ring.
+ */
+int ring_set_node(struct ring *ring, int node) {
+    if (!ring->data || ring->count > 0) {
+        ring->node = node;
+        return 0;
     }
+
+    // Map the new buffer first, so that the ring stays usable if that fails
+    struct ring new_ring = *ring;
+    new_ring.data = NULL;
+    new_ring.node = node;
+    if (ring_map(&new_ring) < 0)
+        return -1;
+
+    struct ring old_ring = *ring;
+    ring->data = new_ring.data;
+    ring->fd = new_ring.fd;
+    ring->node = node;
+    ring->start = 0;
+    ring_destroy(&old_ring);
+    return 0;
+}
+
+// Node of the (first page of the) ring, or -1 if not allocated yet
+int ring_node(struct ring *ring) {
+    if (!ring->data)
+        return -1;
+    return numa_addr_node(ring->data);
+}
+
+void ring_usage(size_t *count, size_t *bytes) {
+    *count = __atomic_load_n(&mapped_count, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
 }
@@ -19,7 +19,9 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <stdio.h>
 #include <signal.h>
@@ -36,7 +38,18 @@
 
 static void run_server(libvchan_t *ctrl, int server_fd);
 static void comm_loop(libvchan_t *ctrl, int socket_fd);
+static short comm_events(libvchan_t *ctrl, struct timespec *timeout);
+static int comm_step(libvchan_t *ctrl, int socket_fd, short revents);
+static int credit_step(libvchan_t *ctrl, int socket_fd, short revents);
+static int credit_read(libvchan_t *ctrl, int socket_fd, bool *changed);
+static int credit_write(libvchan_t *ctrl, int socket_fd, bool *changed);
+static int next_stream(libvchan_t *ctrl, bool flush);
+static short throttle(struct rate_limit *rate, short events, short event,
+                      struct timespec *timeout);
+static int notify_socket_event(libvchan_t *ctrl);
 static void change_state(libvchan_t *ctrl, int state);
+static void set_state(libvchan_t *ctrl, int state);
+static void set_connection(libvchan_t *ctrl, int socket_fd);
 
 int libvchan__listen(const char *socket_path) {
     int server_fd;
@@ -79,10 +92,25 @@ void *libvchan__server(void *arg) {
     }
 
     libvchan_t *ctrl = arg;
+    libvchan__thread_started(ctrl);
     run_server(ctrl, ctrl->socket_fd);
+    libvchan__pump_finish(ctrl);
     return NULL;
 }
 
+/*
+ * A client connected, but the server's I/O thread couldn't be started: turn
+ * the client away, and report the channel as disconnected.
+ */
+void libvchan__server_failed(libvchan_t *ctrl) {
+    int socket_fd = accept4(ctrl->socket_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (socket_fd >= 0 && close(socket_fd))
+        perror("close socket");
+    pthread_mutex_lock(&ctrl->mutex);
+    set_state(ctrl, VCHAN_DISCONNECTED);
+    pthread_mutex_unlock(&ctrl->mutex);
+}
+
 void *libvchan__client(void *arg) {
     sigset_t set;
     sigfillset(&set);
@@ -92,8 +120,12 @@ void *libvchan__client(void *arg) {
     }
 
     libvchan_t *ctrl = arg;
+    libvchan__thread_started(ctrl);
+    set_connection(ctrl, ctrl->socket_fd);
     comm_loop(ctrl, ctrl->socket_fd);
+    set_connection(ctrl, -1);
     change_state(ctrl, VCHAN_DISCONNECTED);
+    libvchan__pump_finish(ctrl);
     return NULL;
 }
 
@@ -166,8 +198,19 @@ static void run_server(libvchan_t *ctrl, int server_fd) {
         return;
     }
 
+    pthread_mutex_lock(&ctrl->mutex);
+    int mapped = libvchan__map_rings(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+    if (mapped < 0) {
+        close(socket_fd);
+        change_state(ctrl, VCHAN_DISCONNECTED);
+        return;
+    }
+
+    set_connection(ctrl, socket_fd);
     change_state(ctrl, VCHAN_CONNECTED);
     comm_loop(ctrl, socket_fd);
+    set_connection(ctrl, -1);
     change_state(ctrl, VCHAN_DISCONNECTED);
 
     if (close(socket_fd)) {
@@ -176,22 +219,22 @@ static void run_server(libvchan_t *ctrl, int server_fd) {
 }
 
 static void comm_loop(libvchan_t *ctrl, int socket_fd) {
-    struct pollfd fds[2];
+    // The socket, user_event_pipe, and the fds of libvchan_pump()
+    struct pollfd fds[4];
     fds[0].fd = socket_fd;
     fds[1].fd = ctrl->user_event_pipe[0];
     fds[1].events = POLLIN;
     int done = 0;
     int shutdown = 0;
+    struct timespec timeout;
     while (!done) {
         pthread_mutex_lock(&ctrl->mutex);
-        fds[0].events = 0;
-        if (ring_available(&ctrl->read_ring) > 0)
-            fds[0].events |= POLLIN;
-        if (ring_filled(&ctrl->write_ring) > 0)
-            fds[0].events |= POLLOUT;
+        fds[0].events = comm_events(ctrl, &timeout);
+        libvchan__pump_events(ctrl, &fds[2], &fds[3]);
         pthread_mutex_unlock(&ctrl->mutex);
 
-        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+        if (ppoll(fds, 4, timeout.tv_sec >= 0 ? &timeout : NULL, NULL) < 0 &&
+            errno != EINTR) {
             perror("poll comm_loop");
             return;
         }
@@ -203,79 +246,516 @@ static void comm_loop(libvchan_t *ctrl, int socket_fd) {
             libvchan__drain_pipe(ctrl->user_event_pipe[0]);
         }
 
-        int notify = 0;
+        done = comm_step(ctrl, socket_fd, fds[0].revents);
+        if (done < 0 || libvchan__spill_drain(ctrl) < 0) {
+            pthread_mutex_unlock(&ctrl->mutex);
+            return;
+        }
+
+        if (ctrl->pump.thread)
+            libvchan__pump_step(ctrl, fds[2].revents, fds[3].revents);
 
-        // Read from socket into read_ring
-        if (fds[0].revents & POLLIN) {
-            int size = ring_available(&ctrl->read_ring);
-            if (size > 0) {
-                int count = read(
-                    socket_fd, ring_tail(&ctrl->read_ring), size);
-                if (count == 0) {
+        // When shutting down, attempt to flush all data first.
+        if ((shutdown || ctrl->pump.disconnect) &&
+            !libvchan__write_pending(ctrl)) {
+            done = 1;
+        }
+
+        pthread_mutex_unlock(&ctrl->mutex);
+
+        libvchan__forward_step(ctrl);
+    }
+}
+
+/*
+ * Poll events to wait for on the socket. If data will become due for sending
+ * after some time, or the rate limit will allow more I/O, set timeout to that
+ * (see libvchan__flush_due). Called with mutex held.
+ */
+static short comm_events(libvchan_t *ctrl, struct timespec *timeout) {
+    short events = 0;
+    bool flush = libvchan__flush_due(ctrl, timeout);
+
+    if (ctrl->credits) {
+        // Always read the frame headers, these might be credits
+        if (ctrl->rx_frame_left == 0 ||
+            ring_available(ctrl->streams[ctrl->rx_stream]->read_ring) > 0)
+            events |= POLLIN;
+        bool owed = false;
+        for (size_t i = 0; i < LIBVCHAN_MAX_STREAMS; i++)
+            if (ctrl->streams[i] && ctrl->streams[i]->credit_owed > 0)
+                owed = true;
+        if (ctrl->tx_header_left > 0 || ctrl->tx_frame_left > 0 || owed ||
+            next_stream(ctrl, flush) >= 0)
+            events |= POLLOUT;
+    } else {
+        if (ring_available(&ctrl->read_ring) > 0 || ctrl->read_ops.head)
+            events |= POLLIN;
+        if (flush)
+            events |= POLLOUT;
+    }
+
+    if (events & POLLIN)
+        events = throttle(&ctrl->read_rate, events, POLLIN, timeout);
+    if (events & POLLOUT)
+        events = throttle(&ctrl->write_rate, events, POLLOUT, timeout);
+    return events;
+}
+
+/*
+ * If the rate limit doesn't allow any I/O now, remove event from events,
+ * and shorten timeout to when it does.
+ */
+static short throttle(struct rate_limit *rate, short events, short event,
+                      struct timespec *timeout) {
+    long long delay = rate_delay(rate);
+    if (delay == 0)
+        return events;
+
+    rate->throttled++;
+    if (timeout->tv_sec < 0 ||
+        delay < timeout->tv_sec * 1000000000LL + timeout->tv_nsec) {
+        timeout->tv_sec = delay / 1000000000LL;
+        timeout->tv_nsec = delay % 1000000000LL;
+    }
+    return events & ~event;
+}
+
+/*
+ * Transfer data between socket and rings, according to revents. Returns 1 if
+ * the connection is closed, -1 on error. Called with mutex held.
+ */
+static int comm_step(libvchan_t *ctrl, int socket_fd, short revents) {
+    int done = 0;
+    int notify = 0;
+    int changed = 0;
+
+    if (ctrl->credits)
+        return credit_step(ctrl, socket_fd, revents);
+
+    // Read straight into the pending asynchronous reads first
+    while (revents & POLLIN && ctrl->read_ops.head &&
+           rate_delay(&ctrl->read_rate) == 0) {
+        struct libvchan_op *op = ctrl->read_ops.head;
+        ssize_t count = read(socket_fd, op->data + op->done,
+                         rate_allowance(&ctrl->read_rate,
+                                        op->size - op->done));
+        if (count == 0) {
+            done = 1;
+            break;
+        } else if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == ECONNRESET) {
+                done = 1;
+                break;
+            }
+            perror("read from socket");
+            return -1;
+        }
+        rate_account(&ctrl->read_rate, count);
+        op->done += count;
+        if (op->done < op->size)
+            break;
+        libvchan__complete_op(ctrl, &ctrl->read_ops);
+    }
+
+    // Read from socket into read_ring
+    if (revents & POLLIN && !done && !ctrl->read_ops.head &&
+        rate_delay(&ctrl->read_rate) == 0) {
+        size_t size = rate_allowance(&ctrl->read_rate,
+                                     ring_available(&ctrl->read_ring));
+        if (size > 0) {
+            ssize_t count = read(
+                socket_fd, ring_tail(&ctrl->read_ring), size);
+            if (count == 0) {
+                done = 1;
+            } else if (count < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    count = 0;
+                else if (errno == ECONNRESET) {
+                    count = 0;
                     done = 1;
-                } else if (count < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                        count = 0;
-                    else if (errno == ECONNRESET) {
-                        count = 0;
-                        done = 1;
-                    } else {
-                        perror("read from socket");
-                        pthread_mutex_unlock(&ctrl->mutex);
-                        return;
-                    }
-                } else
-                    notify = 1;
-                ring_advance_tail(&ctrl->read_ring, count);
+                } else {
+                    perror("read from socket");
+                    return -1;
+                }
+            }
+            ring_advance_tail(&ctrl->read_ring, count);
+            if (count > 0) {
+                rate_account(&ctrl->read_rate, count);
+                changed = 1;
             }
+            if (count > 0 &&
+                ring_filled(&ctrl->read_ring) >= ctrl->read_lowat)
+                notify = 1;
         }
+    }
 
-        if (fds[0].revents & POLLOUT) {
-            // Write from write_ring into socket
-            int size = ring_filled(&ctrl->write_ring);
-            if (size > 0) {
-                int count = write(
-                    socket_fd, ring_head(&ctrl->write_ring), size);
-                if (count < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                        count = 0;
-                    else if (errno == EPIPE) {
-                        count = 0;
-                        done = 1;
-                    } else {
-                        perror("write to socket");
-                        pthread_mutex_unlock(&ctrl->mutex);
-                        return;
-                    }
-                } else if (count > 0)
-                    notify = 1;
-                ring_advance_head(&ctrl->write_ring, count);
+    if (revents & POLLOUT && rate_delay(&ctrl->write_rate) == 0) {
+        // Write from write_ring into socket
+        size_t size = rate_allowance(&ctrl->write_rate,
+                                     ring_filled(&ctrl->write_ring));
+        if (size > 0) {
+            ssize_t count = send(
+                socket_fd, ring_head(&ctrl->write_ring), size, MSG_NOSIGNAL);
+            if (count < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    count = 0;
+                else if (errno == EPIPE) {
+                    count = 0;
+                    done = 1;
+                } else {
+                    perror("write to socket");
+                    return -1;
+                }
             }
+            ring_advance_head(&ctrl->write_ring, count);
+            if (count > 0) {
+                rate_account(&ctrl->write_rate, count);
+                changed = 1;
+            }
+            if (count > 0 &&
+                ring_available(&ctrl->write_ring) >= ctrl->write_lowat)
+                notify = 1;
         }
+    }
 
-        if (notify) {
-            uint8_t byte = 0;
-            if (write(ctrl->socket_event_pipe[1], &byte, 1) != 1) {
-                perror("write");
-                pthread_mutex_unlock(&ctrl->mutex);
-                return;
+    // Then the asynchronous writes, straight from the caller's buffers
+    while (revents & POLLOUT && !done && ctrl->write_ops.head &&
+           ring_filled(&ctrl->write_ring) == 0 &&
+           rate_delay(&ctrl->write_rate) == 0) {
+        struct libvchan_op *op = ctrl->write_ops.head;
+        ssize_t count = send(socket_fd, op->data + op->done,
+                         rate_allowance(&ctrl->write_rate,
+                                        op->size - op->done),
+                         MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EPIPE) {
+                done = 1;
+                break;
             }
+            perror("write to socket");
+            return -1;
         }
+        rate_account(&ctrl->write_rate, count);
+        op->done += count;
+        if (op->done < op->size)
+            break;
+        libvchan__complete_op(ctrl, &ctrl->write_ops);
+    }
 
-        // When shutting down, attempt to flush all data first.
-        if (shutdown && ring_filled(&ctrl->write_ring) == 0) {
-            done = 1;
+    if (changed)
+        libvchan__update_events(ctrl);
+
+    if (notify && notify_socket_event(ctrl) < 0)
+        return -1;
+
+    return done;
+}
+
+// Like comm_step(), but with LIBVCHAN_CREDITS
+static int credit_step(libvchan_t *ctrl, int socket_fd, short revents) {
+    int done = 0;
+    bool changed = false;
+
+    if (revents & POLLIN)
+        done = credit_read(ctrl, socket_fd, &changed);
+    if (done == 0 && revents & POLLOUT)
+        done = credit_write(ctrl, socket_fd, &changed);
+    if (done < 0)
+        return -1;
+
+    if (changed) {
+        libvchan__update_events(ctrl);
+        if (notify_socket_event(ctrl) < 0)
+            return -1;
+    }
+    return done;
+}
+
+/*
+ * Receive frames: data goes to the stream's read_ring, credits allow us to
+ * send more. Returns 1 if the connection is closed, -1 on error.
+ */
+static int credit_read(libvchan_t *ctrl, int socket_fd, bool *changed) {
+    for (;;) {
+        struct ring *ring = ctrl->streams[ctrl->rx_stream]->read_ring;
+        ssize_t count;
+        if (rate_delay(&ctrl->read_rate) > 0)
+            return 0;
+        if (ctrl->rx_frame_left == 0) {
+            count = read(socket_fd,
+                         (uint8_t *)&ctrl->rx_header + ctrl->rx_header_got,
+                         sizeof(ctrl->rx_header) - ctrl->rx_header_got);
+        } else {
+            size_t size = rate_allowance(&ctrl->read_rate,
+                                         ring_available(ring));
+            if (size > ctrl->rx_frame_left)
+                size = ctrl->rx_frame_left;
+            if (size == 0)
+                return 0;
+            count = read(socket_fd, ring_tail(ring), size);
         }
+        if (count == 0)
+            return 1;
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == ECONNRESET)
+                return 1;
+            perror("read from socket");
+            return -1;
+        }
+        rate_account(&ctrl->read_rate, count);
 
-        pthread_mutex_unlock(&ctrl->mutex);
+        if (ctrl->rx_frame_left > 0) {
+            ring_advance_tail(ring, count);
+            ctrl->rx_frame_left -= count;
+            *changed = true;
+            continue;
+        }
+
+        ctrl->rx_header_got += count;
+        if (ctrl->rx_header_got < sizeof(ctrl->rx_header))
+            continue;
+        ctrl->rx_header_got = 0;
+        unsigned int id = (ctrl->rx_header >> FRAME_STREAM_SHIFT) &
+            FRAME_STREAM_MASK;
+        size_t size = ctrl->rx_header & FRAME_MAX;
+        if (id >= LIBVCHAN_MAX_STREAMS) {
+            fprintf(stderr, "frame for invalid stream %u\n", id);
+            return -1;
+        }
+        if (ctrl->rx_header & CREDIT_FRAME) {
+            // The peer might open a stream before we do
+            if (ctrl->streams[id])
+                ctrl->streams[id]->credit += size;
+            else
+                ctrl->unopened_credit[id] += size;
+            *changed = true;
+        } else {
+            // Can't happen before we give credit for the stream
+            if (!ctrl->streams[id]) {
+                fprintf(stderr, "data for stream %u not opened\n", id);
+                return -1;
+            }
+            ctrl->rx_stream = id;
+            ctrl->rx_frame_left = size;
+        }
     }
 }
 
+/*
+ * Choose the stream to send data from next: the one with highest priority,
+ * and among these, the first after the last one sent. Stream 0 obeys
+ * cork/autoflush, the others are sent right away. Returns -1 if there is
+ * nothing to send. Called with mutex held.
+ */
+static int next_stream(libvchan_t *ctrl, bool flush) {
+    int best = -1;
+    for (unsigned int i = 1; i <= LIBVCHAN_MAX_STREAMS; i++) {
+        unsigned int id = (ctrl->tx_stream + i) % LIBVCHAN_MAX_STREAMS;
+        struct libvchan_stream *stream = ctrl->streams[id];
+        if (!stream || stream->credit == 0 ||
+            ring_filled(stream->write_ring) == 0 || (id == 0 && !flush))
+            continue;
+        if (best < 0 || stream->priority > ctrl->streams[best]->priority)
+            best = id;
+    }
+    return best;
+}
+
+/*
+ * Send frames: credits for the data taken out of read rings first, then data
+ * from write rings (see next_stream()), as much as the peer can take. The
+ * header and data go out in one sendmsg(). Returns 1 if the connection is
+ * closed, -1 on error.
+ */
+static int credit_write(libvchan_t *ctrl, int socket_fd, bool *changed) {
+    struct timespec timeout;
+
+    for (;;) {
+        if (rate_delay(&ctrl->write_rate) > 0)
+            return 0;
+        if (ctrl->tx_header_left == 0 && ctrl->tx_frame_left == 0) {
+            struct libvchan_stream *stream = NULL;
+            unsigned int id;
+            for (id = 0; id < LIBVCHAN_MAX_STREAMS; id++) {
+                stream = ctrl->streams[id];
+                if (stream && stream->credit_owed > 0)
+                    break;
+            }
+            if (id < LIBVCHAN_MAX_STREAMS) {
+                size_t size = stream->credit_owed;
+                if (size > FRAME_MAX)
+                    size = FRAME_MAX;
+                ctrl->tx_header = CREDIT_FRAME |
+                    (id << FRAME_STREAM_SHIFT) | size;
+                stream->credit_owed -= size;
+            } else {
+                int next = next_stream(ctrl,
+                                       libvchan__flush_due(ctrl, &timeout));
+                if (next < 0)
+                    return 0;
+                stream = ctrl->streams[next];
+                size_t size = ring_filled(stream->write_ring);
+                if (size > stream->credit)
+                    size = stream->credit;
+                if (size > FRAME_MAX)
+                    size = FRAME_MAX;
+                if (ctrl->nstreams > 0 && size > STREAM_FRAME_MAX)
+                    size = STREAM_FRAME_MAX;
+                ctrl->tx_stream = next;
+                ctrl->tx_header = ((uint32_t)next << FRAME_STREAM_SHIFT) | size;
+                ctrl->tx_frame_left = size;
+                stream->credit -= size;
+            }
+            ctrl->tx_header_left = sizeof(ctrl->tx_header);
+        }
+
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if (ctrl->tx_header_left > 0) {
+            iov[msg.msg_iovlen].iov_base = (uint8_t *)&ctrl->tx_header +
+                sizeof(ctrl->tx_header) - ctrl->tx_header_left;
+            iov[msg.msg_iovlen].iov_len = ctrl->tx_header_left;
+            msg.msg_iovlen++;
+        }
+        if (ctrl->tx_frame_left > 0) {
+            iov[msg.msg_iovlen].iov_base =
+                ring_head(ctrl->streams[ctrl->tx_stream]->write_ring);
+            iov[msg.msg_iovlen].iov_len =
+                rate_allowance(&ctrl->write_rate, ctrl->tx_frame_left);
+            msg.msg_iovlen++;
+        }
+
+        ssize_t count = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return 1;
+            perror("write to socket");
+            return -1;
+        }
+        rate_account(&ctrl->write_rate, count);
+
+        size_t header = (size_t)count < ctrl->tx_header_left ?
+            (size_t)count : ctrl->tx_header_left;
+        ctrl->tx_header_left -= header;
+        count -= header;
+        if (count > 0) {
+            ring_advance_head(ctrl->streams[ctrl->tx_stream]->write_ring,
+                              count);
+            ctrl->tx_frame_left -= count;
+            *changed = true;
+        }
+        if (ctrl->tx_header_left > 0 || ctrl->tx_frame_left > 0)
+            return 0;
+    }
+}
+
+// Nobody listens on the pipe without I/O thread
+static int notify_socket_event(libvchan_t *ctrl) {
+    if (ctrl->threadless)
+        return 0;
+
+    // Only readers and libvchan_wait() empty the pipe, so it fills up on a
+    // channel that only writes. A full pipe is still readable, so that's fine.
+    uint8_t byte = 0;
+    if (write(ctrl->socket_event_pipe[1], &byte, 1) != 1 && errno != EAGAIN) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Without I/O thread: accept a connection, or transfer data, whatever is
+ * possible without blocking. Returns poll events to wait for on
+ * libvchan_fd_for_select(), or -1 on error. Called with mutex held.
+ */
+int libvchan__process(libvchan_t *ctrl) {
+    struct timespec timeout;
+
+    ctrl->process_timeout.tv_sec = -1;
+
+    if (ctrl->state == VCHAN_WAITING) {
+        int socket_fd = accept4(ctrl->socket_fd, NULL, NULL,
+                                SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (socket_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return POLLIN;
+            perror("accept");
+            return -1;
+        }
+        if (libvchan__map_rings(ctrl) < 0) {
+            close(socket_fd);
+            return -1;
+        }
+        ctrl->conn_fd = socket_fd;
+        set_state(ctrl, VCHAN_CONNECTED);
+    }
+
+    if (ctrl->state != VCHAN_CONNECTED)
+        return 0;
+
+    short revents = POLLIN | (comm_events(ctrl, &timeout) & POLLOUT);
+    int done = comm_step(ctrl, ctrl->conn_fd, revents);
+    if (done < 0 || libvchan__spill_drain(ctrl) < 0)
+        return -1;
+    if (done) {
+        // The client keeps its socket until libvchan_close()
+        if (ctrl->conn_fd != ctrl->socket_fd && close(ctrl->conn_fd))
+            perror("close socket");
+        ctrl->conn_fd = -1;
+        set_state(ctrl, VCHAN_DISCONNECTED);
+        return 0;
+    }
+
+    short events = comm_events(ctrl, &timeout);
+    ctrl->process_timeout = timeout;
+    return events;
+}
+
+int libvchan_process(libvchan_t *ctrl) {
+    pthread_mutex_lock(&ctrl->mutex);
+    int result = libvchan__process(ctrl);
+    pthread_mutex_unlock(&ctrl->mutex);
+    return result;
+}
+
 void change_state(libvchan_t *ctrl, int state) {
     pthread_mutex_lock(&ctrl->mutex);
-    ctrl->state = state;
+    set_state(ctrl, state);
+    pthread_mutex_unlock(&ctrl->mutex);
+}
+
+// Called with mutex held
+static void set_state(libvchan_t *ctrl, int state) {
     uint8_t byte = 0;
-    if (write(ctrl->socket_event_pipe[1], &byte, 1) != 1)
+
+    ctrl->state = state;
+    if (state == VCHAN_DISCONNECTED) {
+        libvchan__cancel_ops(ctrl);
+        if (write(ctrl->hup_event_pipe[1], &byte, 1) != 1)
+            perror("write");
+    }
+    libvchan__update_events(ctrl);
+    if (ctrl->threadless)
+        return;
+    if (write(ctrl->socket_event_pipe[1], &byte, 1) != 1 && errno != EAGAIN)
         perror("write");
+}
+
+// Publish the connection, so that user threads can write to it directly
+void set_connection(libvchan_t *ctrl, int socket_fd) {
+    pthread_mutex_lock(&ctrl->mutex);
+    ctrl->conn_fd = socket_fd;
     pthread_mutex_unlock(&ctrl->mutex);
 }
@@ -0,0 +1,123 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * Copyright (C) 2020  Paweł Marczewski  <pawel@invisiblethingslab.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "spill.h"
+#include "iov.h"
+
+// Give memory back to the system in chunks at least this large
+#define SPILL_PUNCH_MIN (1024 * 1024)
+
+void spill_init(struct spill *spill) {
+    spill->fd = -1;
+    spill->head = 0;
+    spill->tail = 0;
+    spill->max = 0;
+    spill->total = 0;
+    spill->peak = 0;
+}
+
+size_t spill_space(struct spill *spill) {
+    size_t pending = spill_pending(spill);
+    return pending < spill->max ? spill->max - pending : 0;
+}
+
+/*
+ * Append size bytes of iov (after skip) at tail. The caller checks
+ * spill_space first.
+ */
+int spill_write(struct spill *spill, const struct iovec *iov, int iovcnt,
+                size_t skip, size_t size) {
+    if (spill->fd < 0) {
+        spill->fd = memfd_create("vchan-spill", MFD_CLOEXEC);
+        if (spill->fd < 0) {
+            perror("memfd_create");
+            return -1;
+        }
+    }
+
+    while (size > 0) {
+        struct iovec slice[IOV_SLICE_MAX];
+        int count = iov_slice(slice, iov, iovcnt, skip, size);
+        ssize_t ret = pwritev(spill->fd, slice, count, spill->tail);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pwritev spill");
+            return -1;
+        }
+        spill->tail += ret;
+        spill->total += ret;
+        skip += ret;
+        size -= ret;
+    }
+    if (spill_pending(spill) > spill->peak)
+        spill->peak = spill_pending(spill);
+    return 0;
+}
+
+/*
+ * Take size bytes from head into dest. The space already taken is released
+ * as it goes, and the file is truncated once it's empty.
+ */
+int spill_read(struct spill *spill, void *dest, size_t size) {
+    uint64_t old_head = spill->head;
+    while (size > 0) {
+        ssize_t ret = pread(spill->fd, dest, size, spill->head);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            perror("pread spill");
+            return -1;
+        }
+        spill->head += ret;
+        dest = (uint8_t *)dest + ret;
+        size -= ret;
+    }
+
+    if (spill->head == spill->tail) {
+        if (ftruncate(spill->fd, 0))
+            perror("ftruncate spill");
+        spill->head = spill->tail = 0;
+    } else if (spill->head / SPILL_PUNCH_MIN > old_head / SPILL_PUNCH_MIN) {
+        // Not fatal: the memory is released at the latest when emptied
+        off_t end = spill->head / SPILL_PUNCH_MIN * SPILL_PUNCH_MIN;
+        if (fallocate(spill->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      0, end))
+            perror("fallocate spill");
+    }
+    return 0;
+}
+
+void spill_destroy(struct spill *spill) {
+    if (spill->fd >= 0 && close(spill->fd))
+        perror("close spill");
+    spill->fd = -1;
+    spill->head = spill->tail = 0;
+}